@@ -0,0 +1,557 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include "../lib/docopt.cpp/docopt.h"
+#include "../src/util.hpp"
+#include "../src/canny.hpp"
+#include "../src/incremental.hpp"
+#include "../src/convolution.hpp"
+#include "../src/two_pass.hpp"
+#include "../src/morphology.hpp"
+#include "../src/batch.hpp"
+#include "../src/composer.hpp"
+
+using namespace cv;
+
+std::string doc =
+R"(Usage: composer_bench [--sizes=<list>] [--filter=<text>] [--repeat=<n>]
+                      [--threads=<n>] [--save=<path>] [--compare=<path>]
+                      [--tolerance=<percent>]
+       composer_bench --scaling [--width=<w>] [--height=<h>]
+                      [--max-threads=<n>] [--repeat=<n>]
+       composer_bench --help
+
+Times every algorithm, the stages of the edge detector and chains of
+algorithms on synthetic frames, reporting the median and 99th percentile
+time, megapixels per second and Mat allocations per run. A run can be saved
+as a baseline and later runs compared against it, any case slower than the
+baseline by more than the tolerance is a regression and fails the run.
+
+With --scaling, runs the strip-parallel Canny edge detector on one frame
+with 1 to N threads, and checks that every thread count finds the same
+edges as one.
+
+Options:
+  --sizes=<list>         Comma separated frame sizes out of vga, 720p, 1080p,
+                         4k and 8k, or WxH [default: vga,720p,1080p,4k,8k].
+  --filter=<text>        Only run cases whose name contains text.
+  --repeat=<n>           Timed runs per case [default: 10].
+  --threads=<n>          Threads for the algorithms that take a pool
+                         [default: 1].
+  --save=<path>          Write the results as a JSON baseline.
+  --compare=<path>       Compare the results with a saved baseline.
+  --tolerance=<percent>  Slowdown of the median allowed before a case is a
+                         regression [default: 10].
+  --scaling              Measure how Canny scales with threads.
+  --width=<w>            Frame width [default: 1920].
+  --height=<h>           Frame height [default: 1080].
+  --max-threads=<n>      Largest thread count, 0 for every core [default: 0].
+  -h --help              Show this message.
+)";
+
+/* deterministic test frame: smooth gradients, shapes and noise */
+Mat synthetic_image(Size size, uint64 seed=0x5eed)
+{
+    Mat image(size, CV_8UC3);
+    for (int r = 0; r < size.height; r++) {
+        Vec3b* row = image.ptr<Vec3b>(r);
+        for (int c = 0; c < size.width; c++) {
+            row[c] = Vec3b(c * 255 / size.width, r * 255 / size.height,
+                           (r + c) % 256);
+        }
+    }
+
+    RNG rng(seed);
+    int shapes = size.area() / 20000 + 8;
+    for (int i = 0; i < shapes; i++) {
+        Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+        Scalar color(rng.uniform(0, 256), rng.uniform(0, 256),
+                     rng.uniform(0, 256));
+        int extent = rng.uniform(4, std::max(5, size.width / 8));
+        if (i % 2) {
+            circle(image, center, extent, color, -1);
+        } else {
+            line(image, center, Point(center.x + extent, center.y + extent / 2),
+                 color, 2);
+        }
+    }
+
+    Mat noise(size, CV_8UC3);
+    rng.fill(noise, RNG::UNIFORM, 0, 16);
+    image += noise;
+    return image;
+}
+
+/* median of the run times in milliseconds */
+double median_ms(std::vector<double> times)
+{
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+/* time below which 99% of the runs finished */
+double p99_ms(std::vector<double> times)
+{
+    std::sort(times.begin(), times.end());
+    size_t i = (size_t)std::ceil(times.size() * 0.99);
+    return times[std::min(std::max<size_t>(i, 1), times.size()) - 1];
+}
+
+/* a frame size given by name or as WxH, an empty size if unknown */
+Size parse_size(const std::string& name)
+{
+    if (name == "vga") return Size(640, 480);
+    if (name == "720p") return Size(1280, 720);
+    if (name == "1080p") return Size(1920, 1080);
+    if (name == "4k") return Size(3840, 2160);
+    if (name == "8k") return Size(7680, 4320);
+    int w = 0, h = 0;
+    char x = 0;
+    std::istringstream in(name);
+    if (in >> w >> x >> h && x == 'x' && w > 0 && h > 0) {
+        return Size(w, h);
+    }
+    return Size();
+}
+
+std::vector<std::string> split(const std::string& list, char separator)
+{
+    std::vector<std::string> items;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, separator)) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+/* something to time on a frame
+ * prepare runs before every run without being timed, for stages that
+ * modify their input */
+struct Case {
+    std::string name;
+    std::function<void()> run;
+    std::function<void()> prepare;
+};
+
+struct Result {
+    std::string name;
+    std::string size;
+    double median_ms = 0;
+    double p99_ms = 0;
+    double mps = 0;
+    double allocs = 0;
+};
+
+/* time a case, after one untimed run to fill caches and workspaces */
+Result measure(const Case& c, const std::string& size_name, Size size,
+               int repeat, CountingAllocator& allocator)
+{
+    if (c.prepare) {
+        c.prepare();
+    }
+    c.run();
+
+    std::vector<double> times;
+    long allocations = 0;
+    for (int i = 0; i < repeat; i++) {
+        if (c.prepare) {
+            c.prepare();
+        }
+        long before = allocator.count;
+        int64 start = getTickCount();
+        c.run();
+        times.push_back((getTickCount() - start) * 1000.0 / getTickFrequency());
+        allocations += allocator.count - before;
+    }
+
+    Result r;
+    r.name = c.name;
+    r.size = size_name;
+    r.median_ms = median_ms(times);
+    r.p99_ms = p99_ms(times);
+    r.mps = size.area() / 1e3 / r.median_ms;
+    r.allocs = (double)allocations / repeat;
+    return r;
+}
+
+/* parse a chain of algorithms like composer does, such as
+ * {"convolution", "--gaussian=1.5", "canny"}, each with the thread count */
+AlgorithmChain make_chain(std::vector<std::string> argv, int threads)
+{
+    std::map<std::string, docopt::value> main_args = {
+        {"--show-intermediates", docopt::value(false)},
+        {"--no-interm-gui", docopt::value(false)}
+    };
+    AlgorithmChain chain;
+    while (!argv.empty()) {
+        std::vector<std::string> args(argv.begin() + 1, argv.end());
+        args.insert(args.begin(), "--threads=" + std::to_string(threads));
+        chain.push_back(make_algorithm(argv[0]));
+        auto next = chain.back()->parse_arguments(main_args, args);
+
+        argv.clear();
+        if (next["<algorithm>"].isString()) {
+            argv.push_back(next["<algorithm>"].asString());
+        }
+        if (!argv.empty() && next["<args>"].isStringList()) {
+            auto more = next["<args>"].asStringList();
+            argv.insert(argv.end(), more.begin(), more.end());
+        }
+    }
+    return chain;
+}
+
+void run_chain(const AlgorithmChain& chain, ChainInputs& inputs,
+               const Mat& input)
+{
+    Mat frame = input;
+    for (size_t i = 0; i < chain.size(); i++) {
+        Mat output;
+        chain[i]->process_frame(inputs.input(i, frame), output);
+        frame = output;
+    }
+}
+
+/* the value of a key in a line of a baseline written by save_results */
+std::string json_field(const std::string& line, const std::string& key)
+{
+    std::string quoted = "\"" + key + "\":";
+    size_t at = line.find(quoted);
+    if (at == std::string::npos) {
+        return "";
+    }
+    at = line.find_first_not_of(' ', at + quoted.size());
+    if (at == std::string::npos) {
+        return "";
+    }
+    if (line[at] == '"') {
+        return line.substr(at + 1, line.find('"', at + 1) - at - 1);
+    }
+    return line.substr(at, line.find_first_of(",}", at) - at);
+}
+
+bool save_results(const std::string& path, const std::vector<Result>& results,
+                  int repeat, int threads)
+{
+    std::ofstream out(path);
+    out << std::setprecision(6);
+    out << "{\n  \"repeat\": " << repeat << ",\n  \"threads\": " << threads
+        << ",\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& r = results[i];
+        out << "    {\"name\": \"" << r.name << "\", \"size\": \"" << r.size
+            << "\", \"median_ms\": " << r.median_ms
+            << ", \"p99_ms\": " << r.p99_ms << ", \"mps\": " << r.mps
+            << ", \"allocs\": " << r.allocs << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return (bool)out;
+}
+
+/* results of a saved baseline by case name and size */
+std::map<std::string, Result> load_results(const std::string& path)
+{
+    std::map<std::string, Result> results;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        Result r;
+        r.name = json_field(line, "name");
+        r.size = json_field(line, "size");
+        if (r.name.empty()) {
+            continue;
+        }
+        r.median_ms = std::atof(json_field(line, "median_ms").c_str());
+        r.p99_ms = std::atof(json_field(line, "p99_ms").c_str());
+        r.mps = std::atof(json_field(line, "mps").c_str());
+        r.allocs = std::atof(json_field(line, "allocs").c_str());
+        results[r.name + " " + r.size] = r;
+    }
+    return results;
+}
+
+/* how Canny scales with threads on one frame */
+int run_scaling(std::map<std::string, docopt::value>& args)
+{
+    Size size((int)docopt_to_float(args, "--width", 1920),
+              (int)docopt_to_float(args, "--height", 1080));
+    int max_threads = (int)docopt_to_float(args, "--max-threads", 0);
+    int repeat = std::max(1, (int)docopt_to_float(args, "--repeat", 10));
+    if (max_threads <= 0) {
+        max_threads = std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    Mat input = synthetic_image(size);
+    Mat serial;
+    canny_edges(input, serial);
+
+    std::cout << "canny " << size.width << "x" << size.height
+              << ", median of " << repeat << " runs" << std::endl;
+    std::cout << "threads\tms\tMP/s\tspeedup\tidentical" << std::endl;
+
+    double base_ms = 0;
+    for (int threads = 1; threads <= max_threads; threads++) {
+        std::unique_ptr<ThreadPool> pool;
+        if (threads > 1) {
+            pool.reset(new ThreadPool(threads - 1));
+        }
+
+        Mat output;
+        std::vector<double> times;
+        for (int i = 0; i < repeat; i++) {
+            int64 start = getTickCount();
+            canny_edges(input, output, false, false, 0.6, 0.8, false, true,
+                        "", false, pool.get());
+            times.push_back((getTickCount() - start) * 1000.0
+                            / getTickFrequency());
+        }
+
+        double ms = median_ms(times);
+        if (threads == 1) {
+            base_ms = ms;
+        }
+        bool identical = norm(output, serial, NORM_INF) == 0;
+        std::cout << threads << "\t" << ms << "\t"
+                  << size.area() / 1e3 / ms << "\t"
+                  << base_ms / ms << "\t"
+                  << (identical ? "yes" : "NO") << std::endl;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    auto args = docopt::docopt(doc, {argv + 1, argv + argc}, true, "");
+    if (args["--scaling"].asBool()) {
+        return run_scaling(args);
+    }
+
+    int repeat = std::max(1, (int)docopt_to_float(args, "--repeat", 10));
+    int threads = std::max(1, (int)docopt_to_float(args, "--threads", 1));
+    double tolerance = docopt_to_float(args, "--tolerance", 10) / 100.0;
+    std::string filter = args["--filter"].isString() ? args["--filter"].asString() : "";
+
+    std::map<std::string, Result> baseline;
+    if (args["--compare"].isString()) {
+        baseline = load_results(args["--compare"].asString());
+        if (baseline.empty()) {
+            std::cout << "No results in '" << args["--compare"].asString()
+                      << "'" << std::endl;
+            return 1;
+        }
+    }
+
+    /* every Mat allocation is counted from here on */
+    CountingAllocator allocator(Mat::getDefaultAllocator());
+    Mat::setDefaultAllocator(&allocator);
+
+    std::unique_ptr<ThreadPool> pool;
+    if (threads > 1) {
+        pool.reset(new ThreadPool(threads - 1));
+    }
+
+    std::cout << "median and 99th percentile of " << repeat << " runs, "
+              << threads << " threads" << std::endl;
+    std::cout << "size\tcase\tms\tp99 ms\tMP/s\tallocs"
+              << (baseline.empty() ? "" : "\tbase ms\tchange") << std::endl;
+
+    std::vector<Result> results;
+    int regressions = 0;
+    for (auto& size_name: split(args["--sizes"].asString(), ',')) {
+        Size size = parse_size(size_name);
+        if (size.area() == 0) {
+            std::cout << "Unknown size '" << size_name << "'" << std::endl;
+            return 1;
+        }
+
+        Mat input = synthetic_image(size);
+        Mat gray, scaled;
+        cvtColor(input, gray, CV_BGR2GRAY);
+        gray.convertTo(scaled, CV_32FC1, 1 / 256.0);
+
+        /* inputs of the later Canny stages */
+        const std::vector<ConvolutionKernel> sobel =
+            gradient_kernels(sobel_or_scharr(true));
+        Workspace gradient_workspace;
+        Mat mag, dir, suppressed;
+        polarGradient(scaled, sobel, mag, dir, &gradient_workspace);
+        non_max_suppresion(mag, dir, suppressed, 0.6f, 0.8f, false);
+
+        Mat gaussian = getGaussianKernel(5, 1.0, CV_32F);
+        Mat kernel = gaussian * gaussian.t();
+        ConvolutionKernel prepared(kernel);
+
+        Workspace canny_workspace, two_pass_workspace, morphology_workspace;
+        CannyAutoThresh percentile;
+        percentile.mode = CannyAutoThresh::PERCENTILE;
+        AlgorithmChain blur_canny = make_chain(
+            {"convolution", "--gaussian=1.5", "canny"}, threads);
+        AlgorithmChain blur_two_pass = make_chain(
+            {"convolution", "--gaussian=1.5", "two_pass", "--max-categories=4"},
+            threads);
+        ChainInputs blur_canny_inputs(blur_canny);
+        ChainInputs blur_two_pass_inputs(blur_two_pass);
+
+        /* the same chain through the library, on caller buffers */
+        ConvolutionConfig blur;
+        blur.gaussian = 1.5f;
+        blur.threads = threads;
+        CannyConfig edges;
+        edges.threads = threads;
+        Composer composer({blur, edges});
+        Mat composed(size, CV_32FC1);
+        PixelBuffer in_buffer, out_buffer;
+        in_buffer.data = input.data;
+        in_buffer.width = input.cols;
+        in_buffer.height = input.rows;
+        in_buffer.stride = input.step;
+        out_buffer.data = composed.data;
+        out_buffer.width = composed.cols;
+        out_buffer.height = composed.rows;
+        out_buffer.format = PIXELS_GRAY32F;
+
+        /* closing gaps in edge maps with a large disk */
+        const MorphologyElement disk = disk_element(25);
+        MorphologyElement square;
+        square.rect = Size(51, 51);
+        const Mat ellipse = getStructuringElement(MORPH_ELLIPSE, Size(51, 51));
+
+        /* the cheapest quality a frame budget lowers canny to */
+        AlgorithmChain lowest_canny = make_chain({"canny", "--n8"}, threads);
+        lowest_canny[0]->quality = lowest_canny[0]->quality_levels();
+        ChainInputs lowest_canny_inputs(lowest_canny);
+
+        /* a stream where one small square changes every frame */
+        AlgorithmChain incremental_chain = make_chain(
+            {"convolution", "--gaussian=1.5", "canny"}, threads);
+        std::vector<Mat> incremental_outputs(incremental_chain.size());
+        ChainInputs incremental_inputs(incremental_chain);
+        DirtyTiles tiles;
+        Mat moved = input.clone();
+        rectangle(moved, Rect(size.width / 3, size.height / 3, 24, 24),
+                  Scalar(255, 255, 255), -1);
+        bool odd_frame = false;
+
+        Mat output, state, labels;
+        std::vector<Case> cases = {
+            {"canny", [&]() {
+                canny_edges(input, output, false, false, 0.6f, 0.8f, false,
+                            true, "", false, pool.get(), &canny_workspace); }},
+            {"canny/fixed_point", [&]() {
+                canny_edges(input, output, false, false, 0.6f, 0.8f, false,
+                            true, "", false, pool.get(), &canny_workspace,
+                            CANNY_FIXED_L2); }},
+            {"canny/fixed_point_l1", [&]() {
+                canny_edges(input, output, false, false, 0.6f, 0.8f, false,
+                            true, "", false, pool.get(), &canny_workspace,
+                            CANNY_FIXED_L1); }},
+            {"canny/auto_thresh", [&]() {
+                canny_edges(input, output, false, false, 0.25f, 0.5f, false,
+                            true, "", false, pool.get(), &canny_workspace,
+                            CANNY_FLOAT, &percentile); }},
+            {"canny/lowest_quality", [&]() {
+                run_chain(lowest_canny, lowest_canny_inputs, input); }},
+            {"canny/polar_gradient", [&]() {
+                polarGradient(scaled, sobel, mag, dir, &gradient_workspace); }},
+            {"canny/non_max_suppression", [&]() {
+                non_max_suppresion(mag, dir, state, 0.6f, 0.8f, false); }},
+            {"canny/gradient_nms", [&]() {
+                state.create(scaled.size(), CV_8UC1);
+                gradient_nms(scaled, state, 0, scaled.rows, 0.6f, 0.8f,
+                             false, true); }},
+            {"canny/gradient_nms_fixed", [&]() {
+                state.create(gray.size(), CV_8UC1);
+                gradient_nms_fixed(gray, state, 0, gray.rows, 0.6f, 0.8f,
+                                   false, true, false); }},
+            {"canny/link_edges", [&]() {
+                link_edges(state, false); },
+             [&]() { suppressed.copyTo(state); }},
+            {"convolution/naive", [&]() {
+                output.create(scaled.size(), CV_32FC1);
+                naive_convolution(scaled, output, kernel); }},
+            {"convolution/filter2D", [&]() {
+                filter2D(scaled, output, CV_32F, kernel); }},
+            {"convolution/composer", [&]() {
+                convolution(scaled, output, prepared, CV_32F,
+                            BORDER_REFLECT_101, pool.get()); }},
+            {"morphology/close_disk", [&]() {
+                morphology(gray, output, MORPHOLOGY_CLOSE, disk, pool.get(),
+                           &morphology_workspace); }},
+            {"morphology/close_square", [&]() {
+                morphology(gray, output, MORPHOLOGY_CLOSE, square, pool.get(),
+                           &morphology_workspace); }},
+            {"morphology/close_edges", [&]() {
+                morphology(mag, output, MORPHOLOGY_CLOSE, disk, pool.get(),
+                           &morphology_workspace); }},
+            {"morphology/morphologyEx", [&]() {
+                morphologyEx(gray, output, MORPH_CLOSE, ellipse); }},
+            {"two_pass", [&]() {
+                two_pass(input, labels, GrayCategorizer(4), true, nullptr,
+                         false, false, "", pool.get(), &two_pass_workspace); }},
+            {"chain/convolution,canny", [&]() {
+                run_chain(blur_canny, blur_canny_inputs, input); }},
+            {"chain/convolution,two_pass", [&]() {
+                run_chain(blur_two_pass, blur_two_pass_inputs, input); }},
+            {"composer/convolution,canny", [&]() {
+                composer.process(in_buffer, out_buffer); }},
+            {"incremental/convolution,canny", [&]() {
+                odd_frame = !odd_frame;
+                Mat frame = odd_frame ? moved : input;
+                tiles.update(frame);
+                for (size_t i = 0; i < incremental_chain.size(); i++) {
+                    process_incremental(*incremental_chain[i],
+                                        incremental_inputs.input(i, frame),
+                                        incremental_outputs[i], tiles, "");
+                    frame = incremental_outputs[i];
+                } }}
+        };
+
+        for (auto& c: cases) {
+            if (c.name.find(filter) == std::string::npos) {
+                continue;
+            }
+            Result r = measure(c, size_name, size, repeat, allocator);
+            results.push_back(r);
+            std::cout << r.size << "\t" << r.name << "\t" << r.median_ms
+                      << "\t" << r.p99_ms << "\t" << r.mps << "\t" << r.allocs;
+
+            auto base = baseline.find(r.name + " " + r.size);
+            if (base != baseline.end()) {
+                double change = r.median_ms / base->second.median_ms - 1;
+                bool regression = change > tolerance;
+                regressions += regression;
+                std::ostringstream percent;
+                percent << std::showpos << std::fixed << std::setprecision(1)
+                        << change * 100 << "%";
+                std::cout << "\t" << base->second.median_ms << "\t"
+                          << percent.str()
+                          << (regression ? "\tREGRESSION" : "");
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    Mat::setDefaultAllocator(nullptr);
+
+    if (args["--save"].isString()
+    && !save_results(args["--save"].asString(), results, repeat, threads)) {
+        std::cout << "Can't write '" << args["--save"].asString() << "'"
+                  << std::endl;
+        return 1;
+    }
+    if (!baseline.empty()) {
+        std::cout << regressions << " regressions beyond "
+                  << tolerance * 100 << "%" << std::endl;
+    }
+    return regressions == 0 ? 0 : 1;
+}
@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
+
+#include "batch.hpp"
+#include "bounded_queue.hpp"
+#include "thread_pool.hpp"
+
+/* file extensions imread can decode */
+static bool is_image_file(const std::string& path)
+{
+    static const char* extensions[] = {
+        "bmp", "dib", "jpeg", "jpg", "jpe", "jp2", "png", "webp", "pbm",
+        "pgm", "ppm", "pxm", "pnm", "sr", "ras", "tiff", "tif", "exr", "hdr",
+        "pic"
+    };
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos) {
+        return false;
+    }
+    std::string ext = path.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    for (auto e: extensions) {
+        if (ext == e) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<std::string> batch_files(const std::vector<std::string>& inputs)
+{
+    std::vector<std::string> files;
+    for (auto& input: inputs) {
+        /* glob lists every file of a directory, or the files matching a
+         * pattern. a plain file name matches itself */
+        std::vector<cv::String> matches;
+        try {
+            cv::glob(input, matches, false);
+        } catch (cv::Exception& e) {
+            std::cout << "Can't list '" << input << "': " << e.what() << std::endl;
+        }
+        for (auto& m: matches) {
+            if (is_image_file(m)) {
+                files.push_back(m);
+            }
+        }
+    }
+    std::sort(files.begin(), files.end());
+    files.erase(std::unique(files.begin(), files.end()), files.end());
+    return files;
+}
+
+/* output path for an input image, its name without the directory
+ * and with the extension of the output format */
+static std::string output_path(const std::string& output_dir,
+                               const std::string& input)
+{
+    size_t slash = input.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+    size_t dot = name.find_last_of('.');
+    return output_dir + "/" + name.substr(0, dot) + image_extension();
+}
+
+/* create a directory and its missing parents, like mkdir -p
+ * fails with the reason in error when a part of the path is not a
+ * directory or can't be created */
+static bool make_directories(const std::string& path, std::string& error)
+{
+    for (size_t end = path.find('/', 1); ; end = path.find('/', end + 1)) {
+        const std::string part = path.substr(0, end);
+        struct stat st;
+        if (stat(part.c_str(), &st) != 0) {
+            if (mkdir(part.c_str(), 0777) != 0 && errno != EEXIST) {
+                error = "can't create '" + part + "': " + strerror(errno);
+                return false;
+            }
+        } else if (!S_ISDIR(st.st_mode)) {
+            error = "'" + part + "' is not a directory";
+            return false;
+        }
+        if (end == std::string::npos) {
+            return true;
+        }
+    }
+}
+
+/* an image decoded ahead of the jobs, or why it couldn't be */
+struct DecodedImage {
+    long index = 0;
+    cv::Mat image;
+    std::string error;
+};
+
+long run_batch(const BatchOptions& options,
+               const std::function<AlgorithmChain()>& make_chain,
+               const std::vector<std::string>& names)
+{
+    const std::vector<std::string> files = batch_files(options.inputs);
+
+    /* images of different directories, or with another extension, may
+     * have the same result name. refuse to overwrite one with another */
+    std::vector<std::string> outputs;
+    std::map<std::string, std::string> written_by;
+    for (auto& f: files) {
+        outputs.push_back(output_path(options.output_dir, f));
+        auto written = written_by.insert(std::make_pair(outputs.back(), f));
+        if (!written.second) {
+            std::cout << "'" << written.first->second << "' and '" << f
+                      << "' would both be written to '" << outputs.back()
+                      << "'" << std::endl;
+            return (long)files.size();
+        }
+    }
+    std::string reason;
+    if (!make_directories(options.output_dir, reason)) {
+        std::cout << "Can't write to the output directory: " << reason
+                  << std::endl;
+        return (long)files.size();
+    }
+
+    const int jobs = std::max(1, std::min(options.jobs, (int)files.size()));
+    if (!options.quiet) {
+        std::cout << "Processing " << files.size() << " images with " << jobs
+                  << " jobs into '" << options.output_dir << "'" << std::endl;
+    }
+
+    /* chains are made up front, parsing arguments is not thread safe */
+    std::vector<AlgorithmChain> chains;
+    std::vector<ChainInputs> inputs;
+    for (int j = 0; j < jobs; j++) {
+        chains.push_back(make_chain());
+        inputs.emplace_back(chains.back());
+    }
+
+    /* readers decode the images into a queue the jobs take them from, so
+     * decoding overlaps processing. an image is in flight from when a
+     * reader starts decoding it until its job has written the result: a
+     * reader takes a slot first, waiting while every slot is taken, and the
+     * job gives it back. the queue never holds more than the slots */
+    const int readers = std::max(1, std::min((int)files.size(),
+        options.readers > 0 ? options.readers : jobs));
+    const int max_in_flight = options.max_in_flight > 0
+                            ? options.max_in_flight : jobs + readers;
+    BoundedQueue<char> slots(max_in_flight);
+    BoundedQueue<DecodedImage> decoded(max_in_flight);
+    std::atomic<long> next_read(0);
+    std::vector<std::thread> reading;
+    for (int r = 0; r < readers; r++) {
+        reading.push_back(std::thread([&]() {
+            trace_thread_name("read");
+            long i;
+            while ((i = next_read++) < (long)files.size()) {
+                slots.push(0);
+                DecodedImage image;
+                image.index = i;
+                try {
+                    TRACE_SCOPE("read");
+                    image.image = cv::imread(files[i], cv::IMREAD_COLOR);
+                } catch (std::exception& e) {
+                    image.error = e.what();
+                }
+                if (image.image.empty() && image.error.empty()) {
+                    image.error = "can't read image";
+                }
+                decoded.push(std::move(image));
+            }
+        }));
+    }
+
+    std::atomic<long> next(0);
+    std::atomic<long> done(0);
+    std::atomic<long> failed(0);
+    std::mutex print;
+    int64 start = cv::getTickCount();
+
+    /* jobs take the next decoded image as soon as they finish one, so slow
+     * images don't hold up the others. every file is pushed once, so a job
+     * that claims one gets one */
+    ThreadPool pool(jobs - 1);
+    pool.parallel_for(0, jobs, [&](int j) {
+        DecodedImage image;
+        while (next++ < (long)files.size() && decoded.pop(image)) {
+            const long i = image.index;
+            std::string error = image.error;
+            try {
+                cv::Mat frame = image.image;
+                image.image.release();
+                for (size_t a = 0; a < chains[j].size() && error.empty(); a++) {
+                    cv::Mat output;
+                    TRACE_SCOPE(names[a]);
+                    /* images of a batch are unrelated */
+                    chains[j][a]->reset(names[a]);
+                    chains[j][a]->process_frame(inputs[j].input(a, frame),
+                                                output, names[a]);
+                    frame = output;
+                }
+                if (error.empty() && !write_mat(outputs[i], frame)) {
+                    error = "can't write result";
+                }
+            } catch (std::exception& e) {
+                error = e.what();
+            }
+            char slot;
+            slots.try_pop(slot);
+
+            long count = ++done;
+            if (!error.empty()) {
+                failed++;
+                std::lock_guard<std::mutex> lock(print);
+                std::cout << "'" << files[i] << "': " << error << std::endl;
+            } else if (!options.quiet && count % 1000 == 0) {
+                std::lock_guard<std::mutex> lock(print);
+                std::cout << "Processed " << count << " of " << files.size()
+                          << " images" << std::endl;
+            }
+        }
+    });
+    for (auto& r: reading) {
+        r.join();
+    }
+
+    if (!options.quiet) {
+        double seconds = (cv::getTickCount() - start) / cv::getTickFrequency();
+        std::cout << "Processed " << done << " images in " << seconds << " s, "
+                  << done / std::max(seconds, 1e-9) << " images/s, "
+                  << failed << " failed" << std::endl;
+    }
+    return failed;
+}
@@ -0,0 +1,41 @@
+#ifndef _BATCH_HPP
+#define _BATCH_HPP
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util.hpp"
+
+/* settings for processing a batch of image files without a gui
+ * inputs are directories, glob patterns or files. results are written to
+ * output_dir, created if needed, named after the input file. jobs is the
+ * number of images processed at once, and readers the number decoded at
+ * once, 0 for one per job. max_in_flight caps the images being decoded,
+ * waiting for a job or being processed, 0 for one per job and reader */
+struct BatchOptions {
+    std::vector<std::string> inputs;
+    std::string output_dir = ".";
+    int jobs = 1;
+    int readers = 0;
+    int max_in_flight = 0;
+    bool quiet = false;
+};
+
+/* image files named by directories, glob patterns or paths, sorted */
+std::vector<std::string> batch_files(const std::vector<std::string>& inputs);
+
+/* run a chain of algorithms on every image of a batch
+ * reader threads decode the images ahead of the jobs, waiting while
+ * max_in_flight are decoded and not yet written. each job takes the next
+ * decoded image when it is done with the last, and runs the whole chain
+ * on it. make_chain is called once per job, since algorithms keep state
+ * between frames. nothing is processed when two images would have the
+ * same result name, or the output directory can't be created.
+ * returns the number of images that failed */
+long run_batch(const BatchOptions& options,
+               const std::function<AlgorithmChain()>& make_chain,
+               const std::vector<std::string>& names);
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef _BOUNDED_QUEUE_HPP
+#define _BOUNDED_QUEUE_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/* a queue of at most capacity items shared between threads
+ *
+ * when the queue is full, push either waits for room (BLOCK) or drops the
+ * oldest item to make room (DROP_OLDEST). after close, pushes fail and pops
+ * return false, waking any thread waiting on the queue */
+template<typename T>
+class BoundedQueue {
+public:
+    enum Policy {
+        BLOCK,
+        DROP_OLDEST
+    };
+
+    explicit BoundedQueue(size_t capacity, Policy policy=BLOCK)
+        : capacity(std::max<size_t>(capacity, 1)), policy(policy) {}
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (policy == BLOCK) {
+            not_full.wait(lock, [this]() {
+                return closed || items.size() < capacity; });
+        }
+        return insert(item);
+    }
+
+    /* push without waiting, fails when the queue is full and blocking */
+    bool try_push(T item)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (policy == BLOCK && items.size() >= capacity) {
+            return false;
+        }
+        return insert(item);
+    }
+
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this]() { return closed || !items.empty(); });
+        if (closed) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    bool try_pop(T& item)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (closed || items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    /* true when a push would wait */
+    bool full()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return policy == BLOCK && items.size() >= capacity;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            items.clear();
+        }
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    /* number of items dropped to make room */
+    long dropped()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return drop_count;
+    }
+
+private:
+    /* called with the mutex held */
+    bool insert(T& item)
+    {
+        if (closed) {
+            return false;
+        }
+        if (items.size() >= capacity) {
+            items.pop_front();
+            drop_count++;
+        }
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    const size_t capacity;
+    const Policy policy;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    bool closed = false;
+    long drop_count = 0;
+};
+
+#endif
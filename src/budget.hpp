@@ -0,0 +1,140 @@
+#ifndef _BUDGET_HPP
+#define _BUDGET_HPP
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+/* lowers the quality of the stages processing a frame while frames take
+ * longer than the budget, and raises it again when there is room
+ *
+ * every stage has quality levels from 0, full quality, to its cheapest.
+ * the time of each stage is averaged over frames, and when the average
+ * frame is over budget the most expensive stage that can still go lower
+ * drops a level. levels are restored in the reverse order, once the frame
+ * would fit in 90% of the budget with the time lowering the stage saved
+ * added back. the saving is scaled by how much the frame time changed
+ * since, so a spike that has passed lets quality come back. the averages
+ * start again after every change, so a change is measured before the next
+ * one */
+class BudgetScheduler {
+public:
+    /* levels holds the cheapest quality of each stage */
+    BudgetScheduler(double budget_ms, const std::vector<int>& levels)
+        : budget_ms(budget_ms), levels(levels), qualities(levels.size(), 0),
+          frame_ticks(levels.size(), 0), costs(levels.size(), -1) {}
+
+    /* quality to process the next frame of a stage at */
+    int quality(size_t stage) const { return qualities[stage]; }
+
+    /* add time spent by a stage on the current frame, in ticks of
+     * cv::getTickCount */
+    void add(size_t stage, int64 ticks)
+    {
+        frame_ticks[stage] += ticks;
+    }
+
+    /* average the stage times of the frame and change at most one quality
+     * level. returns true if one changed */
+    bool end_frame()
+    {
+        double frame_ms = 0;
+        for (size_t s = 0; s < levels.size(); s++) {
+            double ms = frame_ticks[s] * 1000.0 / cv::getTickFrequency();
+            costs[s] = costs[s] < 0 ? ms : costs[s] + alpha * (ms - costs[s]);
+            frame_ms += ms;
+            frame_ticks[s] = 0;
+        }
+        average_ms = average_ms < 0 ? frame_ms
+                   : average_ms + alpha * (frame_ms - average_ms);
+        frames++;
+        over += frame_ms > budget_ms;
+        if (++settled < settle_frames) {
+            return false;
+        }
+        if (!lowered.empty() && lowered.back().frame_ms < 0) {
+            /* first measurement since the last stage was lowered */
+            Lowered& last = lowered.back();
+            last.saved_ms = std::max(last.saved_ms - costs[last.stage], 0.0);
+            last.frame_ms = average_ms;
+        }
+
+        if (average_ms > budget_ms) {
+            int worst = -1;
+            for (size_t s = 0; s < levels.size(); s++) {
+                if (qualities[s] < levels[s]
+                    && (worst < 0 || costs[s] > costs[worst])) {
+                    worst = (int)s;
+                }
+            }
+            if (worst < 0) {
+                return false;
+            }
+            lowered.push_back({worst, costs[worst], -1});
+            qualities[worst]++;
+            lowered_count++;
+            restart();
+            return true;
+        }
+        if (!lowered.empty()) {
+            const Lowered& last = lowered.back();
+            double restored_ms = average_ms + last.saved_ms * average_ms
+                                            / std::max(last.frame_ms, 1e-3);
+            if (restored_ms < budget_ms * 0.9) {
+                qualities[last.stage]--;
+                lowered.pop_back();
+                raised_count++;
+                restart();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void print(std::ostream& out) const
+    {
+        out << "Budget of " << budget_ms << " ms: " << over << " of "
+            << frames << " frames over, quality lowered " << lowered_count
+            << " and raised " << raised_count << " times" << std::endl;
+    }
+
+    /* frames averaged before a level changes, and the weight of each */
+    int settle_frames = 4;
+    double alpha = 0.3;
+
+private:
+    struct Lowered {
+        int stage;
+        /* the cost of the stage until measured after lowering it, then
+         * how much that saved on frames of frame_ms */
+        double saved_ms;
+        double frame_ms;
+    };
+
+    void restart()
+    {
+        settled = 0;
+        average_ms = -1;
+        costs.assign(costs.size(), -1);
+    }
+
+    double budget_ms;
+    std::vector<int> levels;
+    std::vector<int> qualities;
+    std::vector<int64> frame_ticks;
+    /* average time of each stage at its current quality */
+    std::vector<double> costs;
+    double average_ms = -1;
+    int settled = 0;
+    /* stages in the order they were lowered */
+    std::vector<Lowered> lowered;
+
+    long frames = 0;
+    long over = 0;
+    long lowered_count = 0;
+    long raised_count = 0;
+};
+
+#endif
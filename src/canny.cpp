@@ -1,48 +1,80 @@
+#include <cfloat>
+#include <climits>
+#include <cstring>
+
 #include "canny.hpp"
+#include "convolution.hpp"
+#include "simd.hpp"
 
 const float WEAK_GRAD   = 0.5;
 const float STRONG_GRAD = 1.0;
 
-/* scale the min and max threshholds according to max value of image */
-void calc_dynamic_thresh(const Mat mag, const Mat dir,
-                         float& min_thresh, float& max_thresh)
+/* states of the edge image passed from suppression to hysteresis
+ * edges found by hysteresis are marked as linked */
+const uchar EDGE_NONE   = 0;
+const uchar EDGE_WEAK   = 1;
+const uchar EDGE_STRONG = 2;
+const uchar EDGE_LINKED = 3;
+
+/* quantized gradient directions, each names the pair of neighbours compared
+ * during non-maximal suppression */
+const float DIR_0   = 0;
+const float DIR_45  = 1;
+const float DIR_90  = 2;
+const float DIR_135 = 3;
+
+/* horizontal derivative kernel, polarGradient rotates it for the vertical */
+Mat sobel_or_scharr(bool useSobel)
 {
-    /* find highest value */
-    double _max;
-    minMaxLoc(mag, NULL, &_max);
+    if (useSobel) {
+        return Mat ((Mat_<float>(3, 3) <<
+                     -1, 0, 1,
+                     -2, 0, 2,
+                     -1, 0, 1));
+    }
+    return Mat ((Mat_<float>(3, 3) <<
+                 -3,  0,  3,
+                 -10, 0, 10,
+                 -3,  0,  3));
+}
 
-    max_thresh = min(_max, _max * max_thresh);
-    min_thresh = min(_max, _max * min_thresh);
+std::vector<ConvolutionKernel> gradient_kernels(const Mat& kernel)
+{
+    /* rotate the kernel */
+    Mat rotated;
+    transpose(kernel, rotated);
+    flip(rotated, rotated, 1);
+    return {ConvolutionKernel(kernel), ConvolutionKernel(rotated)};
 }
 
 /* find magnitude and direction of gradient */
-void polarGradient(const Mat& input, Mat kernel, Mat& mag, Mat& dir)
+void polarGradient(const Mat& input,
+                   const std::vector<ConvolutionKernel>& kernels,
+                   Mat& mag, Mat& dir, Workspace* workspace)
 {
-    Mat dx (mag.size(), mag.type());
-    Mat dy (mag.size(), mag.type());
+    Mat dx = workspace_mat(workspace, "dx", input.size(), CV_32FC1);
+    Mat dy = workspace_mat(workspace, "dy", input.size(), CV_32FC1);
 
-    filter2D(input, dx, -1, kernel);
-
-    /* rotate the kernel */
-    transpose(kernel, kernel);
-    flip(kernel, kernel, 1);
-
-    filter2D(input, dy, -1, kernel);
+    convolution(input, dx, kernels[0], CV_32F);
+    convolution(input, dy, kernels[1], CV_32F);
 
     /* convert gradient to polar coordinates */
     cartToPolar(dx, dy, mag, dir, true);
 }
 
 /* used within the inner loop of non-maximal suppression algorithm
- * zero a pixel when its neighbor (N4 or N8) has a greater gradient magnitude
+ * true when a pixel's neighbor (N4 or N8) has a greater gradient magnitude
  */
 inline bool zero_if_non_max(const Mat& mag, const Mat& dir, int r, int c,
-                            Mat& output, bool n8=false)
+                            bool n8=false)
 {
 #define wrap(x) (fmod(x, 360))
     float m = mag.at<float>(r, c);
     float d = dir.at<float>(r, c);
-    float up, dw;
+    /* angles that wrap past 360 fall in none of the ranges below,
+     * they belong to the horizontal pair */
+    float up = mag.at<float>(r, c + 1);
+    float dw = mag.at<float>(r, c - 1);
     /* degrees and corresponding row/column offsets */
     float offsets8[][3] = {{0, 0, 1},
                            {45, 1, 1},
@@ -64,143 +96,1239 @@ inline bool zero_if_non_max(const Mat& mag, const Mat& dir, int r, int c,
                 break;
             }
     }
-    if (up > m || dw > m) {
-        output.at<float>(r, c) = 0;
-        return true;
-    }
-    return false;
+    return up > m || dw > m;
 }
 
 /* non-maximal suppression
- * pixels are set to 0.5 if between min_thresh and max_thresh,
- * 1.0 if above max_thresh, 0.0 otherwise
- * also, set to 0.0 if not a local maximum in N4 or N8 neighborhood */
-void non_max_suppresion(const Mat& mag, const Mat& dir, Mat& output,
-                        std::list< Point_<int> >& strong,
-                        std::list< Point_<int> >& weak,
-                        float min_thresh, float max_thresh, bool n8=false)
+ * pixels are marked weak if between min_thresh and max_thresh,
+ * strong if above max_thresh, none otherwise
+ * also, marked none if not a local maximum in N4 or N8 neighborhood */
+void non_max_suppresion(const Mat& mag, const Mat& dir, Mat& state,
+                        float min_thresh, float max_thresh, bool n8)
 {
+    state.create(mag.size(), CV_8UC1);
     for (int r = 0; r < mag.rows; r++) {
         for (int c = 0; c < mag.cols; c++) {
             /* check neighbors of each pixel */
             float m = mag.at<float>(r, c);
-            float d = dir.at<float>(r, c);
+            state.at<uchar>(r, c) = EDGE_NONE;
             if (m >= min_thresh
             && r > 0 && r < mag.rows - 1
             && c > 0 && c < mag.cols - 1)
             {
-                output.at<float>(r, c) = WEAK_GRAD;
-                if (m >= max_thresh) {
-                    output.at<float>(r, c) = STRONG_GRAD;
-                    m = STRONG_GRAD;
-                } else {
-                    m = WEAK_GRAD;
-                }
-
                 /* if there's a pixel with a higher direction in the same
                  * or opposite direction as the pixel, set to zero */
-                if (!zero_if_non_max(mag, dir, r, c, output, n8)) {
-                    if (m == WEAK_GRAD) {
-                        weak.push_back(Point_<int>(r, c));
-                    } else {
-                        strong.push_back(Point_<int>(r, c));
-                    }
+                if (!zero_if_non_max(mag, dir, r, c, n8)) {
+                    state.at<uchar>(r, c) = m >= max_thresh ? EDGE_STRONG
+                                                            : EDGE_WEAK;
+                }
+            }
+        }
+    }
+}
+
+/* expand the linked pixels on the stack into connected weak or strong
+ * pixels, limited to rows [row_begin, row_end) */
+static void flood_edges(Mat& state, bool n8, int row_begin, int row_end,
+                        std::vector<int>& stack)
+{
+    const int step = (int)state.step;
+    const int offsets[] = {-1, 1, -step, step,
+                           -step - 1, -step + 1, step - 1, step + 1};
+    const int n_offsets = n8 ? 8 : 4;
+    const int lo = row_begin * step;
+    const int hi = row_end * step;
+    uchar* data = state.data;
+
+    while (!stack.empty()) {
+        int p = stack.back();
+        stack.pop_back();
+        for (int i = 0; i < n_offsets; i++) {
+            int q = p + offsets[i];
+            if (q >= lo && q < hi
+            && (data[q] == EDGE_WEAK || data[q] == EDGE_STRONG)) {
+                data[q] = EDGE_LINKED;
+                stack.push_back(q);
+            }
+        }
+    }
+}
+
+/* hysteresis: every weak pixel connected to a strong one through N4 or N8
+ * neighbours becomes part of an edge, all others are dropped
+ * pixels are pushed at most once to a contiguous stack of offsets into the
+ * state image, so nothing is allocated per pixel. the border of the state
+ * image is never an edge, so neighbours of pushed pixels are in bounds
+ * only rows [row_begin, row_end) are read or written */
+void link_edges(Mat& state, bool n8, int row_begin, int row_end)
+{
+    std::vector<int> stack;
+    stack.reserve(state.cols * 2);
+
+    for (int r = std::max(row_begin, 1);
+         r < std::min(row_end, state.rows - 1); r++) {
+        uchar* row = state.ptr<uchar>(r);
+        for (int c = 1; c < state.cols - 1; c++) {
+            if (row[c] == EDGE_STRONG) {
+                row[c] = EDGE_LINKED;
+                stack.push_back((int)(row + c - state.data));
+                flood_edges(state, n8, row_begin, row_end, stack);
+            }
+        }
+    }
+}
+
+void link_edges(Mat& state, bool n8)
+{
+    link_edges(state, n8, 0, state.rows);
+}
+
+/* after each strip of rows was linked on its own, continue the edges that
+ * cross from one strip into the next
+ * borders are the first rows of every strip but the first */
+void link_strip_borders(Mat& state, bool n8, const std::vector<int>& borders)
+{
+    std::vector<int> stack;
+    for (int b: borders) {
+        for (int r = std::max(b - 1, 0); r <= std::min(b, state.rows - 1); r++) {
+            uchar* row = state.ptr<uchar>(r);
+            for (int c = 1; c < state.cols - 1; c++) {
+                if (row[c] == EDGE_LINKED) {
+                    stack.push_back((int)(row + c - state.data));
                 }
-            } else {
-                output.at<float>(r, c) = 0;
             }
         }
     }
+    flood_edges(state, n8, 0, state.rows, stack);
+}
+
+/* linked edges are 1.0, everything else is 0.0 */
+void edges_to_output(const Mat& state, Mat& output)
+{
+    output.create(state.size(), CV_32FC1);
+    for (int r = 0; r < state.rows; r++) {
+        const uchar* in = state.ptr<uchar>(r);
+        float* out = output.ptr<float>(r);
+        for (int c = 0; c < state.cols; c++) {
+            out[c] = in[c] == EDGE_LINKED ? STRONG_GRAD : 0;
+        }
+    }
+}
+
+/* fused gradient and non-maximal suppression
+ *
+ * produces the same output as polarGradient followed by non_max_suppresion,
+ * but streams over the image keeping only three rows of gradient magnitude
+ * and direction. derivatives of the 1/256 scaled gray image are exact in
+ * float, and directions use the same polynomial as fastAtan2, so the results
+ * match the filter2D and cartToPolar path bit for bit */
+
+/* quantize an angle in degrees to the neighbour pair used by zero_if_non_max */
+static inline float quantize_dir(float d, bool n8)
+{
+    if (d >= 180) {
+        d -= 180;
+    }
+    if (n8) {
+        if (d < 22.5f || d >= 157.5f) {
+            return DIR_0;
+        }
+        return d < 67.5f ? DIR_45 : (d < 112.5f ? DIR_90 : DIR_135);
+    }
+    return (d < 45 || d >= 135) ? DIR_0 : DIR_90;
+}
+
+/* gradient of a single pixel, l and r are the reflected column neighbours */
+static inline void gradient_px(const float* t, const float* m, const float* b,
+                               int l, int c, int r, float ka, float kb,
+                               bool n8, float* mag, float* dir)
+{
+    float dx = ka * (t[r] - t[l]) + kb * (m[r] - m[l]) + ka * (b[r] - b[l]);
+    float dy = ka * (b[l] - t[l]) + kb * (b[c] - t[c]) + ka * (b[r] - t[r]);
+    mag[c] = std::sqrt(dx * dx + dy * dy);
+    dir[c] = quantize_dir(fastAtan2(dy, dx), n8);
+}
+
+static void gradient_row(const float* t, const float* m, const float* b,
+                         int c0, int c1, float ka, float kb, bool n8,
+                         float* mag, float* dir)
+{
+    for (int c = c0; c < c1; c++) {
+        gradient_px(t, m, b, c - 1, c, c + 1, ka, kb, n8, mag, dir);
+    }
+}
+
+static inline void nms_px(const float* t, const float* m, const float* b,
+                          const float* dir, int c, float lo, float hi,
+                          uchar* out)
+{
+    float v = m[c];
+    float up, dw;
+    if (dir[c] == DIR_0) {
+        up = m[c + 1]; dw = m[c - 1];
+    } else if (dir[c] == DIR_45) {
+        up = b[c + 1]; dw = t[c - 1];
+    } else if (dir[c] == DIR_90) {
+        up = b[c];     dw = t[c];
+    } else {
+        up = b[c - 1]; dw = t[c + 1];
+    }
+    if (v >= lo && !(up > v || dw > v)) {
+        out[c] = v >= hi ? EDGE_STRONG : EDGE_WEAK;
+    } else {
+        out[c] = EDGE_NONE;
+    }
+}
+
+static void nms_row(const float* t, const float* m, const float* b,
+                    const float* dir, int c0, int c1, float lo, float hi,
+                    uchar* out)
+{
+    for (int c = c0; c < c1; c++) {
+        nms_px(t, m, b, dir, c, lo, hi, out);
+    }
+}
+
+/* coefficients of the polynomial used by fastAtan2, in degrees */
+static const float ATAN2_P1 =  0.9997878412794807f * (float)(180 / CV_PI);
+static const float ATAN2_P3 = -0.3258083974640975f * (float)(180 / CV_PI);
+static const float ATAN2_P5 =  0.1555786518463281f * (float)(180 / CV_PI);
+static const float ATAN2_P7 = -0.04432655554792128f * (float)(180 / CV_PI);
+static const float ATAN2_EPS = (float)DBL_EPSILON;
+
+#ifdef COMPOSER_SSE2
+static inline __m128 select_sse2(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+static inline __m128 atan2_sse2(__m128 y, __m128 x)
+{
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 ax = _mm_andnot_ps(sign, x);
+    __m128 ay = _mm_andnot_ps(sign, y);
+    __m128 c = _mm_div_ps(_mm_min_ps(ax, ay),
+                          _mm_add_ps(_mm_max_ps(ax, ay),
+                                     _mm_set1_ps(ATAN2_EPS)));
+    __m128 c2 = _mm_mul_ps(c, c);
+    __m128 a = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(ATAN2_P7), c2),
+                          _mm_set1_ps(ATAN2_P5));
+    a = _mm_add_ps(_mm_mul_ps(a, c2), _mm_set1_ps(ATAN2_P3));
+    a = _mm_add_ps(_mm_mul_ps(a, c2), _mm_set1_ps(ATAN2_P1));
+    a = _mm_mul_ps(a, c);
+    a = select_sse2(_mm_cmpge_ps(ax, ay), a,
+                    _mm_sub_ps(_mm_set1_ps(90), a));
+    a = select_sse2(_mm_cmplt_ps(x, _mm_setzero_ps()),
+                    _mm_sub_ps(_mm_set1_ps(180), a), a);
+    a = select_sse2(_mm_cmplt_ps(y, _mm_setzero_ps()),
+                    _mm_sub_ps(_mm_set1_ps(360), a), a);
+    return a;
+}
+
+static inline __m128 quantize_dir_sse2(__m128 d, bool n8)
+{
+    const __m128 one = _mm_set1_ps(1);
+    d = _mm_sub_ps(d, _mm_and_ps(_mm_cmpge_ps(d, _mm_set1_ps(180)),
+                                 _mm_set1_ps(180)));
+    if (n8) {
+        __m128 q = _mm_and_ps(_mm_cmpge_ps(d, _mm_set1_ps(22.5f)), one);
+        q = _mm_add_ps(q, _mm_and_ps(_mm_cmpge_ps(d, _mm_set1_ps(67.5f)), one));
+        q = _mm_add_ps(q, _mm_and_ps(_mm_cmpge_ps(d, _mm_set1_ps(112.5f)), one));
+        return _mm_andnot_ps(_mm_cmpge_ps(d, _mm_set1_ps(157.5f)), q);
+    }
+    return _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(d, _mm_set1_ps(45)),
+                                 _mm_cmplt_ps(d, _mm_set1_ps(135))),
+                      _mm_set1_ps(DIR_90));
+}
+
+static void gradient_row_sse2(const float* t, const float* m, const float* b,
+                              int c0, int c1, float ka, float kb, bool n8,
+                              float* mag, float* dir)
+{
+    const __m128 va = _mm_set1_ps(ka);
+    const __m128 vb = _mm_set1_ps(kb);
+    int c = c0;
+    for (; c + 4 <= c1; c += 4) {
+        __m128 tl = _mm_loadu_ps(t + c - 1), tc = _mm_loadu_ps(t + c),
+               tr = _mm_loadu_ps(t + c + 1);
+        __m128 bl = _mm_loadu_ps(b + c - 1), bc = _mm_loadu_ps(b + c),
+               br = _mm_loadu_ps(b + c + 1);
+        __m128 dx = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(va, _mm_sub_ps(tr, tl)),
+                       _mm_mul_ps(vb, _mm_sub_ps(_mm_loadu_ps(m + c + 1),
+                                                 _mm_loadu_ps(m + c - 1)))),
+            _mm_mul_ps(va, _mm_sub_ps(br, bl)));
+        __m128 dy = _mm_add_ps(
+            _mm_add_ps(_mm_mul_ps(va, _mm_sub_ps(bl, tl)),
+                       _mm_mul_ps(vb, _mm_sub_ps(bc, tc))),
+            _mm_mul_ps(va, _mm_sub_ps(br, tr)));
+        _mm_storeu_ps(mag + c, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(dx, dx),
+                                                      _mm_mul_ps(dy, dy))));
+        _mm_storeu_ps(dir + c, quantize_dir_sse2(atan2_sse2(dy, dx), n8));
+    }
+    gradient_row(t, m, b, c, c1, ka, kb, n8, mag, dir);
+}
+
+static void nms_row_sse2(const float* t, const float* m, const float* b,
+                         const float* dir, int c0, int c1, float lo, float hi,
+                         uchar* out)
+{
+    const __m128 vlo = _mm_set1_ps(lo), vhi = _mm_set1_ps(hi);
+    const __m128 weak = _mm_set1_ps(EDGE_WEAK);
+    const __m128 strong = _mm_set1_ps(EDGE_STRONG);
+    int c = c0;
+    for (; c + 4 <= c1; c += 4) {
+        __m128 v = _mm_loadu_ps(m + c);
+        __m128 d = _mm_loadu_ps(dir + c);
+        __m128 k0 = _mm_cmpeq_ps(d, _mm_set1_ps(DIR_0));
+        __m128 k1 = _mm_cmpeq_ps(d, _mm_set1_ps(DIR_45));
+        __m128 k2 = _mm_cmpeq_ps(d, _mm_set1_ps(DIR_90));
+        __m128 up = select_sse2(k0, _mm_loadu_ps(m + c + 1),
+                    select_sse2(k1, _mm_loadu_ps(b + c + 1),
+                    select_sse2(k2, _mm_loadu_ps(b + c),
+                                    _mm_loadu_ps(b + c - 1))));
+        __m128 dw = select_sse2(k0, _mm_loadu_ps(m + c - 1),
+                    select_sse2(k1, _mm_loadu_ps(t + c - 1),
+                    select_sse2(k2, _mm_loadu_ps(t + c),
+                                    _mm_loadu_ps(t + c + 1))));
+        __m128 suppressed = _mm_or_ps(_mm_cmpgt_ps(up, v), _mm_cmpgt_ps(dw, v));
+        __m128 keep = _mm_andnot_ps(suppressed, _mm_cmpge_ps(v, vlo));
+        __m128 val = select_sse2(_mm_cmpge_ps(v, vhi), strong, weak);
+        __m128i q = _mm_cvttps_epi32(_mm_and_ps(keep, val));
+        q = _mm_packs_epi32(q, q);
+        const int packed = _mm_cvtsi128_si32(_mm_packus_epi16(q, q));
+        std::memcpy(out + c, &packed, sizeof(packed));
+    }
+    nms_row(t, m, b, dir, c, c1, lo, hi, out);
+}
+#endif
+
+#ifdef COMPOSER_AVX2
+TARGET_AVX2 static inline __m256 atan2_avx2(__m256 y, __m256 x)
+{
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 ax = _mm256_andnot_ps(sign, x);
+    __m256 ay = _mm256_andnot_ps(sign, y);
+    __m256 c = _mm256_div_ps(_mm256_min_ps(ax, ay),
+                             _mm256_add_ps(_mm256_max_ps(ax, ay),
+                                           _mm256_set1_ps(ATAN2_EPS)));
+    __m256 c2 = _mm256_mul_ps(c, c);
+    __m256 a = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(ATAN2_P7), c2),
+                             _mm256_set1_ps(ATAN2_P5));
+    a = _mm256_add_ps(_mm256_mul_ps(a, c2), _mm256_set1_ps(ATAN2_P3));
+    a = _mm256_add_ps(_mm256_mul_ps(a, c2), _mm256_set1_ps(ATAN2_P1));
+    a = _mm256_mul_ps(a, c);
+    a = _mm256_blendv_ps(_mm256_sub_ps(_mm256_set1_ps(90), a), a,
+                         _mm256_cmp_ps(ax, ay, _CMP_GE_OQ));
+    a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps(180), a),
+                         _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_LT_OQ));
+    a = _mm256_blendv_ps(a, _mm256_sub_ps(_mm256_set1_ps(360), a),
+                         _mm256_cmp_ps(y, _mm256_setzero_ps(), _CMP_LT_OQ));
+    return a;
+}
+
+TARGET_AVX2 static inline __m256 quantize_dir_avx2(__m256 d, bool n8)
+{
+    const __m256 one = _mm256_set1_ps(1);
+    d = _mm256_sub_ps(d, _mm256_and_ps(
+            _mm256_cmp_ps(d, _mm256_set1_ps(180), _CMP_GE_OQ),
+            _mm256_set1_ps(180)));
+    if (n8) {
+        __m256 q = _mm256_and_ps(
+            _mm256_cmp_ps(d, _mm256_set1_ps(22.5f), _CMP_GE_OQ), one);
+        q = _mm256_add_ps(q, _mm256_and_ps(
+            _mm256_cmp_ps(d, _mm256_set1_ps(67.5f), _CMP_GE_OQ), one));
+        q = _mm256_add_ps(q, _mm256_and_ps(
+            _mm256_cmp_ps(d, _mm256_set1_ps(112.5f), _CMP_GE_OQ), one));
+        return _mm256_andnot_ps(
+            _mm256_cmp_ps(d, _mm256_set1_ps(157.5f), _CMP_GE_OQ), q);
+    }
+    return _mm256_and_ps(
+        _mm256_and_ps(_mm256_cmp_ps(d, _mm256_set1_ps(45), _CMP_GE_OQ),
+                      _mm256_cmp_ps(d, _mm256_set1_ps(135), _CMP_LT_OQ)),
+        _mm256_set1_ps(DIR_90));
+}
+
+TARGET_AVX2
+static void gradient_row_avx2(const float* t, const float* m, const float* b,
+                              int c0, int c1, float ka, float kb, bool n8,
+                              float* mag, float* dir)
+{
+    const __m256 va = _mm256_set1_ps(ka);
+    const __m256 vb = _mm256_set1_ps(kb);
+    int c = c0;
+    for (; c + 8 <= c1; c += 8) {
+        __m256 tl = _mm256_loadu_ps(t + c - 1), tc = _mm256_loadu_ps(t + c),
+               tr = _mm256_loadu_ps(t + c + 1);
+        __m256 bl = _mm256_loadu_ps(b + c - 1), bc = _mm256_loadu_ps(b + c),
+               br = _mm256_loadu_ps(b + c + 1);
+        __m256 dx = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(va, _mm256_sub_ps(tr, tl)),
+                          _mm256_mul_ps(vb, _mm256_sub_ps(
+                              _mm256_loadu_ps(m + c + 1),
+                              _mm256_loadu_ps(m + c - 1)))),
+            _mm256_mul_ps(va, _mm256_sub_ps(br, bl)));
+        __m256 dy = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(va, _mm256_sub_ps(bl, tl)),
+                          _mm256_mul_ps(vb, _mm256_sub_ps(bc, tc))),
+            _mm256_mul_ps(va, _mm256_sub_ps(br, tr)));
+        _mm256_storeu_ps(mag + c, _mm256_sqrt_ps(
+            _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy))));
+        _mm256_storeu_ps(dir + c, quantize_dir_avx2(atan2_avx2(dy, dx), n8));
+    }
+    gradient_row_sse2(t, m, b, c, c1, ka, kb, n8, mag, dir);
 }
 
-/* all pixels with strong gradients are in the vector
- * marks all weak pixels as strong if they're connected to a strong pixel */
-void link_edges(const std::list< Point_<int> > weak,
-                std::list< Point_<int> >& strong,
-                Mat& output, bool n8=true)
+TARGET_AVX2
+static void nms_row_avx2(const float* t, const float* m, const float* b,
+                         const float* dir, int c0, int c1, float lo, float hi,
+                         uchar* out)
 {
-    while (!strong.empty()) {
-        /* mark all weak N8 neighbors as strong and push to the strong list */
-        auto p = strong.front();
-        int r = p.x;
-        int c = p.y;
-        strong.erase(strong.begin());
+    const __m256 vlo = _mm256_set1_ps(lo), vhi = _mm256_set1_ps(hi);
+    const __m256 weak = _mm256_set1_ps(EDGE_WEAK);
+    const __m256 strong = _mm256_set1_ps(EDGE_STRONG);
+    int c = c0;
+    for (; c + 8 <= c1; c += 8) {
+        __m256 v = _mm256_loadu_ps(m + c);
+        __m256 d = _mm256_loadu_ps(dir + c);
+        __m256 k0 = _mm256_cmp_ps(d, _mm256_set1_ps(DIR_0), _CMP_EQ_OQ);
+        __m256 k1 = _mm256_cmp_ps(d, _mm256_set1_ps(DIR_45), _CMP_EQ_OQ);
+        __m256 k2 = _mm256_cmp_ps(d, _mm256_set1_ps(DIR_90), _CMP_EQ_OQ);
+        __m256 up = _mm256_blendv_ps(_mm256_blendv_ps(_mm256_blendv_ps(
+                        _mm256_loadu_ps(b + c - 1), _mm256_loadu_ps(b + c), k2),
+                        _mm256_loadu_ps(b + c + 1), k1),
+                        _mm256_loadu_ps(m + c + 1), k0);
+        __m256 dw = _mm256_blendv_ps(_mm256_blendv_ps(_mm256_blendv_ps(
+                        _mm256_loadu_ps(t + c + 1), _mm256_loadu_ps(t + c), k2),
+                        _mm256_loadu_ps(t + c - 1), k1),
+                        _mm256_loadu_ps(m + c - 1), k0);
+        __m256 suppressed = _mm256_or_ps(_mm256_cmp_ps(up, v, _CMP_GT_OQ),
+                                         _mm256_cmp_ps(dw, v, _CMP_GT_OQ));
+        __m256 keep = _mm256_andnot_ps(suppressed,
+                                       _mm256_cmp_ps(v, vlo, _CMP_GE_OQ));
+        __m256 val = _mm256_blendv_ps(weak, strong,
+                                      _mm256_cmp_ps(v, vhi, _CMP_GE_OQ));
+        __m256i q = _mm256_cvttps_epi32(_mm256_and_ps(keep, val));
+        __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q),
+                                      _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64((__m128i*)(out + c), _mm_packus_epi16(q16, q16));
+    }
+    nms_row_sse2(t, m, b, dir, c, c1, lo, hi, out);
+}
+#endif
+
+typedef void (*gradient_row_fn)(const float*, const float*, const float*,
+                                int, int, float, float, bool, float*, float*);
+typedef void (*nms_row_fn)(const float*, const float*, const float*,
+                           const float*, int, int, float, float, uchar*);
+
+/* gradient magnitude per histogram bin, a black to white step is bin 255 */
+static float level_scale(bool useSobel)
+{
+    return CANNY_LEVELS / (useSobel ? 4.0f : 16.0f);
+}
+
+/* with a histogram, local maxima get the bin of their magnitude as level
+ * instead of being classified, and every magnitude is counted */
+static void gradient_nms_rows(const Mat& input, Mat& state, int row_begin,
+                              int row_end, float min_thresh, float max_thresh,
+                              bool n8, bool useSobel, int* histogram)
+{
+    const int rows = input.rows;
+    const int cols = input.cols;
+    /* outer and center coefficients of the Sobel or Scharr kernel */
+    const float ka = useSobel ? 1 : 3;
+    const float kb = useSobel ? 2 : 10;
+    const float scale = level_scale(useSobel);
+    if (histogram != nullptr) {
+        /* every maximum with a level above zero is kept */
+        min_thresh = 1 / scale;
+        max_thresh = FLT_MAX;
+    }
+
+    gradient_row_fn grad = gradient_row;
+    nms_row_fn nms = nms_row;
+#ifdef COMPOSER_SSE2
+    grad = gradient_row_sse2;
+    nms = nms_row_sse2;
+#endif
+#ifdef COMPOSER_AVX2
+    if (cpu_has_avx2()) {
+        grad = gradient_row_avx2;
+        nms = nms_row_avx2;
+    }
+#endif
+
+    /* border pixels are never edges */
+    if (row_begin == 0) {
+        state.row(0).setTo(EDGE_NONE);
+    }
+    if (row_end == rows && rows > 0) {
+        state.row(rows - 1).setTo(EDGE_NONE);
+    }
+    const int r0 = std::max(row_begin, 1);
+    const int r1 = std::min(row_end, rows - 1);
+    if (cols < 3 || r0 >= r1) {
+        state.rowRange(r0, std::max(r0, r1)).setTo(EDGE_NONE);
+        return;
+    }
 
-        for (int i = -1; i <= 1; i++) {
-            for (int j = -1; j <= 1; j++) {
-                if (i != 0 && j != 0) {
-                    if (output.at<float>(r + i, c + j) == WEAK_GRAD) {
-                        output.at<float>(r + i, c + j) = STRONG_GRAD;
-                        strong.push_back(Point_<int>(r + i, c + j));
-                    }
+    /* rolling buffer with the magnitude and direction of three rows,
+     * kept per thread between frames */
+    static thread_local Mat rows_buffer;
+    Mat buffer = buffer_view(rows_buffer, Size(cols, 6), CV_32FC1);
+    for (int r = r0 - 1; r <= r1; r++) {
+        const float* t = input.ptr<float>(borderInterpolate(r - 1, rows,
+                                                            BORDER_REFLECT_101));
+        const float* m = input.ptr<float>(r);
+        const float* b = input.ptr<float>(borderInterpolate(r + 1, rows,
+                                                            BORDER_REFLECT_101));
+        float* mag = buffer.ptr<float>(r % 3);
+        float* dir = buffer.ptr<float>(3 + r % 3);
+        gradient_px(t, m, b, 1, 0, 1, ka, kb, n8, mag, dir);
+        grad(t, m, b, 1, cols - 1, ka, kb, n8, mag, dir);
+        gradient_px(t, m, b, cols - 2, cols - 1, cols - 2, ka, kb, n8, mag, dir);
+
+        /* the row above now has both of its neighbours */
+        int s = r - 1;
+        if (s < r0) {
+            continue;
+        }
+        uchar* out = state.ptr<uchar>(s);
+        out[0] = EDGE_NONE;
+        out[cols - 1] = EDGE_NONE;
+        nms(buffer.ptr<float>((s - 1) % 3), buffer.ptr<float>(s % 3),
+            buffer.ptr<float>((s + 1) % 3), buffer.ptr<float>(3 + s % 3),
+            1, cols - 1, min_thresh, max_thresh, out);
+
+        /* the row is still in cache, so the histogram costs no extra pass */
+        if (histogram != nullptr) {
+            const float* mid = buffer.ptr<float>(s % 3);
+            for (int c = 1; c < cols - 1; c++) {
+                int level = std::min((int)(mid[c] * scale), CANNY_LEVELS - 1);
+                histogram[level]++;
+                if (out[c] != EDGE_NONE) {
+                    out[c] = (uchar)std::max(level, 1);
                 }
             }
         }
     }
+}
+
+void gradient_nms(const Mat& input, Mat& state, int row_begin, int row_end,
+                  float min_thresh, float max_thresh, bool n8, bool useSobel)
+{
+    gradient_nms_rows(input, state, row_begin, row_end, min_thresh, max_thresh,
+                      n8, useSobel, nullptr);
+}
+
+void gradient_nms_levels(const Mat& input, Mat& levels, int row_begin,
+                         int row_end, bool n8, bool useSobel, int* histogram)
+{
+    gradient_nms_rows(input, levels, row_begin, row_end, 0, 0, n8, useSobel,
+                      histogram);
+}
 
-    /* this list was originally populated by pixels with weak gradient */
-    for (auto p: weak) {
-        if (output.at<float>(p.x, p.y) == WEAK_GRAD) {
-            output.at<float>(p.x, p.y) = 0;
+/* magnitude of the histogram bin where a fraction of the pixels is below */
+static float histogram_percentile(const int* histogram, float scale, float p)
+{
+    long total = 0;
+    for (int i = 0; i < CANNY_LEVELS; i++) {
+        total += histogram[i];
+    }
+    long count = 0;
+    for (int i = 0; i < CANNY_LEVELS; i++) {
+        count += histogram[i];
+        if (count >= p * total) {
+            return (i + 1) / scale;
         }
     }
+    return CANNY_LEVELS / scale;
 }
 
-void canny_edges(const Mat& bgr_input, Mat& output,
+/* Otsu's threshold, splitting the magnitudes in the two classes with the
+ * largest variance between them */
+static float histogram_otsu(const int* histogram, float scale)
+{
+    double total = 0, sum = 0;
+    for (int i = 0; i < CANNY_LEVELS; i++) {
+        total += histogram[i];
+        sum += (double)i * histogram[i];
+    }
+    double count = 0, below = 0, best = -1;
+    int split = 0;
+    for (int i = 0; i < CANNY_LEVELS - 1; i++) {
+        count += histogram[i];
+        below += (double)i * histogram[i];
+        if (count == 0 || count == total) {
+            continue;
+        }
+        double mean_lo = below / count;
+        double mean_hi = (sum - below) / (total - count);
+        double between = count * (total - count) * (mean_lo - mean_hi)
+                                                 * (mean_lo - mean_hi);
+        if (between > best) {
+            best = between;
+            split = i;
+        }
+    }
+    return (split + 1) / scale;
+}
+
+/* thresholds of a frame from its magnitude histogram, smoothed with the
+ * thresholds of the previous frames */
+static void auto_thresholds(const int* histogram, bool useSobel,
+                            CannyAutoThresh& auto_thresh,
+                            float& min_thresh, float& max_thresh)
+{
+    const float scale = level_scale(useSobel);
+    const float ratio = max_thresh > 0 ? min_thresh / max_thresh : 0.5f;
+    float lo, hi;
+    if (auto_thresh.mode == CannyAutoThresh::MAX) {
+        int top = CANNY_LEVELS - 1;
+        while (top > 0 && histogram[top] == 0) {
+            top--;
+        }
+        const float max_mag = (top + 1) / scale;
+        hi = std::min(max_mag, max_mag * max_thresh);
+        lo = std::min(max_mag, max_mag * min_thresh);
+    } else {
+        hi = auto_thresh.mode == CannyAutoThresh::OTSU
+           ? histogram_otsu(histogram, scale)
+           : histogram_percentile(histogram, scale, auto_thresh.percentile);
+        lo = hi * ratio;
+    }
+
+    if (auto_thresh.high >= 0) {
+        const float a = auto_thresh.smoothing;
+        hi = a * auto_thresh.high + (1 - a) * hi;
+        lo = a * auto_thresh.low + (1 - a) * lo;
+    }
+    auto_thresh.high = max_thresh = hi;
+    auto_thresh.low = min_thresh = lo;
+}
+
+/* turn the levels of local maxima into edge states */
+static void classify_levels(Mat& state, const uchar* lut)
+{
+    for (int r = 0; r < state.rows; r++) {
+        uchar* row = state.ptr<uchar>(r);
+        for (int c = 0; c < state.cols; c++) {
+            row[c] = lut[row[c]];
+        }
+    }
+}
+
+/* fixed point gradient and non-maximal suppression
+ *
+ * works on the 8-bit gray image, so derivatives are exact 16-bit integers
+ * and the magnitude is the integer L1 norm or squared L2 norm. directions
+ * are binned by comparing the derivatives, with the tangent of 22.5 degrees
+ * in 16-bit fixed point for the diagonal bins, so neither atan nor sqrt is
+ * needed. the squared L2 magnitude orders pixels like the float magnitude,
+ * only bins of gradients within a rounding error of a bin edge can differ */
+
+/* tan(22.5) * 65536 */
+static const int TAN_22_5 = 27146;
+
+/* a threshold on the gradient of the 1/256 scaled image as an integer
+ * magnitude of the 8-bit image */
+static int fixed_thresh(float thresh, bool l1)
+{
+    double t = std::max(0.0, thresh * 256.0);
+    t = std::ceil(l1 ? t : t * t);
+    return (int)std::min(t, (double)INT_MAX);
+}
+
+/* direction bin from the signs and ratio of the derivatives */
+static inline uchar fixed_dir(int dx, int dy, bool n8)
+{
+    int ax = std::abs(dx), ay = std::abs(dy);
+    bool same = (dx > 0 && dy > 0) || (dx < 0 && dy < 0);
+    if (n8) {
+        if (ay <= (ax * TAN_22_5) >> 16) {
+            return (uchar)DIR_0;
+        }
+        if (ax <= (ay * TAN_22_5) >> 16) {
+            return (uchar)DIR_90;
+        }
+        return (uchar)(same ? DIR_45 : DIR_135);
+    }
+    return (uchar)((ay < ax || (ay == ax && !same)) ? DIR_0 : DIR_90);
+}
+
+static inline void fixed_gradient_px(const uchar* t, const uchar* m,
+                                     const uchar* b, int l, int c, int r,
+                                     int ka, int kb, bool n8, bool l1,
+                                     int* mag, uchar* dir)
+{
+    int dx = ka * (t[r] - t[l]) + kb * (m[r] - m[l]) + ka * (b[r] - b[l]);
+    int dy = ka * (b[l] - t[l]) + kb * (b[c] - t[c]) + ka * (b[r] - t[r]);
+    mag[c] = l1 ? std::abs(dx) + std::abs(dy) : dx * dx + dy * dy;
+    dir[c] = fixed_dir(dx, dy, n8);
+}
+
+static void fixed_gradient_row(const uchar* t, const uchar* m, const uchar* b,
+                               int c0, int c1, int ka, int kb, bool n8,
+                               bool l1, int* mag, uchar* dir)
+{
+    for (int c = c0; c < c1; c++) {
+        fixed_gradient_px(t, m, b, c - 1, c, c + 1, ka, kb, n8, l1, mag, dir);
+    }
+}
+
+static void fixed_nms_row(const int* t, const int* m, const int* b,
+                          const uchar* dir, int c0, int c1, int lo, int hi,
+                          uchar* out)
+{
+    for (int c = c0; c < c1; c++) {
+        int v = m[c];
+        int up, dw;
+        if (dir[c] == DIR_0) {
+            up = m[c + 1]; dw = m[c - 1];
+        } else if (dir[c] == DIR_45) {
+            up = b[c + 1]; dw = t[c - 1];
+        } else if (dir[c] == DIR_90) {
+            up = b[c];     dw = t[c];
+        } else {
+            up = b[c - 1]; dw = t[c + 1];
+        }
+        if (v >= lo && !(up > v || dw > v)) {
+            out[c] = v >= hi ? EDGE_STRONG : EDGE_WEAK;
+        } else {
+            out[c] = EDGE_NONE;
+        }
+    }
+}
+
+#ifdef COMPOSER_SSE2
+static inline __m128i select_si128(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+/* direction bins of eight pixels from 16-bit derivatives */
+static inline __m128i fixed_dir_sse2(__m128i dx, __m128i dy, bool n8)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i ax = _mm_max_epi16(dx, _mm_sub_epi16(zero, dx));
+    __m128i ay = _mm_max_epi16(dy, _mm_sub_epi16(zero, dy));
+    __m128i same = _mm_or_si128(
+        _mm_and_si128(_mm_cmpgt_epi16(dx, zero), _mm_cmpgt_epi16(dy, zero)),
+        _mm_and_si128(_mm_cmplt_epi16(dx, zero), _mm_cmplt_epi16(dy, zero)));
+    if (n8) {
+        const __m128i tan = _mm_set1_epi16((short)TAN_22_5);
+        /* DIR_0 is zero, so it is left where neither mask is set */
+        __m128i not0 = _mm_cmpgt_epi16(ay, _mm_mulhi_epu16(ax, tan));
+        __m128i not90 = _mm_cmpgt_epi16(ax, _mm_mulhi_epu16(ay, tan));
+        __m128i d = select_si128(same, _mm_set1_epi16((short)DIR_45),
+                                 _mm_set1_epi16((short)DIR_135));
+        d = select_si128(not90, d, _mm_set1_epi16((short)DIR_90));
+        return _mm_and_si128(not0, d);
+    }
+    __m128i is0 = _mm_or_si128(_mm_cmpgt_epi16(ax, ay),
+                               _mm_andnot_si128(same, _mm_cmpeq_epi16(ax, ay)));
+    return _mm_andnot_si128(is0, _mm_set1_epi16((short)DIR_90));
+}
+
+static inline __m128i load_u8_epi16(const uchar* p)
+{
+    return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p),
+                             _mm_setzero_si128());
+}
+
+static void fixed_gradient_row_sse2(const uchar* t, const uchar* m,
+                                    const uchar* b, int c0, int c1, int ka,
+                                    int kb, bool n8, bool l1, int* mag,
+                                    uchar* dir)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i va = _mm_set1_epi16((short)ka);
+    const __m128i vb = _mm_set1_epi16((short)kb);
+    int c = c0;
+    for (; c + 8 <= c1; c += 8) {
+        __m128i tl = load_u8_epi16(t + c - 1), tc = load_u8_epi16(t + c),
+                tr = load_u8_epi16(t + c + 1);
+        __m128i bl = load_u8_epi16(b + c - 1), bc = load_u8_epi16(b + c),
+                br = load_u8_epi16(b + c + 1);
+        __m128i dx = _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(va, _mm_sub_epi16(tr, tl)),
+                          _mm_mullo_epi16(vb, _mm_sub_epi16(
+                              load_u8_epi16(m + c + 1),
+                              load_u8_epi16(m + c - 1)))),
+            _mm_mullo_epi16(va, _mm_sub_epi16(br, bl)));
+        __m128i dy = _mm_add_epi16(
+            _mm_add_epi16(_mm_mullo_epi16(va, _mm_sub_epi16(bl, tl)),
+                          _mm_mullo_epi16(vb, _mm_sub_epi16(bc, tc))),
+            _mm_mullo_epi16(va, _mm_sub_epi16(br, tr)));
+
+        __m128i lo, hi;
+        if (l1) {
+            __m128i sum = _mm_add_epi16(_mm_max_epi16(dx, _mm_sub_epi16(zero, dx)),
+                                        _mm_max_epi16(dy, _mm_sub_epi16(zero, dy)));
+            lo = _mm_unpacklo_epi16(sum, zero);
+            hi = _mm_unpackhi_epi16(sum, zero);
+        } else {
+            /* pairs of dx and dy, multiplied and summed in 32 bits */
+            __m128i xy_lo = _mm_unpacklo_epi16(dx, dy);
+            __m128i xy_hi = _mm_unpackhi_epi16(dx, dy);
+            lo = _mm_madd_epi16(xy_lo, xy_lo);
+            hi = _mm_madd_epi16(xy_hi, xy_hi);
+        }
+        _mm_storeu_si128((__m128i*)(mag + c), lo);
+        _mm_storeu_si128((__m128i*)(mag + c + 4), hi);
+        __m128i d = fixed_dir_sse2(dx, dy, n8);
+        _mm_storel_epi64((__m128i*)(dir + c), _mm_packus_epi16(d, d));
+    }
+    fixed_gradient_row(t, m, b, c, c1, ka, kb, n8, l1, mag, dir);
+}
+
+static void fixed_nms_row_sse2(const int* t, const int* m, const int* b,
+                               const uchar* dir, int c0, int c1, int lo,
+                               int hi, uchar* out)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i vlo = _mm_set1_epi32(lo), vhi = _mm_set1_epi32(hi);
+    const __m128i weak = _mm_set1_epi32(EDGE_WEAK);
+    const __m128i strong = _mm_set1_epi32(EDGE_STRONG);
+    int c = c0;
+    for (; c + 4 <= c1; c += 4) {
+        int bins;
+        std::memcpy(&bins, dir + c, sizeof(bins));
+        __m128i d = _mm_unpacklo_epi16(
+            _mm_unpacklo_epi8(_mm_cvtsi32_si128(bins), zero), zero);
+        __m128i v = _mm_loadu_si128((const __m128i*)(m + c));
+        __m128i k0 = _mm_cmpeq_epi32(d, _mm_set1_epi32((int)DIR_0));
+        __m128i k1 = _mm_cmpeq_epi32(d, _mm_set1_epi32((int)DIR_45));
+        __m128i k2 = _mm_cmpeq_epi32(d, _mm_set1_epi32((int)DIR_90));
+        __m128i up = select_si128(k0, _mm_loadu_si128((const __m128i*)(m + c + 1)),
+                     select_si128(k1, _mm_loadu_si128((const __m128i*)(b + c + 1)),
+                     select_si128(k2, _mm_loadu_si128((const __m128i*)(b + c)),
+                                      _mm_loadu_si128((const __m128i*)(b + c - 1)))));
+        __m128i dw = select_si128(k0, _mm_loadu_si128((const __m128i*)(m + c - 1)),
+                     select_si128(k1, _mm_loadu_si128((const __m128i*)(t + c - 1)),
+                     select_si128(k2, _mm_loadu_si128((const __m128i*)(t + c)),
+                                      _mm_loadu_si128((const __m128i*)(t + c + 1)))));
+        __m128i suppressed = _mm_or_si128(_mm_or_si128(_mm_cmpgt_epi32(up, v),
+                                                       _mm_cmpgt_epi32(dw, v)),
+                                          _mm_cmpgt_epi32(vlo, v));
+        __m128i val = select_si128(_mm_cmpgt_epi32(vhi, v), weak, strong);
+        __m128i q = _mm_andnot_si128(suppressed, val);
+        q = _mm_packs_epi32(q, q);
+        const int packed = _mm_cvtsi128_si32(_mm_packus_epi16(q, q));
+        std::memcpy(out + c, &packed, sizeof(packed));
+    }
+    fixed_nms_row(t, m, b, dir, c, c1, lo, hi, out);
+}
+#endif
+
+#ifdef COMPOSER_AVX2
+/* direction bins of sixteen pixels from 16-bit derivatives */
+TARGET_AVX2 static inline __m256i fixed_dir_avx2(__m256i dx, __m256i dy, bool n8)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i ax = _mm256_abs_epi16(dx);
+    __m256i ay = _mm256_abs_epi16(dy);
+    __m256i same = _mm256_or_si256(
+        _mm256_and_si256(_mm256_cmpgt_epi16(dx, zero), _mm256_cmpgt_epi16(dy, zero)),
+        _mm256_and_si256(_mm256_cmpgt_epi16(zero, dx), _mm256_cmpgt_epi16(zero, dy)));
+    if (n8) {
+        const __m256i tan = _mm256_set1_epi16((short)TAN_22_5);
+        __m256i not0 = _mm256_cmpgt_epi16(ay, _mm256_mulhi_epu16(ax, tan));
+        __m256i not90 = _mm256_cmpgt_epi16(ax, _mm256_mulhi_epu16(ay, tan));
+        __m256i d = _mm256_blendv_epi8(_mm256_set1_epi16((short)DIR_135),
+                                       _mm256_set1_epi16((short)DIR_45), same);
+        d = _mm256_blendv_epi8(_mm256_set1_epi16((short)DIR_90), d, not90);
+        return _mm256_and_si256(not0, d);
+    }
+    __m256i is0 = _mm256_or_si256(_mm256_cmpgt_epi16(ax, ay),
+                                  _mm256_andnot_si256(same, _mm256_cmpeq_epi16(ax, ay)));
+    return _mm256_andnot_si256(is0, _mm256_set1_epi16((short)DIR_90));
+}
+
+TARGET_AVX2 static inline __m256i load_u8_epi16_avx2(const uchar* p)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+}
+
+TARGET_AVX2
+static void fixed_gradient_row_avx2(const uchar* t, const uchar* m,
+                                    const uchar* b, int c0, int c1, int ka,
+                                    int kb, bool n8, bool l1, int* mag,
+                                    uchar* dir)
+{
+    const __m256i va = _mm256_set1_epi16((short)ka);
+    const __m256i vb = _mm256_set1_epi16((short)kb);
+    int c = c0;
+    /* the right neighbours end at c + 16 */
+    for (; c + 16 <= c1; c += 16) {
+        __m256i tl = load_u8_epi16_avx2(t + c - 1), tc = load_u8_epi16_avx2(t + c),
+                tr = load_u8_epi16_avx2(t + c + 1);
+        __m256i bl = load_u8_epi16_avx2(b + c - 1), bc = load_u8_epi16_avx2(b + c),
+                br = load_u8_epi16_avx2(b + c + 1);
+        __m256i dx = _mm256_add_epi16(
+            _mm256_add_epi16(_mm256_mullo_epi16(va, _mm256_sub_epi16(tr, tl)),
+                             _mm256_mullo_epi16(vb, _mm256_sub_epi16(
+                                 load_u8_epi16_avx2(m + c + 1),
+                                 load_u8_epi16_avx2(m + c - 1)))),
+            _mm256_mullo_epi16(va, _mm256_sub_epi16(br, bl)));
+        __m256i dy = _mm256_add_epi16(
+            _mm256_add_epi16(_mm256_mullo_epi16(va, _mm256_sub_epi16(bl, tl)),
+                             _mm256_mullo_epi16(vb, _mm256_sub_epi16(bc, tc))),
+            _mm256_mullo_epi16(va, _mm256_sub_epi16(br, tr)));
+
+        /* widen each half of the row to 32 bits in pixel order */
+        for (int half = 0; half < 2; half++) {
+            __m256i x = _mm256_cvtepi16_epi32(half ? _mm256_extracti128_si256(dx, 1)
+                                                   : _mm256_castsi256_si128(dx));
+            __m256i y = _mm256_cvtepi16_epi32(half ? _mm256_extracti128_si256(dy, 1)
+                                                   : _mm256_castsi256_si128(dy));
+            __m256i v = l1 ? _mm256_add_epi32(_mm256_abs_epi32(x), _mm256_abs_epi32(y))
+                           : _mm256_add_epi32(_mm256_mullo_epi32(x, x),
+                                              _mm256_mullo_epi32(y, y));
+            _mm256_storeu_si256((__m256i*)(mag + c + 8 * half), v);
+        }
+        __m256i d = fixed_dir_avx2(dx, dy, n8);
+        __m128i d8 = _mm_packus_epi16(_mm256_castsi256_si128(d),
+                                      _mm256_extracti128_si256(d, 1));
+        _mm_storeu_si128((__m128i*)(dir + c), d8);
+    }
+    fixed_gradient_row_sse2(t, m, b, c, c1, ka, kb, n8, l1, mag, dir);
+}
+
+TARGET_AVX2
+static void fixed_nms_row_avx2(const int* t, const int* m, const int* b,
+                               const uchar* dir, int c0, int c1, int lo,
+                               int hi, uchar* out)
+{
+    const __m256i vlo = _mm256_set1_epi32(lo), vhi = _mm256_set1_epi32(hi);
+    const __m256i weak = _mm256_set1_epi32(EDGE_WEAK);
+    const __m256i strong = _mm256_set1_epi32(EDGE_STRONG);
+    int c = c0;
+    for (; c + 8 <= c1; c += 8) {
+        __m256i d = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(dir + c)));
+        __m256i v = _mm256_loadu_si256((const __m256i*)(m + c));
+        __m256i k0 = _mm256_cmpeq_epi32(d, _mm256_set1_epi32((int)DIR_0));
+        __m256i k1 = _mm256_cmpeq_epi32(d, _mm256_set1_epi32((int)DIR_45));
+        __m256i k2 = _mm256_cmpeq_epi32(d, _mm256_set1_epi32((int)DIR_90));
+        __m256i up = _mm256_blendv_epi8(_mm256_blendv_epi8(_mm256_blendv_epi8(
+                         _mm256_loadu_si256((const __m256i*)(b + c - 1)),
+                         _mm256_loadu_si256((const __m256i*)(b + c)), k2),
+                         _mm256_loadu_si256((const __m256i*)(b + c + 1)), k1),
+                         _mm256_loadu_si256((const __m256i*)(m + c + 1)), k0);
+        __m256i dw = _mm256_blendv_epi8(_mm256_blendv_epi8(_mm256_blendv_epi8(
+                         _mm256_loadu_si256((const __m256i*)(t + c + 1)),
+                         _mm256_loadu_si256((const __m256i*)(t + c)), k2),
+                         _mm256_loadu_si256((const __m256i*)(t + c - 1)), k1),
+                         _mm256_loadu_si256((const __m256i*)(m + c - 1)), k0);
+        __m256i suppressed = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpgt_epi32(up, v), _mm256_cmpgt_epi32(dw, v)),
+            _mm256_cmpgt_epi32(vlo, v));
+        __m256i val = _mm256_blendv_epi8(strong, weak, _mm256_cmpgt_epi32(vhi, v));
+        __m256i q = _mm256_andnot_si256(suppressed, val);
+        __m128i q16 = _mm_packs_epi32(_mm256_castsi256_si128(q),
+                                      _mm256_extracti128_si256(q, 1));
+        _mm_storel_epi64((__m128i*)(out + c), _mm_packus_epi16(q16, q16));
+    }
+    fixed_nms_row_sse2(t, m, b, dir, c, c1, lo, hi, out);
+}
+#endif
+
+typedef void (*fixed_gradient_row_fn)(const uchar*, const uchar*, const uchar*,
+                                      int, int, int, int, bool, bool, int*,
+                                      uchar*);
+typedef void (*fixed_nms_row_fn)(const int*, const int*, const int*,
+                                 const uchar*, int, int, int, int, uchar*);
+
+void gradient_nms_fixed(const Mat& gray, Mat& state, int row_begin,
+                        int row_end, float min_thresh, float max_thresh,
+                        bool n8, bool useSobel, bool l1)
+{
+    const int rows = gray.rows;
+    const int cols = gray.cols;
+    const int ka = useSobel ? 1 : 3;
+    const int kb = useSobel ? 2 : 10;
+    const int lo = fixed_thresh(min_thresh, l1);
+    const int hi = fixed_thresh(max_thresh, l1);
+
+    fixed_gradient_row_fn grad = fixed_gradient_row;
+    fixed_nms_row_fn nms = fixed_nms_row;
+#ifdef COMPOSER_SSE2
+    grad = fixed_gradient_row_sse2;
+    nms = fixed_nms_row_sse2;
+#endif
+#ifdef COMPOSER_AVX2
+    if (cpu_has_avx2()) {
+        grad = fixed_gradient_row_avx2;
+        nms = fixed_nms_row_avx2;
+    }
+#endif
+
+    if (row_begin == 0) {
+        state.row(0).setTo(EDGE_NONE);
+    }
+    if (row_end == rows && rows > 0) {
+        state.row(rows - 1).setTo(EDGE_NONE);
+    }
+    const int r0 = std::max(row_begin, 1);
+    const int r1 = std::min(row_end, rows - 1);
+    if (cols < 3 || r0 >= r1) {
+        state.rowRange(r0, std::max(r0, r1)).setTo(EDGE_NONE);
+        return;
+    }
+
+    /* rolling buffers with the magnitude and direction of three rows,
+     * kept per thread between frames */
+    static thread_local Mat mags_buffer, dirs_buffer;
+    Mat mags = buffer_view(mags_buffer, Size(cols, 3), CV_32SC1);
+    Mat dirs = buffer_view(dirs_buffer, Size(cols, 3), CV_8UC1);
+    for (int r = r0 - 1; r <= r1; r++) {
+        const uchar* t = gray.ptr<uchar>(borderInterpolate(r - 1, rows,
+                                                           BORDER_REFLECT_101));
+        const uchar* m = gray.ptr<uchar>(r);
+        const uchar* b = gray.ptr<uchar>(borderInterpolate(r + 1, rows,
+                                                           BORDER_REFLECT_101));
+        int* mag = mags.ptr<int>(r % 3);
+        uchar* dir = dirs.ptr<uchar>(r % 3);
+        fixed_gradient_px(t, m, b, 1, 0, 1, ka, kb, n8, l1, mag, dir);
+        grad(t, m, b, 1, cols - 1, ka, kb, n8, l1, mag, dir);
+        fixed_gradient_px(t, m, b, cols - 2, cols - 1, cols - 2, ka, kb, n8, l1,
+                          mag, dir);
+
+        int s = r - 1;
+        if (s < r0) {
+            continue;
+        }
+        uchar* out = state.ptr<uchar>(s);
+        out[0] = EDGE_NONE;
+        out[cols - 1] = EDGE_NONE;
+        nms(mags.ptr<int>((s - 1) % 3), mags.ptr<int>(s % 3),
+            mags.ptr<int>((s + 1) % 3), dirs.ptr<uchar>(s % 3),
+            1, cols - 1, lo, hi, out);
+    }
+}
+
+/* edge tracking, within each strip and then across strips, and the output
+ * levels are classified with lut first when there is one */
+static void link_to_output(Mat& state, Mat& output, bool n8, ThreadPool* pool,
+                           const std::vector<int>& bounds, const uchar* lut)
+{
+    const int strips = (int)bounds.size() - 1;
+    {
+        TRACE_SCOPE("canny edge linking");
+        parallel_for(pool, 0, strips, [&](int i) {
+            if (lut != nullptr) {
+                Mat strip_state = state.rowRange(bounds[i], bounds[i + 1]);
+                classify_levels(strip_state, lut);
+            }
+            link_edges(state, n8, bounds[i], bounds[i + 1]);
+        });
+        if (strips > 1) {
+            link_strip_borders(state, n8,
+                               std::vector<int>(bounds.begin() + 1, bounds.end() - 1));
+        }
+    }
+
+    {
+        TRACE_SCOPE("canny output");
+        output.create(state.size(), CV_32FC1);
+        parallel_for(pool, 0, strips, [&](int i) {
+            Mat strip_output = output.rowRange(bounds[i], bounds[i + 1]);
+            edges_to_output(state.rowRange(bounds[i], bounds[i + 1]), strip_output);
+        });
+    }
+}
+
+void canny_edges(const Mat& frame, Mat& output,
                  bool save, bool gui,
                  float min_thresh, float max_thresh, bool n8,
                  bool useSobel, std::string interm_name_prefix,
-                 bool dynamic_thresh)
+                 bool dynamic_thresh, ThreadPool* pool, Workspace* workspace,
+                 int gradient, CannyAutoThresh* auto_thresh)
 {
-    /* convert to grayscale and smooth the result */
-    Mat input;
+    /* split the image in one strip of rows per thread
+     * every stage finishes on all strips before the next one starts,
+     * since gradients and suppression read two rows past their strip */
+    const int strips = strip_count(pool, frame.rows, 8);
+    const std::vector<int> bounds = split_rows(frame.rows, strips);
 
-    cvtColor(bgr_input, input, CV_BGR2GRAY);
-    input.convertTo(input, CV_32FC1, 1.0f/256.0f);
+    CannyAutoThresh max_thresh_only;
+    if (auto_thresh == nullptr && dynamic_thresh) {
+        max_thresh_only.mode = CannyAutoThresh::MAX;
+        auto_thresh = &max_thresh_only;
+    }
+    const bool adaptive = auto_thresh != nullptr
+                       && auto_thresh->mode != CannyAutoThresh::OFF;
+    /* the magnitude histogram is only built on the float path */
+    const bool fixed = gradient != CANNY_FLOAT && !adaptive;
+
+    /* the 8-bit gray image and its floats, the frame itself when it is
+     * one of them. colour frames go through the gray image either way */
+    const int type = frame.type();
+    const bool colour = type != CV_8UC1 && type != CV_32FC1;
+    Mat gray, input;
+    if (type == CV_8UC1) {
+        gray = frame;
+    } else if (colour || fixed) {
+        gray = workspace_mat(workspace, "gray", frame.size(), CV_8UC1);
+    }
+    if (type == CV_32FC1) {
+        input = frame;
+    } else if (!fixed || save) {
+        input = workspace_mat(workspace, "input", frame.size(), CV_32FC1);
+    }
+
+    if (colour || (type == CV_32FC1 ? fixed : !input.empty())) {
+        TRACE_SCOPE("canny gray");
+        parallel_for(pool, 0, strips, [&](int i) {
+            Mat strip = frame.rowRange(bounds[i], bounds[i + 1]);
+            Mat strip_gray;
+            if (!gray.empty()) {
+                strip_gray = gray.rowRange(bounds[i], bounds[i + 1]);
+            }
+            if (colour) {
+                cvtColor(strip, strip_gray, CV_BGR2GRAY);
+            } else if (type == CV_32FC1) {
+                strip.convertTo(strip_gray, CV_8UC1, 256);
+            }
+            if (type != CV_32FC1 && !input.empty()) {
+                Mat strip_input = input.rowRange(bounds[i], bounds[i + 1]);
+                strip_gray.convertTo(strip_input, CV_32FC1, 1.0f/256.0f);
+            }
+        });
+    }
 
     save_mat(interm_name_prefix + "gray", input, save, gui);
 
-    output = Mat(input.size(), CV_32FC1);
+    /* edge state of every pixel */
+    Mat state = workspace_mat(workspace, "state", frame.size(), CV_8UC1);
 
-    /* find gradient magnitude and direction using Sobel filters */
-    Mat kernel;
-    if (useSobel) {
-        kernel = Mat ((Mat_<float>(3, 3) <<
-                       -1, 0, 1,
-                       -2, 0, 2,
-                       -1, 0, 1));
+    /* with adaptive thresholds, suppression leaves the magnitude level of
+     * each maximum and the thresholds come from the histogram of the
+     * levels, found per strip in the same pass */
+    uchar lut[CANNY_LEVELS];
+    if (adaptive) {
+        Mat histograms = workspace_mat(workspace, "histograms",
+                                       Size(CANNY_LEVELS, strips), CV_32SC1);
+        histograms.setTo(0);
+        {
+            TRACE_SCOPE("canny gradient and suppression");
+            parallel_for(pool, 0, strips, [&](int i) {
+                gradient_nms_levels(input, state, bounds[i], bounds[i + 1], n8,
+                                    useSobel, histograms.ptr<int>(i));
+            });
+        }
+        int* histogram = histograms.ptr<int>(0);
+        for (int i = 1; i < strips; i++) {
+            for (int l = 0; l < CANNY_LEVELS; l++) {
+                histogram[l] += histograms.ptr<int>(i)[l];
+            }
+        }
+        auto_thresholds(histogram, useSobel, *auto_thresh,
+                        min_thresh, max_thresh);
+
+        /* a level is weak or strong when its bin reaches the threshold */
+        const float scale = level_scale(useSobel);
+        const float lo = std::max(min_thresh * scale, 1.0f);
+        const float hi = std::max(max_thresh * scale, 1.0f);
+        for (int l = 0; l < CANNY_LEVELS; l++) {
+            lut[l] = l >= hi ? EDGE_STRONG : (l >= lo ? EDGE_WEAK : EDGE_NONE);
+        }
+        if (save) {
+            classify_levels(state, lut);
+        }
+    } else if (fixed) {
+        TRACE_SCOPE("canny gradient and suppression");
+        parallel_for(pool, 0, strips, [&](int i) {
+            gradient_nms_fixed(gray, state, bounds[i], bounds[i + 1],
+                               min_thresh, max_thresh, n8, useSobel,
+                               gradient == CANNY_FIXED_L1);
+        });
     } else {
-        kernel = Mat ((Mat_<float>(3, 3) <<
-                       -3,  0,  3,
-                       -10, 0, 10,
-                       -3,  0,  3));
-    }
-    Mat mag (input.size(), input.type());
-    Mat dir (input.size(), input.type());
-    polarGradient(input, kernel, mag, dir);
-
-    /* try to dynamically calculate thresholds */
-    if (dynamic_thresh) {
-        calc_dynamic_thresh(mag, dir, min_thresh, max_thresh);
-    }
-
-    /* vectors of all weak and strong pixels */
-    std::list<Point_<int> > strong, weak;
-    non_max_suppresion(mag, dir, // inputs
-                       output, strong, weak, // output
-                       min_thresh, max_thresh, n8 /* parameters */);
-
-    dir /= 360;
-    // save_mat("gradient_direction", dir, save, gui);
-    // save_mat("gradient_magnitude", mag, save, gui);
-    save_mat(interm_name_prefix + "non_maximal_suppression"
-                      + (n8 ? std::string("8") : std::string("4")),
-                      output, save, gui);
+        TRACE_SCOPE("canny gradient and suppression");
+        /* find gradient magnitude and direction using Sobel filters
+         * and suppress non-maxima in a single pass */
+        parallel_for(pool, 0, strips, [&](int i) {
+            gradient_nms(input, state, bounds[i], bounds[i + 1],
+                         min_thresh, max_thresh, n8, useSobel);
+        });
+    }
+
+    if (save) {
+        Mat suppressed;
+        state.convertTo(suppressed, CV_32FC1, WEAK_GRAD);
+        save_mat(interm_name_prefix + "non_maximal_suppression"
+                          + (n8 ? std::string("8") : std::string("4")),
+                          suppressed, save, gui);
+    }
 
-    /* edge tracking */
-    link_edges(weak, strong, output);
+    link_to_output(state, output, n8, pool, bounds,
+                   adaptive && !save ? lut : nullptr);
 
     save_mat(interm_name_prefix + "edge_linking"
                       + (n8 ? std::string("8") : std::string("4")),
                       output, save, gui);
 }
+
+void canny_edges_dirty(const Mat& image, Mat& output, Mat& suppressed,
+                       const std::vector<Rect>& dirty,
+                       float min_thresh, float max_thresh, bool n8,
+                       bool useSobel, ThreadPool* pool, Workspace* workspace,
+                       int gradient)
+{
+    const Rect frame(Point(0, 0), image.size());
+    std::vector<Rect> rects = dirty;
+    if (suppressed.size() != image.size()) {
+        suppressed.create(image.size(), CV_8UC1);
+        rects = {frame};
+    }
+
+    /* suppression of a pixel reads the gradient of its neighbours, which
+     * reads their neighbours, so each rectangle is found from the gray
+     * pixels two further out. where that reaches the frame border, the
+     * rectangle's border is the frame's and is reflected the same way */
+    {
+        TRACE_SCOPE("canny gradient and suppression");
+        parallel_for(pool, 0, (int)rects.size(), [&](int i) {
+            const Rect r = rects[i];
+            const Rect grown = Rect(r.x - 2, r.y - 2, r.width + 4, r.height + 4)
+                             & frame;
+            /* buffers of the worker, kept between rectangles and frames */
+            static thread_local Mat state_buffer, gray_buffer, float_buffer;
+            Mat region = image(grown), gray = region;
+            Mat state = buffer_view(state_buffer, grown.size(), CV_8UC1);
+            if (region.type() == CV_32FC1 && gradient != CANNY_FLOAT) {
+                gray = buffer_view(gray_buffer, grown.size(), CV_8UC1);
+                region.convertTo(gray, CV_8UC1, 256);
+            } else if (region.type() != CV_8UC1 && region.type() != CV_32FC1) {
+                gray = buffer_view(gray_buffer, grown.size(), CV_8UC1);
+                cvtColor(region, gray, CV_BGR2GRAY);
+            }
+            if (gradient == CANNY_FLOAT) {
+                Mat input = gray;
+                if (gray.type() != CV_32FC1) {
+                    input = buffer_view(float_buffer, grown.size(), CV_32FC1);
+                    gray.convertTo(input, CV_32FC1, 1.0f/256.0f);
+                }
+                gradient_nms(input, state, 0, state.rows, min_thresh,
+                             max_thresh, n8, useSobel);
+            } else {
+                gradient_nms_fixed(gray, state, 0, state.rows, min_thresh,
+                                   max_thresh, n8, useSobel,
+                                   gradient == CANNY_FIXED_L1);
+            }
+            Mat dst = suppressed(r);
+            state(Rect(r.x - grown.x, r.y - grown.y, r.width, r.height))
+                .copyTo(dst);
+        });
+    }
+
+    /* linking is not local, an edge may continue anywhere, so it runs on
+     * the whole frame again. the suppressed states are kept for the next
+     * frame and linked in a copy */
+    Mat state = workspace_mat(workspace, "state", image.size(), CV_8UC1);
+    suppressed.copyTo(state);
+    const int strips = strip_count(pool, state.rows, 8);
+    link_to_output(state, output, n8, pool, split_rows(state.rows, strips),
+                   nullptr);
+}
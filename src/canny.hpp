@@ -1,65 +1,313 @@
 #ifndef _CANNY_HPP
 #define _CANNY_HPP
 
-#include <list>
+#include <vector>
 #include <iostream>
 #include "util.hpp"
+#include "thread_pool.hpp"
+#include "convolution.hpp"
 
 using namespace cv;
 
-/* run the Canny edge detection algorithm on the given 32-bit float input
+/* how the gradient is computed
+ * CANNY_FLOAT uses the 32-bit float image, sqrt and atan. the fixed point
+ * modes use the 8-bit gray image with integer derivatives and direction
+ * bins from their ratio, with the squared L2 or the L1 magnitude. L1
+ * overestimates diagonal gradients by up to sqrt(2) */
+enum CannyGradient {
+    CANNY_FLOAT,
+    CANNY_FIXED_L2,
+    CANNY_FIXED_L1
+};
+
+/* number of magnitude levels in the histogram of adaptive thresholds */
+const int CANNY_LEVELS = 256;
+
+/* thresholds picked from the histogram of gradient magnitudes of each frame
+ * MAX scales min_thresh and max_thresh by the largest magnitude. PERCENTILE
+ * puts the high threshold above a fraction of the pixels and OTSU between
+ * the two classes of magnitudes Otsu's method separates, and both keep the
+ * ratio of min_thresh to max_thresh for the low threshold. each frame's
+ * thresholds are weighted with smoothing from 0 to 1 against the previous
+ * ones, which are kept here between frames */
+struct CannyAutoThresh {
+    enum Mode {
+        OFF,
+        MAX,
+        PERCENTILE,
+        OTSU
+    };
+
+    Mode mode = OFF;
+    float percentile = 0.9f;
+    float smoothing = 0;
+    /* thresholds of the last frame, negative before the first */
+    float low = -1;
+    float high = -1;
+};
+
+/* run the Canny edge detection algorithm on a BGR frame, an 8-bit gray one
+ * or a 32-bit float gray one from 0 to 1
  * can save intermediate results, use N7 neighbors during non-max suppression,
  * use Sobel or Scharr kernels to find the gradient
+ * dynamic_thresh is auto_thresh in MAX mode without smoothing
  */
-void canny_edges(const Mat& bgr_input, Mat& output,
+void canny_edges(const Mat& frame, Mat& output,
                  bool save=false, bool gui=false,
                  float min_thresh=0.6, float max_thresh=0.8, bool n8=false,
                  bool useSobel=true, std::string interm_name_prefix="",
-                 bool dynamic_thresh=false);
+                 bool dynamic_thresh=false, ThreadPool* pool=nullptr,
+                 Workspace* workspace=nullptr, int gradient=CANNY_FLOAT,
+                 CannyAutoThresh* auto_thresh=nullptr);
+
+/* canny_edges for a frame that changed no further than 2 pixels from the
+ * dirty rectangles
+ * suppressed holds the suppression states of the last frame, and only the
+ * dirty rectangles of it are found again, or all of it when its size does
+ * not match. edges are linked over the whole frame, since they can reach
+ * anywhere. thresholds are fixed */
+void canny_edges_dirty(const Mat& image, Mat& output, Mat& suppressed,
+                       const std::vector<Rect>& dirty,
+                       float min_thresh, float max_thresh, bool n8,
+                       bool useSobel, ThreadPool* pool=nullptr,
+                       Workspace* workspace=nullptr, int gradient=CANNY_FLOAT);
+
+/* horizontal Sobel or Scharr derivative kernel */
+Mat sobel_or_scharr(bool useSobel);
+
+/* a horizontal derivative kernel and its rotation for the vertical
+ * derivative, prepared once for polarGradient */
+std::vector<ConvolutionKernel> gradient_kernels(const Mat& kernel);
+
+/* magnitude and direction in degrees of the gradient of a 32-bit float
+ * image, the reference for the fused gradient_nms */
+void polarGradient(const Mat& input,
+                   const std::vector<ConvolutionKernel>& kernels,
+                   Mat& mag, Mat& dir, Workspace* workspace=nullptr);
+
+/* mark each pixel none, weak or strong from its gradient, keeping only
+ * local maxima along the gradient direction */
+void non_max_suppresion(const Mat& mag, const Mat& dir, Mat& state,
+                        float min_thresh, float max_thresh, bool n8);
+
+/* gradient and non-maximal suppression of rows [row_begin, row_end) of a
+ * 32-bit float gray image in a single pass
+ * writes the 8-bit edge state of each pixel, state must be preallocated */
+void gradient_nms(const Mat& input, Mat& state, int row_begin, int row_end,
+                  float min_thresh, float max_thresh, bool n8, bool useSobel);
+
+/* gradient_nms without thresholds, for adaptive ones
+ * local maxima get their magnitude level from 1 to CANNY_LEVELS - 1 and
+ * other pixels 0, and the level of every pixel is added to histogram */
+void gradient_nms_levels(const Mat& input, Mat& levels, int row_begin,
+                         int row_end, bool n8, bool useSobel, int* histogram);
+
+/* gradient_nms on an 8-bit gray image with integer arithmetic
+ * the thresholds are on the same scale as gradient_nms, with L1 or
+ * squared L2 magnitudes */
+void gradient_nms_fixed(const Mat& gray, Mat& state, int row_begin,
+                        int row_end, float min_thresh, float max_thresh,
+                        bool n8, bool useSobel, bool l1);
+
+/* connect weak edges to strong ones in an edge state image */
+void link_edges(Mat& state, bool n8);
+void link_edges(Mat& state, bool n8, int row_begin, int row_end);
+void link_strip_borders(Mat& state, bool n8, const std::vector<int>& borders);
+
+/* settings of CannyAlgorithm, the same as its command line options */
+struct CannyConfig {
+    float min_thresh = 0.25f;
+    float max_thresh = 0.5f;
+    bool n8 = false;
+    bool scharr = false;
+    int gradient = CANNY_FLOAT;
+    CannyAutoThresh::Mode auto_thresh = CannyAutoThresh::OFF;
+    float percentile = 0.9f;
+    float smoothing = 0;
+    int threads = 1;
+};
 
 class CannyAlgorithm : public FrameAlgorithm {
 public:
     const float default_thi = 0.5;
     const float default_tlo = 0.25;
 
-    bool save_interm;
-    bool show_interm;
-    bool max_thresh;
-    bool min_thresh;
-    bool n8;
-    bool scharr;
+    bool save_interm = false;
+    bool show_interm = false;
+    float max_thresh = default_thi;
+    float min_thresh = default_tlo;
+    bool n8 = false;
+    bool scharr = false;
+    int gradient = CANNY_FLOAT;
+    /* settings of the adaptive thresholds */
+    CannyAutoThresh auto_thresh;
+    /* thresholds and suppression states of the last frame of each source */
+    std::map<std::string, CannyAutoThresh> thresholds;
+    std::map<std::string, Mat> suppressed;
+    int threads = 1;
+    std::shared_ptr<ThreadPool> pool;
 
     CannyAlgorithm() : FrameAlgorithm(
 R"(Usage: canny [--sobel | --scharr]
              [--max-thresh=<thi>] [--min-thresh=<tlo>]
-             [--n8 | --n4] [--help] [<algorithm> [<args>...]]]
+             [--n8 | --n4] [--threads=<n>] [--fixed-point [--l1]]
+             [--auto-thresh=<mode>] [--percentile=<p>]
+             [--thresh-smoothing=<a>]
+             [--help] [<algorithm> [<args>...]]]
 
 Options:
   --max-thresh=<thi> Threshold [default: 0.5].
   --min-thresh=<tlo> Threshold [default: 0.25].
+  -t <n> --threads=<n> Process strips of rows in parallel [default: 1].
+  --fixed-point Find the gradient with integer arithmetic.
+  --l1 Use the L1 gradient magnitude with --fixed-point.
+  --auto-thresh=<mode> Thresholds from each frame: max, percentile or otsu.
+  --percentile=<p> Fraction of pixels below the high threshold [default: 0.9].
+  --thresh-smoothing=<a> Weight of the previous thresholds [default: 0].
   -h --help Show this message.
 )")
     { }
 
+    inline void configure(const CannyConfig& config)
+    {
+        min_thresh = config.min_thresh;
+        max_thresh = config.max_thresh;
+        n8 = config.n8;
+        scharr = config.scharr;
+        gradient = config.gradient;
+        auto_thresh = CannyAutoThresh();
+        auto_thresh.mode = config.auto_thresh;
+        auto_thresh.percentile = config.percentile;
+        auto_thresh.smoothing = config.smoothing;
+        thresholds.clear();
+        threads = config.threads;
+        pool.reset();
+        if (threads > 1) {
+            pool = std::make_shared<ThreadPool>(threads - 1);
+        }
+    }
+
     inline virtual std::map<std::string, docopt::value>
     parse_arguments(std::map<std::string, docopt::value> m,
                     std::vector<std::string> a)
     {
         FrameAlgorithm::parse_arguments(m, a);
         save_interm = main_args["--show-intermediates"].asBool();
-        show_interm = main_args["--no-interm-gui"].asBool();
-        max_thresh = docopt_to_float(args, "--min-thresh", default_thi);
-        min_thresh = docopt_to_float(args, "--max-thresh", default_tlo);
-        n8 = args["--n8"].asBool();
-        scharr = args["--scharr"].asBool();
+        show_interm = !main_args["--no-interm-gui"].asBool();
+        CannyConfig config;
+        config.max_thresh = docopt_to_float(args, "--max-thresh", default_thi);
+        config.min_thresh = docopt_to_float(args, "--min-thresh", default_tlo);
+        config.n8 = args["--n8"].asBool();
+        config.scharr = args["--scharr"].asBool();
+        if (args["--fixed-point"].asBool()) {
+            config.gradient = args["--l1"].asBool() ? CANNY_FIXED_L1
+                                                    : CANNY_FIXED_L2;
+        }
+        if (args["--auto-thresh"].isString()) {
+            std::string m = args["--auto-thresh"].asString();
+            if (m == "max") {
+                config.auto_thresh = CannyAutoThresh::MAX;
+            } else if (m == "percentile") {
+                config.auto_thresh = CannyAutoThresh::PERCENTILE;
+            } else if (m == "otsu") {
+                config.auto_thresh = CannyAutoThresh::OTSU;
+            } else {
+                std::cout << "threshold mode '" << m << "' unknown" << std::endl;
+            }
+        }
+        config.percentile = docopt_to_float(args, "--percentile",
+                                            config.percentile);
+        config.smoothing = docopt_to_float(args, "--thresh-smoothing",
+                                           config.smoothing);
+        config.threads = (int)docopt_to_float(args, "--threads", config.threads);
+        configure(config);
         return args;
     }
 
+    /* gray frames skip the conversion, colour ones are converted in
+     * strips on the threads. the fixed point gradient is found on 8 bits */
+    inline virtual std::vector<PixelFormat> input_formats() override
+    {
+        if (gradient != CANNY_FLOAT && auto_thresh.mode == CannyAutoThresh::OFF) {
+            return {PIXELS_GRAY8, PIXELS_BGR8};
+        }
+        return {PIXELS_GRAY8, PIXELS_GRAY32F, PIXELS_BGR8};
+    }
+
+    inline virtual PixelFormat output_format(PixelFormat) override
+    {
+        return PIXELS_GRAY32F;
+    }
+
+    /* below full quality, intermediates are no longer saved, then the
+     * gradient uses Sobel and suppression 4 neighbours, then edges are
+     * found on the half resolution level of the pyramid */
+    inline virtual int quality_levels() override
+    {
+        return (save_interm ? 1 : 0) + (n8 || scharr ? 1 : 0) + 1;
+    }
+
     inline virtual void process_frame(const Mat& in, Mat& out,
                                       std::string prefix="") override
     {
-        canny_edges(in, out, save_interm, show_interm, min_thresh, max_thresh,
-                    n8, !scharr, prefix);
+        int level = quality;
+        bool save = save_interm;
+        if (save && level > 0) {
+            save = false;
+            level--;
+        }
+        bool cheap = (n8 || scharr) && level > 0;
+        if (cheap) {
+            level--;
+        }
+        CannyAutoThresh& last = thresholds.emplace(prefix, auto_thresh)
+                                          .first->second;
+        if (level == 0) {
+            canny_edges(in, out, save, show_interm, min_thresh, max_thresh,
+                        n8 && !cheap, !scharr || cheap, prefix, false,
+                        pool.get(), &workspace, gradient, &last);
+            return;
+        }
+
+        /* edges scaled back up are two pixels wide */
+        Size half_size((in.cols + 1) / 2, (in.rows + 1) / 2);
+        Mat half = workspace.get("half", half_size, in.type());
+        Mat half_edges = workspace.get("half_edges", half_size, CV_32FC1);
+        pyrDown(in, half, half_size);
+        canny_edges(half, half_edges, false, false, min_thresh, max_thresh,
+                    false, true, prefix, false, pool.get(), &workspace,
+                    gradient, &last);
+        resize(half_edges, out, in.size(), 0, 0, INTER_NEAREST);
+    }
+
+    /* suppression reads the gradient around each pixel, which reads the
+     * pixels around it */
+    inline virtual int halo() override { return 2; }
+
+    /* the edges are linked again on the whole frame, so they may change
+     * anywhere */
+    inline virtual bool process_dirty(const Mat& in, Mat& out,
+                                      const std::vector<Rect>& dirty,
+                                      std::string prefix="") override
+    {
+        /* adaptive thresholds depend on the whole frame, and the states
+         * of other quality levels can't be reused */
+        if (save_interm || auto_thresh.mode != CannyAutoThresh::OFF
+            || quality > 0) {
+            suppressed.erase(prefix);
+            process_frame(in, out, prefix);
+        } else {
+            canny_edges_dirty(in, out, suppressed[prefix], dirty, min_thresh,
+                              max_thresh, n8, !scharr, pool.get(), &workspace,
+                              gradient);
+        }
+        return false;
+    }
+
+    inline virtual void reset(const std::string& prefix) override
+    {
+        thresholds.erase(prefix);
+        suppressed.erase(prefix);
     }
 };
 
@@ -0,0 +1,267 @@
+#ifndef _CAPTURE_HPP
+#define _CAPTURE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "trace.hpp"
+#include "util.hpp"
+
+/* a frame read by a capture thread
+ * timestamp is the getTickCount() when the frame was grabbed */
+struct CapturedFrame {
+    cv::Mat image;
+    long frame_number = -1;
+    int64 timestamp = 0;
+};
+
+/* where a CaptureThread reads its frames from */
+class FrameSource {
+public:
+    virtual ~FrameSource() {}
+
+    /* read the next frame into image, reusing its buffer, and set timestamp
+     * to the getTickCount() when it was grabbed. false at the end
+     * the frame may instead point into memory the source keeps, like a
+     * mapped file, without owning a buffer */
+    virtual bool read(cv::Mat& image, int64& timestamp) = 0;
+
+    /* frames per second the source was recorded at, 0 if unknown */
+    virtual double fps() { return 0; }
+};
+
+/* frames of a camera, a video file or an image sequence */
+class VideoCaptureSource : public FrameSource {
+public:
+    explicit VideoCaptureSource(cv::VideoCapture capture) : capture(capture) {}
+
+    virtual bool read(cv::Mat& image, int64& timestamp) override
+    {
+        bool ok = capture.grab();
+        timestamp = cv::getTickCount();
+        return ok && capture.retrieve(image) && !image.empty();
+    }
+
+    virtual double fps() override
+    {
+        return capture.get(cv::CAP_PROP_FPS);
+    }
+
+private:
+    cv::VideoCapture capture;
+};
+
+/* reads frames from a FrameSource on its own thread
+ *
+ * frames are read into a ring of Mats, so a slow reader never holds up the
+ * capture and always gets the latest frame instead of a stale one buffered
+ * by the driver. readers get the Mat of a slot, not a copy of it, and the
+ * slot is only written again once no reader holds it. the ring grows to
+ * the slot being written, the one holding the latest frame and the ones
+ * readers hold, then its buffers are reused. frames pointing into memory
+ * of the source hold no buffer, so their slots are free at once.
+ *
+ * video files and image sequences stand in for cameras. they are played
+ * at their frame rate when paced, otherwise every frame is handed to the
+ * reader before the next one is read */
+class CaptureThread {
+public:
+    enum Policy {
+        LATEST,
+        EVERY_FRAME
+    };
+
+    CaptureThread(std::shared_ptr<FrameSource> source, Policy policy=LATEST,
+                  bool paced=false)
+        : source(source), policy(policy), paced(paced), ring(2)
+    {
+        thread = std::thread([this]() { run(); });
+    }
+
+    CaptureThread(cv::VideoCapture capture, Policy policy=LATEST,
+                  bool paced=false)
+        : CaptureThread(std::make_shared<VideoCaptureSource>(capture), policy,
+                        paced) {}
+
+    ~CaptureThread()
+    {
+        stop();
+    }
+
+    CaptureThread(const CaptureThread&) = delete;
+    CaptureThread& operator=(const CaptureThread&) = delete;
+
+    /* the latest frame the reader has not seen, waiting up to timeout_ms
+     * for one. returns false if none arrived
+     * frame.image shares the buffer of the ring, which is not written to
+     * until frame and every copy of it let go of it. the frame it held
+     * before is let go of first */
+    bool latest(CapturedFrame& frame, int timeout_ms=0)
+    {
+        frame.image.release();
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this]() {
+                return stopping || ended || (newest >= 0 && ring[newest].frame_number > returned); });
+            if (newest < 0 || ring[newest].frame_number <= returned) {
+                return false;
+            }
+            frame = ring[newest];
+            skipped += frame.frame_number - returned - 1;
+            returned = frame.frame_number;
+        }
+        wake.notify_all();
+        return true;
+    }
+
+    /* true once the source has no more frames and the last was read */
+    bool finished()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return ended && (newest < 0 || ring[newest].frame_number <= returned);
+    }
+
+    /* frames captured but replaced by a newer one before being read */
+    long dropped()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return skipped;
+    }
+
+    /* frame rate of the source, 0 if it has none */
+    double fps()
+    {
+        return source->fps();
+    }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+private:
+    void run()
+    {
+        trace_thread_name("capture");
+        double fps = paced ? source->fps() : 0;
+        auto start = std::chrono::steady_clock::now();
+        for (long n = 0; ; n++) {
+            int slot;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                /* read ahead at most one frame */
+                if (policy == EVERY_FRAME) {
+                    wake.wait(lock, [this, n]() { return stopping || returned >= n - 2; });
+                }
+                if (stopping) {
+                    return;
+                }
+                /* a slot no reader holds, the latest frame stays. a frame
+                 * without a buffer only points into the source, readers
+                 * keep their own header of it */
+                slot = 0;
+                while (slot < (int)ring.size()
+                       && (slot == newest
+                           || (ring[slot].image.u != nullptr
+                               && !unshared(ring[slot].image)))) {
+                    slot++;
+                }
+                if (slot == (int)ring.size()) {
+                    ring.emplace_back();
+                } else if (ring[slot].image.u == nullptr) {
+                    /* so the source can't write through it */
+                    ring[slot].image.release();
+                }
+            }
+
+            if (fps > 0) {
+                std::this_thread::sleep_until(start + std::chrono::microseconds(
+                                              (long long)(n * 1e6 / fps)));
+            }
+            bool ok;
+            int64 timestamp;
+            {
+                TRACE_SCOPE("capture");
+                ok = source->read(ring[slot].image, timestamp);
+            }
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (policy == EVERY_FRAME) {
+                    wake.wait(lock, [this, n]() { return stopping || returned >= n - 1; });
+                }
+                if (ok) {
+                    ring[slot].frame_number = n;
+                    ring[slot].timestamp = timestamp;
+                    newest = slot;
+                } else {
+                    ended = true;
+                }
+            }
+            wake.notify_all();
+            if (!ok) {
+                return;
+            }
+        }
+    }
+
+    std::shared_ptr<FrameSource> source;
+    const Policy policy;
+    const bool paced;
+    /* only grows under the lock, on the capture thread */
+    std::vector<CapturedFrame> ring;
+    int newest = -1;
+    long returned = -1;
+    long skipped = 0;
+    bool ended = false;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::thread thread;
+};
+
+/* capture to display latency of frames, in milliseconds */
+class LatencyStats {
+public:
+    void add(int64 timestamp)
+    {
+        samples.push_back((cv::getTickCount() - timestamp) * 1000.0
+                          / cv::getTickFrequency());
+    }
+
+    void print(std::ostream& out)
+    {
+        if (samples.empty()) {
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (double s: samples) {
+            sum += s;
+        }
+        out << "Latency over " << samples.size() << " frames: mean "
+            << sum / samples.size() << " ms, median "
+            << samples[samples.size() / 2] << " ms, 99th percentile "
+            << samples[samples.size() * 99 / 100] << " ms, max "
+            << samples.back() << " ms" << std::endl;
+    }
+
+private:
+    std::vector<double> samples;
+};
+
+#endif
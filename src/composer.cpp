@@ -0,0 +1,190 @@
+#include "composer.hpp"
+
+cv::Mat wrap_buffer(const PixelBuffer& buffer)
+{
+    if (buffer.data == nullptr || buffer.width <= 0 || buffer.height <= 0) {
+        return cv::Mat();
+    }
+    return cv::Mat(buffer.height, buffer.width, pixel_type(buffer.format),
+                   buffer.data,
+                   buffer.stride > 0 ? buffer.stride : cv::Mat::AUTO_STEP);
+}
+
+std::vector<std::string> algorithm_names()
+{
+    return {"canny", "convolution", "two_pass", "morphology", "erode", "dilate"};
+}
+
+std::shared_ptr<FrameAlgorithm> make_algorithm(const std::string& name)
+{
+    if (name == "canny") {
+        return std::make_shared<CannyAlgorithm>();
+    }
+    if (name == "convolution") {
+        return std::make_shared<ConvolutionAlgorithm>();
+    }
+    if (name == "two_pass") {
+        return std::make_shared<TwoPassAlgorithm>();
+    }
+    if (name == "morphology" || name == "dilate") {
+        return std::make_shared<MorphologyAlgorithm>(MORPHOLOGY_DILATE);
+    }
+    if (name == "erode") {
+        return std::make_shared<MorphologyAlgorithm>(MORPHOLOGY_ERODE);
+    }
+    return nullptr;
+}
+
+std::shared_ptr<FrameAlgorithm> make_algorithm(const AlgorithmConfig& config)
+{
+    switch (config.kind) {
+    case AlgorithmConfig::CANNY: {
+        auto canny = std::make_shared<CannyAlgorithm>();
+        canny->configure(config.canny);
+        return canny;
+    }
+    case AlgorithmConfig::CONVOLUTION: {
+        auto convolution = std::make_shared<ConvolutionAlgorithm>();
+        if (!convolution->configure(config.convolution)) {
+            return nullptr;
+        }
+        return convolution;
+    }
+    case AlgorithmConfig::TWO_PASS: {
+        auto two_pass = std::make_shared<TwoPassAlgorithm>();
+        two_pass->configure(config.two_pass);
+        return two_pass;
+    }
+    case AlgorithmConfig::MORPHOLOGY: {
+        auto morphology = std::make_shared<MorphologyAlgorithm>();
+        morphology->configure(config.morphology);
+        return morphology;
+    }
+    }
+    return nullptr;
+}
+
+Composer::Composer(const ChainConfig& config)
+{
+    for (size_t i = 0; i < config.size(); i++) {
+        auto algorithm = make_algorithm(config[i]);
+        if (algorithm == nullptr) {
+            failure = "algorithm " + std::to_string(i) + " has invalid settings";
+            configured = false;
+            return;
+        }
+        algorithms.push_back(algorithm);
+    }
+    inputs = ChainInputs(algorithms);
+    if (!algorithms.empty()) {
+        outputs.resize(algorithms.size() - 1);
+    }
+}
+
+Composer::Composer(const std::vector<std::shared_ptr<FrameAlgorithm>>& chain)
+    : algorithms(chain), inputs(chain)
+{
+    if (!algorithms.empty()) {
+        outputs.resize(algorithms.size() - 1);
+    }
+}
+
+PixelFormat Composer::result_format(PixelFormat format) const
+{
+    for (size_t i = 0; i < algorithms.size(); i++) {
+        const std::vector<PixelFormat>& takes = inputs.formats[i];
+        if (std::find(takes.begin(), takes.end(), format) == takes.end()) {
+            format = takes.front();
+        }
+        format = algorithms[i]->output_format(format);
+    }
+    return format;
+}
+
+bool Composer::convert_into(const cv::Mat& src, cv::Mat& dst, PixelFormat format)
+{
+    const uchar* data = dst.data;
+    PixelFormat from;
+    if (!pixel_format(src, from)) {
+        return false;
+    }
+    converted.reset(src);
+    const cv::Mat& source = converted.get(conversion_source(from, format));
+    return !source.empty() && convert_pixels(source, dst, format)
+        && dst.data == data;
+}
+
+bool Composer::process(const PixelBuffer& in, const PixelBuffer& out)
+{
+    if (!configured) {
+        return false;
+    }
+    failure.clear();
+    cv::Mat input = wrap_buffer(in);
+    cv::Mat target = wrap_buffer(out);
+    if (input.empty() || target.empty() || input.size() != target.size()) {
+        failure = "input and output must be buffers of the same size";
+        return false;
+    }
+
+    if (algorithms.empty()) {
+        if (!convert_into(input, target, out.format)) {
+            failure = "the input can't be converted to the output format";
+            return false;
+        }
+        return true;
+    }
+    cv::Mat frame = input;
+    for (size_t i = 0; i + 1 < algorithms.size(); i++) {
+        algorithms[i]->process_frame(inputs.input(i, frame), outputs[i]);
+        frame = outputs[i];
+    }
+
+    /* when the last algorithm produces the output format, it writes into
+     * the output buffer */
+    const bool direct = result_format(in.format) == out.format;
+    cv::Mat last = direct ? target : result;
+    algorithms.back()->process_frame(inputs.input(algorithms.size() - 1, frame),
+                                     last);
+    if (direct && last.data == target.data) {
+        return true;
+    }
+    if (!direct) {
+        result = last;
+    }
+    if (!convert_into(last, target, out.format)) {
+        failure = "the result can't be converted to the output format";
+        return false;
+    }
+    return true;
+}
+
+ComposerPool::ComposerPool(const ChainConfig& config, size_t max_idle)
+    : config(config), max_idle(max_idle) {}
+
+bool ComposerPool::process(const PixelBuffer& in, const PixelBuffer& out,
+                           std::string* error)
+{
+    std::unique_ptr<Composer> composer;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!idle.empty()) {
+            composer = std::move(idle.back());
+            idle.pop_back();
+        }
+    }
+    if (composer == nullptr) {
+        composer.reset(new Composer(config));
+    }
+
+    bool ok = composer->process(in, out);
+    if (!ok && error != nullptr) {
+        *error = composer->error();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (idle.size() < max_idle) {
+        idle.push_back(std::move(composer));
+    }
+    return ok;
+}
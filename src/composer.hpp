@@ -0,0 +1,136 @@
+#ifndef _COMPOSER_HPP
+#define _COMPOSER_HPP
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "util.hpp"
+#include "canny.hpp"
+#include "convolution.hpp"
+#include "morphology.hpp"
+#include "two_pass.hpp"
+
+/* the algorithms as a library, run on buffers the caller owns
+ *
+ * a chain is configured with typed settings instead of command lines, and
+ * kept between frames so its buffers are only allocated once. composer is
+ * a command line over the same algorithms */
+
+/* an image in memory owned by the caller
+ * stride is the number of bytes from the start of one row to the next, 0
+ * for rows packed one after another */
+struct PixelBuffer {
+    void* data = nullptr;
+    int width = 0;
+    int height = 0;
+    size_t stride = 0;
+    PixelFormat format = PIXELS_BGR8;
+};
+
+/* a Mat header over the buffer, without copying it */
+cv::Mat wrap_buffer(const PixelBuffer& buffer);
+
+/* one algorithm of a chain and its settings */
+struct AlgorithmConfig {
+    enum Kind {
+        CANNY,
+        CONVOLUTION,
+        TWO_PASS,
+        MORPHOLOGY
+    };
+
+    AlgorithmConfig(const CannyConfig& c) : kind(CANNY), canny(c) {}
+    AlgorithmConfig(const ConvolutionConfig& c) : kind(CONVOLUTION), convolution(c) {}
+    AlgorithmConfig(const TwoPassConfig& c) : kind(TWO_PASS), two_pass(c) {}
+    AlgorithmConfig(const MorphologyConfig& c) : kind(MORPHOLOGY), morphology(c) {}
+
+    Kind kind;
+    CannyConfig canny;
+    ConvolutionConfig convolution;
+    TwoPassConfig two_pass;
+    MorphologyConfig morphology;
+};
+
+typedef std::vector<AlgorithmConfig> ChainConfig;
+
+/* names of the algorithms composer runs */
+std::vector<std::string> algorithm_names();
+
+/* a new algorithm by name, to set up with parse_arguments, or null */
+std::shared_ptr<FrameAlgorithm> make_algorithm(const std::string& name);
+
+/* a new algorithm with the given settings, or null if they are invalid */
+std::shared_ptr<FrameAlgorithm> make_algorithm(const AlgorithmConfig& config);
+
+/* a chain of algorithms run on caller buffers
+ *
+ * algorithms keep buffers and state between frames, so a Composer must
+ * only be used by one thread at a time. separate instances share nothing
+ * and run in parallel, see ComposerPool.
+ *
+ * the input is read where it is, and each algorithm gets its input in a
+ * format it takes, see ChainInputs. the last algorithm writes straight into
+ * the output when it produces the format of the output buffer. otherwise
+ * the result is converted into it: gray to BGR, BGR to gray, floats from 0
+ * to 1 to 8 bits and labels to colours. input and output must not overlap */
+class Composer {
+public:
+    explicit Composer(const ChainConfig& config);
+
+    /* a chain of algorithms already set up, such as by parse_arguments */
+    explicit Composer(const std::vector<std::shared_ptr<FrameAlgorithm>>& chain);
+
+    Composer(const Composer&) = delete;
+    Composer& operator=(const Composer&) = delete;
+
+    /* run the chain on in and write the result to out, which must have the
+     * same size. returns false if it can't, see error() */
+    bool process(const PixelBuffer& in, const PixelBuffer& out);
+
+    /* why the chain could not be set up or the last frame processed,
+     * empty if it could */
+    const std::string& error() const { return failure; }
+
+    std::vector<std::shared_ptr<FrameAlgorithm>> algorithms;
+
+private:
+    /* format of the result for an input format */
+    PixelFormat result_format(PixelFormat format) const;
+
+    /* convert into the buffer of dst without reallocating it */
+    bool convert_into(const cv::Mat& src, cv::Mat& dst, PixelFormat format);
+
+    ChainInputs inputs{AlgorithmChain()};
+    /* outputs of all but the last algorithm, reused between frames */
+    std::vector<cv::Mat> outputs;
+    /* the result when it does not have the format of the output buffer */
+    cv::Mat result;
+    FrameCache converted;
+    bool configured = true;
+    std::string failure;
+};
+
+/* Composers for a chain shared by any number of threads
+ * each call takes an idle instance, or creates one when all are busy, so
+ * instances stay warm between calls and are never used by two threads at
+ * once. at most max_idle instances are kept when calls drop off */
+class ComposerPool {
+public:
+    explicit ComposerPool(const ChainConfig& config, size_t max_idle=16);
+
+    /* Composer::process on an idle instance, error is set on failure */
+    bool process(const PixelBuffer& in, const PixelBuffer& out,
+                 std::string* error=nullptr);
+
+private:
+    ChainConfig config;
+    size_t max_idle;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Composer>> idle;
+};
+
+#endif
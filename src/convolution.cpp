@@ -1,4 +1,9 @@
+#include <cfloat>
+#include <fstream>
+#include <sstream>
+
 #include "convolution.hpp"
+#include "simd.hpp"
 
 /* finds the convolution of a matrix and kernel
  * the input should be an 1-channel floating point image 
@@ -33,3 +38,473 @@ int naive_convolution(const Mat& input, Mat& output, const Mat& kernel)
     return 0;
 }
 
+struct ConvolutionKernel::SpectrumCache {
+    std::mutex mutex;
+    std::map<std::pair<int, int>, Mat> spectra;
+};
+
+/* kernel prepared for the convolution engine
+ * the kernel is split into a sum of outer products of column and row
+ * vectors by gaussian elimination with complete pivoting, which finds the
+ * rank of kernels built from separable filters. each factor pair is scaled
+ * so that integer kernels such as Sobel and Scharr factor exactly. the
+ * terms are kept when applying them takes fewer taps than the 2D kernel */
+ConvolutionKernel::ConvolutionKernel(const Mat& k)
+    : spectra(std::make_shared<SpectrumCache>())
+{
+    k.convertTo(kernel, CV_32F);
+    anchor = Point(kernel.cols / 2, kernel.rows / 2);
+
+    Mat_<float> residual = kernel.clone();
+    float tolerance = 0;
+    const int max_terms = std::min(kernel.rows, kernel.cols);
+    while ((int)columns.size() < max_terms) {
+        Point pivot;
+        for (int i = 0; i < residual.rows; i++) {
+            for (int j = 0; j < residual.cols; j++) {
+                if (std::abs(residual(i, j)) > std::abs(residual(pivot.y, pivot.x))) {
+                    pivot = Point(j, i);
+                }
+            }
+        }
+        float p = residual(pivot.y, pivot.x);
+        if (columns.empty()) {
+            tolerance = 1e-6f * std::abs(p);
+        }
+        if (std::abs(p) <= tolerance) {
+            break;
+        }
+
+        Mat_<float> col = residual.col(pivot.x).clone();
+        Mat_<float> row = residual.row(pivot.y).clone();
+        bool exact = true;
+        for (int j = 0; j < row.cols; j++) {
+            exact = exact && row(0, j) / p * p == row(0, j);
+        }
+        if (exact) {
+            row /= p;
+        } else {
+            col /= p;
+        }
+        for (int i = 0; i < residual.rows; i++) {
+            for (int j = 0; j < residual.cols; j++) {
+                residual(i, j) -= col(i, 0) * row(0, j);
+            }
+        }
+        columns.push_back(col);
+        rows.push_back(row);
+    }
+
+    int taps = (int)columns.size() * (kernel.rows + kernel.cols);
+    separable = !columns.empty() && taps < (int)kernel.total();
+    if (!separable) {
+        columns.clear();
+        rows.clear();
+    }
+}
+
+Mat ConvolutionKernel::spectrum(Size dft_size) const
+{
+    std::lock_guard<std::mutex> lock(spectra->mutex);
+    Mat& s = spectra->spectra[std::make_pair(dft_size.width, dft_size.height)];
+    if (s.empty()) {
+        Mat padded = Mat::zeros(dft_size, CV_32F);
+        Mat corner = padded(Rect(0, 0, kernel.cols, kernel.rows));
+        kernel.copyTo(corner);
+        dft(padded, s, 0, kernel.rows);
+    }
+    return s;
+}
+
+int load_kernel(const std::string& path, Mat_<float>& kernel)
+{
+    std::string ext = path.substr(path.find_last_of('.') + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == "yml" || ext == "yaml" || ext == "xml" || ext == "json") {
+        FileStorage fs(path, FileStorage::READ);
+        if (!fs.isOpened()) {
+            return -1;
+        }
+        Mat m;
+        fs["kernel"] >> m;
+        if (m.empty() || m.channels() != 1) {
+            return -1;
+        }
+        m.convertTo(kernel, CV_32F);
+        return 0;
+    }
+
+    std::ifstream file(path);
+    if (!file) {
+        return -1;
+    }
+    std::vector<std::vector<float>> rows;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::replace(line.begin(), line.end(), ',', ' ');
+        std::istringstream fields(line);
+        std::vector<float> row;
+        float v;
+        while (fields >> v) {
+            row.push_back(v);
+        }
+        if (!fields.eof()) {
+            return -1;
+        }
+        if (row.empty()) {
+            continue;
+        }
+        if (!rows.empty() && row.size() != rows[0].size()) {
+            return -1;
+        }
+        rows.push_back(row);
+    }
+    if (rows.empty()) {
+        return -1;
+    }
+    kernel.create((int)rows.size(), (int)rows[0].size());
+    for (int i = 0; i < kernel.rows; i++) {
+        for (int j = 0; j < kernel.cols; j++) {
+            kernel(i, j) = rows[i][j];
+        }
+    }
+    return 0;
+}
+
+/* acc[i] += k * src[i] for n values */
+static void axpy(float* acc, const float* src, float k, int n)
+{
+    int i = 0;
+#ifdef COMPOSER_SSE2
+    const __m128 vk = _mm_set1_ps(k);
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i),
+                                          _mm_mul_ps(vk, _mm_loadu_ps(src + i))));
+    }
+#endif
+    for (; i < n; i++) {
+        acc[i] += k * src[i];
+    }
+}
+
+#ifdef COMPOSER_AVX2
+TARGET_AVX2 static void axpy_avx2(float* acc, const float* src, float k, int n)
+{
+    const __m256 vk = _mm256_set1_ps(k);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i),
+                         _mm256_mul_ps(vk, _mm256_loadu_ps(src + i))));
+    }
+    axpy(acc + i, src + i, k, n - i);
+}
+#endif
+
+typedef void (*axpy_fn)(float*, const float*, float, int);
+
+static axpy_fn select_axpy()
+{
+#ifdef COMPOSER_AVX2
+    if (cpu_has_avx2()) {
+        return axpy_avx2;
+    }
+#endif
+    return axpy;
+}
+
+/* source row y as float, with left and right borders for the kernel
+ * rows outside the image are interpolated, or zero for a constant border */
+static void padded_row(const Mat& input, int y, int left, int right,
+                       int border, float* out)
+{
+    const int cn = input.channels();
+    const int cols = input.cols;
+    y = borderInterpolate(y, input.rows, border);
+    if (y < 0) {
+        std::fill(out, out + (cols + left + right) * cn, 0.0f);
+        return;
+    }
+    Mat row(1, cols, CV_32FC(cn), out + left * cn);
+    input.row(y).convertTo(row, CV_32F);
+    for (int x = -left; x < cols + right; x++) {
+        if (x >= 0 && x < cols) {
+            continue;
+        }
+        int src = borderInterpolate(x, cols, border);
+        for (int ch = 0; ch < cn; ch++) {
+            out[(x + left) * cn + ch] = src < 0 ? 0 : out[(src + left) * cn + ch];
+        }
+    }
+}
+
+/* convolve rows [row_begin, row_end) of the outputs, one for each kernel
+ * padded source rows are prepared once each into a ring shared by all the
+ * kernels. separable kernels sum scaled ring rows into a column sum for
+ * each term and apply the row vector to it. 2D kernels sum scaled and
+ * shifted ring rows directly */
+static void convolve_rows(const Mat& input, std::vector<Mat>& outputs,
+                          const std::vector<ConvolutionKernel>& kernels,
+                          int border, int row_begin, int row_end)
+{
+    const axpy_fn add = select_axpy();
+    const int cn = input.channels();
+    const int width = input.cols * cn;
+
+    /* room around the image for every kernel */
+    int top = 0, bottom = 0, left = 0, right = 0;
+    for (auto& k: kernels) {
+        top = std::max(top, k.anchor.y);
+        bottom = std::max(bottom, k.kernel.rows - 1 - k.anchor.y);
+        left = std::max(left, k.anchor.x);
+        right = std::max(right, k.kernel.cols - 1 - k.anchor.x);
+    }
+    const int height = top + bottom + 1;
+    const int padded = (input.cols + left + right) * cn;
+
+    /* scratch rows are kept per thread, and only reallocated when a
+     * frame of another size comes along */
+    static thread_local Mat ring, column_sum, acc;
+    ring.create(height, padded, CV_32F);
+    column_sum.create(1, padded, CV_32F);
+    acc.create(1, width, CV_32F);
+    float* csum = column_sum.ptr<float>();
+    float* sum = acc.ptr<float>();
+    auto ring_row = [&](int y) {
+        return ring.ptr<float>(((y % height) + height) % height);
+    };
+
+    int next = row_begin - top;
+    for (int r = row_begin; r < row_end; r++) {
+        /* prepare the source rows this output row needs */
+        for (; next <= r + bottom; next++) {
+            padded_row(input, next, left, right, border, ring_row(next));
+        }
+
+        for (size_t n = 0; n < kernels.size(); n++) {
+            const ConvolutionKernel& k = kernels[n];
+            const int kh = k.kernel.rows;
+            const int kw = k.kernel.cols;
+            /* first ring row and column the kernel covers */
+            const int y0 = r - k.anchor.y;
+            const int x0 = (left - k.anchor.x) * cn;
+
+            std::fill(sum, sum + width, 0.0f);
+            if (k.separable) {
+                const int span = width + (kw - 1) * cn;
+                for (size_t t = 0; t < k.columns.size(); t++) {
+                    std::fill(csum, csum + span, 0.0f);
+                    for (int i = 0; i < kh; i++) {
+                        if (k.columns[t](i, 0) != 0) {
+                            add(csum, ring_row(y0 + i) + x0, k.columns[t](i, 0), span);
+                        }
+                    }
+                    for (int j = 0; j < kw; j++) {
+                        if (k.rows[t](0, j) != 0) {
+                            add(sum, csum + j * cn, k.rows[t](0, j), width);
+                        }
+                    }
+                }
+            } else {
+                for (int i = 0; i < kh; i++) {
+                    const float* src = ring_row(y0 + i) + x0;
+                    for (int j = 0; j < kw; j++) {
+                        if (k.kernel(i, j) != 0) {
+                            add(sum, src + j * cn, k.kernel(i, j), width);
+                        }
+                    }
+                }
+            }
+
+            Mat out_row = outputs[n].row(r);
+            acc.reshape(cn).convertTo(out_row, outputs[n].type());
+        }
+    }
+}
+
+/* the cost model counts multiply-adds per channel
+ * a real DFT of n points takes about 2.5 n log2 n of them, and each tile
+ * needs a forward and an inverse transform plus the spectrum product */
+const double DFT_COST = 2.5;
+
+static double direct_cost(Size image, const ConvolutionKernel& k)
+{
+    int taps = k.separable ? (int)k.columns.size() * (k.kernel.rows + k.kernel.cols)
+                           : (int)k.kernel.total();
+    return (double)image.area() * taps;
+}
+
+/* pick the DFT size of the tiles with the lowest cost and return the cost
+ * tiles cover as much of the image as they can, less the kernel overlap */
+static double fft_cost(Size image, Size ksize, Size& dft_size)
+{
+    double best = DBL_MAX;
+    const Size whole(image.width + ksize.width - 1, image.height + ksize.height - 1);
+    for (int d = 32; ; d *= 2) {
+        Size dft(getOptimalDFTSize(std::min(std::max(d, ksize.width), whole.width)),
+                 getOptimalDFTSize(std::min(std::max(d, ksize.height), whole.height)));
+        Size tile(dft.width - ksize.width + 1, dft.height - ksize.height + 1);
+        double tiles = std::ceil(image.width / (double)tile.width)
+                     * std::ceil(image.height / (double)tile.height);
+        double n = dft.area();
+        double cost = tiles * (2 * DFT_COST * n * std::log2(n) + 2 * n);
+        if (cost < best) {
+            best = cost;
+            dft_size = dft;
+        }
+        if (d >= whole.width && d >= whole.height) {
+            return best;
+        }
+    }
+}
+
+/* convolve in the frequency domain with overlapping tiles
+ * each tile reads its output area plus the kernel overlap from the bordered
+ * image, so no wrap around reaches the part of the result that is kept.
+ * correlation is the product with the conjugate kernel spectrum */
+static void convolve_fft(const Mat& input, Mat& output,
+                         const ConvolutionKernel& k, int border,
+                         Size dft_size, ThreadPool* pool)
+{
+    const int kh = k.kernel.rows;
+    const int kw = k.kernel.cols;
+    const int cn = input.channels();
+    const Size tile(dft_size.width - kw + 1, dft_size.height - kh + 1);
+    const int across = (input.cols + tile.width - 1) / tile.width;
+    const int down = (input.rows + tile.height - 1) / tile.height;
+    const Mat spectrum = k.spectrum(dft_size);
+
+    Mat source;
+    input.convertTo(source, CV_32F);
+    copyMakeBorder(source, source, k.anchor.y, kh - 1 - k.anchor.y,
+                   k.anchor.x, kw - 1 - k.anchor.x, border, Scalar::all(0));
+    std::vector<Mat> planes, results(cn);
+    split(source, planes);
+    for (auto& r: results) {
+        r.create(input.size(), CV_32F);
+    }
+
+    parallel_for(pool, 0, across * down * cn, [&](int i) {
+        const int ch = i % cn;
+        const int t = i / cn;
+        Rect area(t % across * tile.width, t / across * tile.height,
+                  tile.width, tile.height);
+        area &= Rect(0, 0, input.cols, input.rows);
+
+        const Size extent(area.width + kw - 1, area.height + kh - 1);
+        Mat buffer = Mat::zeros(dft_size, CV_32F);
+        Mat corner = buffer(Rect(0, 0, extent.width, extent.height));
+        planes[ch](Rect(area.x, area.y, extent.width, extent.height)).copyTo(corner);
+
+        Mat spec;
+        dft(buffer, spec, 0, extent.height);
+        mulSpectrums(spec, spectrum, spec, 0, true);
+        dft(spec, buffer, DFT_INVERSE | DFT_SCALE | DFT_REAL_OUTPUT, area.height);
+
+        Mat dst = results[ch](area);
+        buffer(Rect(0, 0, area.width, area.height)).copyTo(dst);
+    });
+
+    Mat merged;
+    merge(results, merged);
+    merged.convertTo(output, output.type());
+}
+
+/* output image of the given depth, reused when it has the right size and
+ * type. rows are read while others are written, so never work in place */
+static Mat output_for(const Mat& input, const Mat& output, int ddepth)
+{
+    int type = CV_MAKETYPE(ddepth < 0 ? input.depth() : ddepth,
+                           input.channels());
+    if (output.data == input.data || output.size() != input.size()
+    ||  output.type() != type) {
+        return Mat(input.size(), type);
+    }
+    return output;
+}
+
+static void convolve_direct(const Mat& input, std::vector<Mat>& outputs,
+                            const std::vector<ConvolutionKernel>& kernels,
+                            int border, ThreadPool* pool)
+{
+    const std::vector<int> bounds = split_rows(input.rows,
+                                               strip_count(pool, input.rows, 32));
+    parallel_for(pool, 0, (int)bounds.size() - 1, [&](int i) {
+        convolve_rows(input, outputs, kernels, border, bounds[i], bounds[i + 1]);
+    });
+}
+
+int convolution(const Mat& input, Mat& output, const ConvolutionKernel& kernel,
+                int ddepth, int border, ThreadPool* pool, int method)
+{
+    if (kernel.kernel.empty()) {
+        return -1;
+    }
+    Mat result = output_for(input, output, ddepth);
+
+    Size dft_size;
+    double fft = fft_cost(input.size(), kernel.kernel.size(), dft_size);
+    if (method == CONVOLUTION_FFT
+    || (method == CONVOLUTION_AUTO && fft < direct_cost(input.size(), kernel))) {
+        convolve_fft(input, result, kernel, border, dft_size, pool);
+    } else {
+        std::vector<Mat> results(1, result);
+        convolve_direct(input, results, std::vector<ConvolutionKernel>(1, kernel),
+                        border, pool);
+    }
+    output = result;
+    return 0;
+}
+
+int convolution(const Mat& input, std::vector<Mat>& outputs,
+                const std::vector<ConvolutionKernel>& kernels,
+                int ddepth, int border, ThreadPool* pool, int method)
+{
+    double direct = 0, fft = 0;
+    for (auto& k: kernels) {
+        if (k.kernel.empty()) {
+            return -1;
+        }
+        Size dft_size;
+        direct += direct_cost(input.size(), k);
+        fft += fft_cost(input.size(), k.kernel.size(), dft_size);
+    }
+    outputs.resize(kernels.size());
+
+    /* the shared pass only saves reading the source rows again, so the
+     * costs of the kernels taken one by one decide between the methods */
+    if (method == CONVOLUTION_FFT || (method == CONVOLUTION_AUTO && fft < direct)) {
+        for (size_t n = 0; n < kernels.size(); n++) {
+            convolution(input, outputs[n], kernels[n], ddepth, border, pool,
+                        CONVOLUTION_FFT);
+        }
+        return 0;
+    }
+    std::vector<Mat> results(kernels.size());
+    for (size_t n = 0; n < kernels.size(); n++) {
+        results[n] = output_for(input, outputs[n], ddepth);
+    }
+    convolve_direct(input, results, kernels, border, pool);
+    outputs = results;
+    return 0;
+}
+
+Mat_<float> compose_kernels(const Mat& first, const Mat& second)
+{
+    Mat_<float> a = first, b = second;
+    Mat_<float> c(a.rows + b.rows - 1, a.cols + b.cols - 1, 0.0f);
+    for (int i = 0; i < a.rows; i++) {
+        for (int j = 0; j < a.cols; j++) {
+            for (int y = 0; y < b.rows; y++) {
+                for (int x = 0; x < b.cols; x++) {
+                    c(i + y, j + x) += a(i, j) * b(y, x);
+                }
+            }
+        }
+    }
+    return c;
+}
+
+int convolution(const Mat& input, Mat& output, const Mat& kernel)
+{
+    return convolution(input, output, ConvolutionKernel(kernel));
+}
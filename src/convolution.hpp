@@ -1,9 +1,89 @@
 #ifndef _CONVOLUTION_HPP
 #define _CONVOLUTION_HPP
 #include "util.hpp"
+#include "thread_pool.hpp"
 using namespace cv;
+
+enum ConvolutionMethod {
+    CONVOLUTION_AUTO,
+    CONVOLUTION_DIRECT,
+    CONVOLUTION_FFT
+};
+
+/* a kernel prepared for convolution, with its anchor in the center
+ * kernels of low rank are also split into a sum of column and row vector
+ * products, each applied as two 1D passes. spectra used by the FFT path
+ * are cached for each DFT size, and shared between copies of the kernel */
+class ConvolutionKernel {
+public:
+    ConvolutionKernel() {}
+    explicit ConvolutionKernel(const Mat& kernel);
+
+    /* spectrum of the kernel zero padded to the given DFT size */
+    Mat spectrum(Size dft_size) const;
+
+    Mat_<float> kernel;
+    Point anchor;
+    bool separable = false;
+    std::vector<Mat_<float>> columns;
+    std::vector<Mat_<float>> rows;
+
+private:
+    struct SpectrumCache;
+    std::shared_ptr<SpectrumCache> spectra;
+};
+
+/* convolution of a 1-channel float image by moving a region of interest
+ * over it, pixels closer than half the kernel to the border are 0
+ * output must be preallocated. written as an illustration only */
+int naive_convolution(const Mat& input, Mat& output, const Mat& kernel);
+
+/* read a kernel from a file
+ * YAML, XML and JSON files are read with FileStorage from a "kernel"
+ * node. other files are plain text, one row per line with coefficients
+ * separated by spaces or commas. returns 0 on success */
+int load_kernel(const std::string& path, Mat_<float>& kernel);
+
+/* correlate an image with a kernel like filter2D, for 8 to 32-bit images
+ * of 1 to 4 channels. sums are computed in float and converted to ddepth,
+ * or the input depth when it is negative. large kernels are applied in
+ * the frequency domain, chosen by a cost model unless a method is given.
+ * with a thread pool, blocks of rows or tiles are computed in parallel.
+ * returns 0 on success */
+int convolution(const Mat& input, Mat& output, const ConvolutionKernel& kernel,
+                int ddepth=-1, int border=BORDER_REFLECT_101,
+                ThreadPool* pool=nullptr, int method=CONVOLUTION_AUTO);
+
+/* correlate an image with several kernels in a single direct pass, reading
+ * each source row once, or with each kernel in turn in the frequency domain
+ * when that is asked for or cheaper for them all. outputs are resized to
+ * one for each kernel */
+int convolution(const Mat& input, std::vector<Mat>& outputs,
+                const std::vector<ConvolutionKernel>& kernels,
+                int ddepth=-1, int border=BORDER_REFLECT_101,
+                ThreadPool* pool=nullptr, int method=CONVOLUTION_AUTO);
 int convolution(const Mat& input, Mat& output, const Mat& kernel);
 
+/* kernel equal to correlating with first and then with second */
+Mat_<float> compose_kernels(const Mat& first, const Mat& second);
+
+/* settings of ConvolutionAlgorithm, the same as its command line options
+ * the kernel is kernel_matrix, read from kernel_file or one of the named
+ * kernels, in that order. gaussian is the standard deviation of a gaussian
+ * applied first, 0 for none. polar_x and polar_y name kernels for the
+ * gradient magnitude, instead of filtering */
+struct ConvolutionConfig {
+    std::string kernel;
+    std::string kernel_file;
+    Mat_<float> kernel_matrix;
+    float gaussian = 0;
+    bool laplacian = false;
+    std::string polar_x;
+    std::string polar_y;
+    int method = CONVOLUTION_AUTO;
+    int threads = 1;
+};
+
 class ConvolutionAlgorithm : public FrameAlgorithm {
 public:
     bool apply_gauss = false;
@@ -16,16 +96,26 @@ public:
     std::string kernel_key_y;
 
     std::map<std::string, Mat_<float>> kernels;
+    std::map<std::string, ConvolutionKernel> prepared;
+    /* the gaussian, laplacian and kernel composed into one kernel */
+    ConvolutionKernel chain;
+    std::vector<ConvolutionKernel> polar;
+    int method = CONVOLUTION_AUTO;
+    int threads = 1;
+    std::shared_ptr<ThreadPool> pool;
 
 ConvolutionAlgorithm() : FrameAlgorithm(
-R".(Usage: convolution [--kernel=<name>] [--gaussian=<stddev>] [--laplacian] [--polar-x=<kernel-x> --polar-y=<kernel-y>] [--help | -h]] [<algorithm> [<args>...]]
+R".(Usage: convolution [--kernel=<name> | --kernel-file=<path>] [--gaussian=<stddev>] [--laplacian] [--polar-x=<kernel-x> --polar-y=<kernel-y>] [--method=<method>] [--threads=<n>] [--help | -h]] [<algorithm> [<args>...]]
 
 options:
   -k <name> --kernel=<name> Apply a given kernel.
+  -f <path> --kernel-file=<path> Apply a kernel read from a file, as a YAML, XML or JSON "kernel" matrix or as plain text rows.
   -g <stddev> --gaussian=<stddev> Gaussian.
   -l --laplacian Laplacian.
   -px <kernel-x> --polar-x=<kernel-x> Grayscale magnitude. Must also give --polar-y.
   -py <kernel-y> --polar-y=<kernel-y> Grayscale magnitude. Must also give --polar-x.
+  -m <method> --method=<method> Convolve directly, with FFTs or pick by cost: direct, fft or auto [default: auto].
+  -t <n> --threads=<n> Convolve blocks of rows in parallel [default: 1].
 
 Kernels:
 ).")
@@ -59,6 +149,7 @@ Kernels:
         /* append kernel names to documentation */
         for (auto& k: kernels) {
             doc += "  " + k.first + "\n";
+            prepared[k.first] = ConvolutionKernel(k.second);
         }
     }
 
@@ -75,51 +166,219 @@ Kernels:
         return false;
     }
 
+    /* returns false if a kernel is unknown or can't be read, which is
+     * then left out */
+    inline bool configure(const ConvolutionConfig& config)
+    {
+        bool ok = true;
+        apply_kernel = false;
+        if (!config.kernel_matrix.empty()) {
+            kernel_key = "<kernel>";
+            kernels[kernel_key] = config.kernel_matrix;
+            apply_kernel = true;
+        } else if (!config.kernel_file.empty()) {
+            kernel_key = config.kernel_file;
+            apply_kernel = load_kernel(kernel_key, kernels[kernel_key]) == 0;
+            if (!apply_kernel) {
+                kernels.erase(kernel_key);
+                ok = false;
+            }
+        } else if (!config.kernel.empty()) {
+            kernel_key = config.kernel;
+            apply_kernel = kernels.count(kernel_key) > 0;
+            ok = apply_kernel;
+        }
+        if (apply_kernel) {
+            prepared[kernel_key] = ConvolutionKernel(kernels[kernel_key]);
+        }
+        apply_laplacian = config.laplacian;
+        apply_gauss = config.gaussian > 0;
+        gauss_stddev = apply_gauss ? config.gaussian : gauss_stddev;
+        apply_polar = false;
+        if (!config.polar_x.empty() || !config.polar_y.empty()) {
+            apply_polar = kernels.count(config.polar_x) > 0
+                       && kernels.count(config.polar_y) > 0;
+            ok = ok && apply_polar;
+        }
+        if (apply_polar) {
+            kernel_key_x = config.polar_x;
+            kernel_key_y = config.polar_y;
+            polar = {prepared[kernel_key_x], prepared[kernel_key_y]};
+        }
+        chain = ConvolutionKernel();
+        compose_chain();
+        method = config.method;
+        threads = config.threads;
+        pool.reset();
+        if (threads > 1) {
+            pool = std::make_shared<ThreadPool>(threads - 1);
+        }
+        return ok;
+    }
+
     inline virtual std::map<std::string, docopt::value>
     parse_arguments(std::map<std::string, docopt::value> m,
                     std::vector<std::string> a)
     {
         FrameAlgorithm::parse_arguments(m, a);
+        ConvolutionConfig config;
         if (is_kernel(args["--kernel"])) {
-            kernel_key = args["--kernel"].asString();
-            apply_kernel = true;
+            config.kernel = args["--kernel"].asString();
+        }
+        if (args["--kernel-file"].isString()) {
+            config.kernel_file = args["--kernel-file"].asString();
         }
         if (!args["--laplacian"].isEmpty() && args["--laplacian"].asBool()) {
-            apply_laplacian = true;
+            config.laplacian = true;
         }
         if (args["--gaussian"].isString()) {
-            apply_gauss = true;
-            gauss_stddev = docopt_to_float(args, "--gaussian", gauss_stddev);
+            config.gaussian = docopt_to_float(args, "--gaussian", gauss_stddev);
         }
         if (is_kernel(args["--polar-x"]) && is_kernel(args["--polar-y"])) {
-            apply_polar = true;
-            kernel_key_x = args["--polar-x"].asString();
-            kernel_key_y = args["--polar-y"].asString();
+            config.polar_x = args["--polar-x"].asString();
+            config.polar_y = args["--polar-y"].asString();
+        }
+        if (args["--method"].isString()) {
+            std::string m = args["--method"].asString();
+            if (m == "direct") {
+                config.method = CONVOLUTION_DIRECT;
+            } else if (m == "fft") {
+                config.method = CONVOLUTION_FFT;
+            } else if (m != "auto") {
+                std::cout << "convolution method '" << m << "' unknown" << std::endl;
+            }
+        }
+        config.threads = (int)docopt_to_float(args, "--threads", config.threads);
+        if (!configure(config) && !config.kernel_file.empty()) {
+            std::cout << "can't read convolution kernel from '"
+                      << config.kernel_file << "'" << std::endl;
         }
         return args;
     }
 
-    inline virtual void process_frame(const Mat& in, Mat& out, std::string prefix="") override
+    /* the filters are linear, so applying them one after another equals a
+     * single pass with the composition of their kernels. intermediate
+     * results are no longer rounded or saturated, and borders are only
+     * extended once */
+    inline void compose_chain()
     {
-        in.copyTo(out);
+        Mat_<float> composed(1, 1, 1.0f);
         if (apply_gauss) {
-            GaussianBlur(out, out, Size(9, 9), gauss_stddev, gauss_stddev);
+            /* the window size GaussianBlur picks for 8-bit images */
+            int size = cvRound(gauss_stddev * 6 + 1) | 1;
+            Mat g = getGaussianKernel(size, gauss_stddev, CV_32F);
+            Mat gauss = g * g.t();
+            composed = compose_kernels(composed, gauss);
         }
         if (apply_laplacian) {
-            Laplacian(out, out, -1, 9);
+            /* the second derivatives Laplacian sums for an aperture of 9 */
+            Mat d2, smooth;
+            getDerivKernels(d2, smooth, 2, 0, 9, false, CV_32F);
+            Mat d2x = smooth * d2.t();
+            Mat d2y = d2 * smooth.t();
+            composed = compose_kernels(composed, d2x + d2y);
         }
         if (apply_kernel) {
-            filter2D(out, out, -1, kernels[kernel_key]);
+            composed = compose_kernels(composed, kernels[kernel_key]);
+        }
+        if (apply_gauss || apply_laplacian || apply_kernel) {
+            chain = ConvolutionKernel(composed);
+        }
+    }
+
+    inline virtual void process_frame(const Mat& in, Mat& out, std::string prefix="") override
+    {
+        filter(in, out, &workspace, pool.get());
+    }
+
+    /* kernels filter every channel at the depth of the frame, so a gray
+     * frame is the cheapest. polar gradients are found on gray floats */
+    inline virtual std::vector<PixelFormat> input_formats() override
+    {
+        if (apply_polar) {
+            return {PIXELS_GRAY8, PIXELS_GRAY32F, PIXELS_BGR8};
+        }
+        return {PIXELS_GRAY8, PIXELS_BGR8, PIXELS_GRAY32F};
+    }
+
+    inline virtual PixelFormat output_format(PixelFormat input) override
+    {
+        return apply_polar ? PIXELS_GRAY32F : input;
+    }
+
+    /* furthest a kernel reaches from its anchor */
+    static int reach(const ConvolutionKernel& k)
+    {
+        return std::max(std::max(k.anchor.x, k.kernel.cols - 1 - k.anchor.x),
+                        std::max(k.anchor.y, k.kernel.rows - 1 - k.anchor.y));
+    }
+
+    inline virtual int halo() override
+    {
+        if (apply_polar) {
+            return std::max(reach(polar[0]), reach(polar[1]));
         }
+        return chain.kernel.empty() ? 0 : reach(chain);
+    }
+
+    /* filter each dirty rectangle with the pixels around it, and keep the
+     * part of the result that does not depend on the borders */
+    inline virtual bool process_dirty(const Mat& in, Mat& out,
+                                      const std::vector<Rect>& dirty,
+                                      std::string prefix="") override
+    {
+        const int h = halo();
+        const Rect frame(Point(0, 0), in.size());
+        parallel_for(pool.get(), 0, (int)dirty.size(), [&](int i) {
+            const Rect r = dirty[i];
+            const Rect grown = Rect(r.x - h, r.y - h, r.width + 2 * h,
+                                    r.height + 2 * h) & frame;
+            Mat filtered;
+            filter(in(grown), filtered, nullptr, nullptr);
+            Mat dst = out(r);
+            filtered(Rect(r.x - grown.x, r.y - grown.y, r.width, r.height))
+                .copyTo(dst);
+        });
+        return true;
+    }
+
+    inline void filter(const Mat& in, Mat& out, Workspace* workspace,
+                       ThreadPool* pool)
+    {
         if (apply_polar) {
-            cvtColor(in, out, CV_BGR2GRAY);
-            out.convertTo(out, CV_32FC1, 1/256.0);
-
-            Mat x, y, dir;
-            filter2D(out, x, CV_32F, kernels[kernel_key_x]);
-            filter2D(out, y, CV_32F, kernels[kernel_key_y]);
-            cartToPolar(x, y, out, dir, true);
-            dir /= 360;
+            Mat scaled = in;
+            if (in.type() != CV_32FC1) {
+                TRACE_SCOPE("convolution gray");
+                Mat gray = in;
+                if (in.type() != CV_8UC1) {
+                    gray = workspace_mat(workspace, "gray", in.size(), CV_8UC1);
+                    cvtColor(in, gray, CV_BGR2GRAY);
+                }
+                scaled = workspace_mat(workspace, "scaled", in.size(), CV_32FC1);
+                gray.convertTo(scaled, CV_32FC1, 1/256.0);
+            }
+
+            /* both derivatives, in one pass over the image unless the
+             * method says otherwise, into the workspace buffers since they
+             * match the output type */
+            std::vector<Mat> xy = {
+                workspace_mat(workspace, "x", in.size(), CV_32FC1),
+                workspace_mat(workspace, "y", in.size(), CV_32FC1)
+            };
+            {
+                TRACE_SCOPE("convolution derivatives");
+                convolution(scaled, xy, polar, CV_32F, BORDER_REFLECT_101, pool,
+                            method);
+            }
+
+            /* only the magnitude is output, the direction is not found */
+            TRACE_SCOPE("convolution polar");
+            magnitude(xy[0], xy[1], out);
+        } else if (!chain.kernel.empty()) {
+            TRACE_SCOPE("convolution filter");
+            convolution(in, out, chain, -1, BORDER_REFLECT_101, pool, method);
+        } else {
+            in.copyTo(out);
         }
     }
 };
@@ -0,0 +1,112 @@
+#include "formats.hpp"
+#include "util.hpp"
+
+int pixel_type(PixelFormat format)
+{
+    switch (format) {
+    case PIXELS_BGR8:
+        return CV_8UC3;
+    case PIXELS_GRAY8:
+        return CV_8UC1;
+    case PIXELS_GRAY32F:
+        return CV_32FC1;
+    case PIXELS_LABELS32S:
+        return CV_32SC1;
+    }
+    return -1;
+}
+
+bool pixel_format(const cv::Mat& mat, PixelFormat& format)
+{
+    for (int f = 0; f < PIXEL_FORMATS; f++) {
+        if (mat.type() == pixel_type((PixelFormat)f)) {
+            format = (PixelFormat)f;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* conversions convert_pixels makes in one step */
+static bool direct_conversion(PixelFormat from, PixelFormat to)
+{
+    switch (to) {
+    case PIXELS_BGR8:
+        return from != PIXELS_GRAY32F;
+    case PIXELS_GRAY8:
+        return from != PIXELS_LABELS32S;
+    case PIXELS_GRAY32F:
+        return from == PIXELS_GRAY8 || from == PIXELS_GRAY32F;
+    case PIXELS_LABELS32S:
+        return from == PIXELS_LABELS32S;
+    }
+    return false;
+}
+
+PixelFormat conversion_source(PixelFormat from, PixelFormat to)
+{
+    if (direct_conversion(from, to)) {
+        return from;
+    }
+    switch (to) {
+    case PIXELS_BGR8:
+    case PIXELS_GRAY32F:
+        return PIXELS_GRAY8;
+    case PIXELS_GRAY8:
+        return PIXELS_BGR8;
+    case PIXELS_LABELS32S:
+        break;
+    }
+    return from;
+}
+
+bool convert_pixels(const cv::Mat& src, cv::Mat& dst, PixelFormat format)
+{
+    PixelFormat from;
+    if (!pixel_format(src, from) || !direct_conversion(from, format)) {
+        return false;
+    }
+    if (from == format) {
+        src.copyTo(dst);
+    } else if (from == PIXELS_BGR8 && format == PIXELS_GRAY8) {
+        cvtColor(src, dst, CV_BGR2GRAY);
+    } else if (from == PIXELS_GRAY8 && format == PIXELS_BGR8) {
+        cvtColor(src, dst, CV_GRAY2BGR);
+    } else if (from == PIXELS_GRAY8 && format == PIXELS_GRAY32F) {
+        src.convertTo(dst, CV_32FC1, 1.0 / 256);
+    } else if (from == PIXELS_GRAY32F && format == PIXELS_GRAY8) {
+        src.convertTo(dst, CV_8UC1, 256);
+    } else {
+        labels_to_bgr(src, dst);
+    }
+    return true;
+}
+
+void FrameCache::reset(const cv::Mat& frame)
+{
+    this->frame = frame;
+    known = pixel_format(frame, format);
+    for (int f = 0; f < PIXEL_FORMATS; f++) {
+        valid[f] = false;
+    }
+}
+
+const cv::Mat& FrameCache::get(PixelFormat to)
+{
+    if (!known) {
+        return none;
+    }
+    if (to == format) {
+        return frame;
+    }
+    if (!valid[to]) {
+        const PixelFormat source = conversion_source(format, to);
+        const cv::Mat& from = source == format ? frame : get(source);
+        if (from.empty() || !convert_pixels(from, converted[to], to)) {
+            return none;
+        }
+        valid[to] = true;
+        conversions++;
+    }
+    return converted[to];
+}
@@ -0,0 +1,60 @@
+#ifndef _FORMATS_HPP
+#define _FORMATS_HPP
+
+#include <opencv2/opencv.hpp>
+
+/* pixels of the frames algorithms take and produce
+ * 8-bit values are 0 to 255, and floats 0 to 1 in steps of 1/256 like the
+ * gray images the algorithms find their gradients on */
+enum PixelFormat {
+    PIXELS_BGR8,
+    PIXELS_GRAY8,
+    PIXELS_GRAY32F,
+    PIXELS_LABELS32S
+};
+
+const int PIXEL_FORMATS = 4;
+
+/* OpenCV type of the pixels */
+int pixel_type(PixelFormat format);
+
+/* the format of an image, false when it has none of them */
+bool pixel_format(const cv::Mat& mat, PixelFormat& format);
+
+/* the format the last step of a conversion from one format to another
+ * starts from, which is from itself when it converts directly */
+PixelFormat conversion_source(PixelFormat from, PixelFormat to);
+
+/* convert src to a format into dst, which is only reallocated when it does
+ * not have the size and type already. BGR and gray convert both ways, gray
+ * to and from floats, and labels to colours. conversions through another
+ * format, see conversion_source, and to labels return false */
+bool convert_pixels(const cv::Mat& src, cv::Mat& dst, PixelFormat format);
+
+/* the formats of a frame, each converted from it at most once
+ *
+ * formats that go through another share it, so the gray image is found once
+ * for both the 8-bit and the float gray frame. buffers are kept for the next
+ * frame, so frames of the same size are converted without allocating */
+class FrameCache {
+public:
+    /* start on a new frame, conversions of the last one are dropped */
+    void reset(const cv::Mat& frame);
+
+    /* the frame in a format, the frame itself when it has the format
+     * an empty image when the format can't be reached */
+    const cv::Mat& get(PixelFormat format);
+
+    /* conversions done over all frames */
+    long conversions = 0;
+
+private:
+    cv::Mat frame;
+    bool known = false;
+    PixelFormat format = PIXELS_BGR8;
+    cv::Mat converted[PIXEL_FORMATS];
+    bool valid[PIXEL_FORMATS] = {};
+    cv::Mat none;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#include "incremental.hpp"
+#include "simd.hpp"
+
+static uint64_t excess_scalar(const uchar* a, const uchar* b, int n,
+                              int noise)
+{
+    uint64_t sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += (uint64_t)std::max(std::abs((int)a[i] - (int)b[i]) - noise, 0);
+    }
+    return sum;
+}
+
+#ifdef COMPOSER_SSE2
+static uint64_t excess_sse2(const uchar* a, const uchar* b, int n, int noise)
+{
+    /* the saturated differences both ways give |a - b|, less the noise,
+     * and psadbw against zero sums each half into a 64-bit lane */
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i floor = _mm_set1_epi8((char)noise);
+    __m128i acc = zero;
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        __m128i d = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_subs_epu8(d, floor), zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return lanes[0] + lanes[1] + excess_scalar(a + i, b + i, n - i, noise);
+}
+#endif
+
+#ifdef COMPOSER_AVX2
+TARGET_AVX2
+static uint64_t excess_avx2(const uchar* a, const uchar* b, int n, int noise)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i floor = _mm256_set1_epi8((char)noise);
+    __m256i acc = zero;
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        __m256i d = _mm256_or_si256(_mm256_subs_epu8(x, y), _mm256_subs_epu8(y, x));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_subs_epu8(d, floor), zero));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3]
+         + excess_sse2(a + i, b + i, n - i, noise);
+}
+#endif
+
+uint64_t sad_excess(const uchar* a, const uchar* b, int n, int noise)
+{
+    noise = std::min(std::max(noise, 0), 255);
+#ifdef COMPOSER_AVX2
+    if (cpu_has_avx2()) {
+        return excess_avx2(a, b, n, noise);
+    }
+#endif
+#ifdef COMPOSER_SSE2
+    return excess_sse2(a, b, n, noise);
+#else
+    return excess_scalar(a, b, n, noise);
+#endif
+}
+
+void DirtyTiles::update(const cv::Mat& frame)
+{
+    const cv::Size tiles((frame.cols + tile_size - 1) / tile_size,
+                         (frame.rows + tile_size - 1) / tile_size);
+    if (reference.size() != frame.size() || reference.type() != frame.type()) {
+        frame.copyTo(reference);
+        size = frame.size();
+        mask.create(tiles, CV_8UC1);
+        mask.setTo(1);
+        compared += tiles.area();
+        changed += tiles.area();
+        return;
+    }
+
+    const size_t elem = frame.elemSize();
+    for (int ty = 0; ty < tiles.height; ty++) {
+        const int y0 = ty * tile_size;
+        const int y1 = std::min(y0 + tile_size, frame.rows);
+        uchar* dirty = mask.ptr<uchar>(ty);
+        for (int tx = 0; tx < tiles.width; tx++) {
+            const int x0 = tx * tile_size;
+            const int x1 = std::min(x0 + tile_size, frame.cols);
+            const int bytes = (int)((x1 - x0) * elem);
+            /* stop at the first row that changed */
+            dirty[tx] = 0;
+            for (int y = y0; y < y1 && !dirty[tx]; y++) {
+                dirty[tx] = sad_excess(frame.ptr<uchar>(y) + x0 * elem,
+                                       reference.ptr<uchar>(y) + x0 * elem,
+                                       bytes, noise) > 0;
+            }
+            if (dirty[tx]) {
+                cv::Rect tile(x0, y0, x1 - x0, y1 - y0);
+                cv::Mat dst = reference(tile);
+                frame(tile).copyTo(dst);
+                changed++;
+            }
+        }
+    }
+    compared += tiles.area();
+}
+
+void DirtyTiles::grow(int halo)
+{
+    if (halo < 0) {
+        mask.setTo(1);
+        return;
+    }
+    const int reach = (halo + tile_size - 1) / tile_size;
+    if (reach == 0 || none()) {
+        return;
+    }
+    cv::Mat grown = cv::Mat::zeros(mask.size(), CV_8UC1);
+    for (int ty = 0; ty < mask.rows; ty++) {
+        const uchar* dirty = mask.ptr<uchar>(ty);
+        for (int tx = 0; tx < mask.cols; tx++) {
+            if (!dirty[tx]) {
+                continue;
+            }
+            for (int y = std::max(ty - reach, 0);
+                 y <= std::min(ty + reach, mask.rows - 1); y++) {
+                uchar* row = grown.ptr<uchar>(y);
+                for (int x = std::max(tx - reach, 0);
+                     x <= std::min(tx + reach, mask.cols - 1); x++) {
+                    row[x] = 1;
+                }
+            }
+        }
+    }
+    mask = grown;
+}
+
+std::vector<cv::Rect> DirtyTiles::rects() const
+{
+    std::vector<cv::Rect> rects;
+    for (int ty = 0; ty < mask.rows; ty++) {
+        const uchar* dirty = mask.ptr<uchar>(ty);
+        const int y0 = ty * tile_size;
+        const int y1 = std::min(y0 + tile_size, size.height);
+        for (int tx = 0; tx < mask.cols; tx++) {
+            if (!dirty[tx]) {
+                continue;
+            }
+            int end = tx;
+            while (end + 1 < mask.cols && dirty[end + 1]) {
+                end++;
+            }
+            const int x0 = tx * tile_size;
+            const int x1 = std::min((end + 1) * tile_size, size.width);
+            rects.push_back(cv::Rect(x0, y0, x1 - x0, y1 - y0));
+            tx = end;
+        }
+    }
+    return rects;
+}
+
+bool DirtyTiles::all() const
+{
+    return cv::countNonZero(mask) == (int)mask.total();
+}
+
+bool DirtyTiles::none() const
+{
+    return cv::countNonZero(mask) == 0;
+}
+
+void process_incremental(FrameAlgorithm& algorithm, const cv::Mat& in,
+                         cv::Mat& out, DirtyTiles& dirty,
+                         const std::string& prefix)
+{
+    if (out.empty() || out.size() != in.size() || dirty.all()) {
+        algorithm.process_frame(in, out, prefix);
+        dirty.grow(-1);
+        return;
+    }
+    if (dirty.none()) {
+        return;
+    }
+    dirty.grow(algorithm.halo());
+    if (!algorithm.process_dirty(in, out, dirty.rects(), prefix)) {
+        dirty.grow(-1);
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef _INCREMENTAL_HPP
+#define _INCREMENTAL_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "util.hpp"
+
+/* the tiles of a camera stream that changed since they were last processed
+ *
+ * each tile of a frame is compared with the reference, the pixels of the
+ * tile when it was last found dirty. a tile is dirty when any of its bytes
+ * differs by more than noise, so a small object is not lost in a large
+ * tile. comparing against the last processed pixels instead of the
+ * previous frame catches slow drifts. the first frame, and any frame of a
+ * different size or type, is dirty everywhere */
+class DirtyTiles {
+public:
+    explicit DirtyTiles(int tile_size=32, int noise=8)
+        : tile_size(std::max(tile_size, 1)), noise(noise) {}
+
+    /* mark the tiles of frame that changed and copy them to the reference */
+    void update(const cv::Mat& frame);
+
+    /* also mark the tiles within halo pixels of a dirty tile, or every tile
+     * when halo is negative */
+    void grow(int halo);
+
+    /* dirty tiles in pixels, neighbouring dirty tiles of a row of tiles
+     * are joined into one rectangle */
+    std::vector<cv::Rect> rects() const;
+
+    bool all() const;
+    bool none() const;
+
+    int tile_size;
+    int noise;
+
+    /* one byte per tile, nonzero when dirty */
+    cv::Mat mask;
+    cv::Size size;
+
+    /* tiles compared and tiles found dirty, over all frames */
+    long compared = 0;
+    long changed = 0;
+
+private:
+    cv::Mat reference;
+};
+
+/* run an algorithm on the frame in, reusing out from the last frame where
+ * the dirty tiles of in allow it, and grow dirty to the tiles of out that
+ * may have changed, which are the tiles of in the next algorithm gets
+ * out is left as it is when nothing changed, and the whole frame is
+ * processed when everything did or out has another size */
+void process_incremental(FrameAlgorithm& algorithm, const cv::Mat& in,
+                         cv::Mat& out, DirtyTiles& dirty,
+                         const std::string& prefix);
+
+/* sum of the absolute differences of n bytes, less noise for each byte
+ * and never negative, so it is 0 when no byte differs by more than noise */
+uint64_t sad_excess(const uchar* a, const uchar* b, int n, int noise);
+
+#endif
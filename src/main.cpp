@@ -1,28 +1,111 @@
+#include <csignal>
 #include <memory>
 #include <iostream>
 #include <map>
+#include <sstream>
 
 #include "../lib/docopt.cpp/docopt.h"
 #include "util.hpp"
-#include "convolution.hpp"
-#include "canny.hpp"
-#include "two_pass.hpp"
+#include "composer.hpp"
+#include "pipeline.hpp"
+#include "capture.hpp"
+#include "batch.hpp"
+#include "incremental.hpp"
+#include "stream.hpp"
+#include "budget.hpp"
+#include "server.hpp"
 
 using namespace cv;
 
 std::string doc =
-R"(Usage: composer [-Sng] [--image=<path>...] [--camera]
-                [--quiet] [--help]
+R"(Usage: composer [-Sngp] [--image=<path>...] [--camera] [--video=<path>...]
+                [--every-frame] [--raw=<WxH> [--raw-format=<fmt>]]
+                [--output-stream=<path> [--output-format=<fmt>]]
+                [--queue-size=<n>] [--drop-oldest]
+                [--incremental [--tile-size=<n>] [--tile-noise=<n>]]
+                [--budget-ms=<n>] [--writers=<n>] [--png-compression=<level>] [--float-maps]
+                [--trace=<file>] [--quiet] [--help]
                 <algorithm> [<args>...]
+       composer --batch=<path>... [--output-dir=<dir>] [--jobs=<n>]
+                [--readers=<n>] [--max-in-flight=<n>] [--png-compression=<level>]
+                [--float-maps] [--trace=<file>] [--quiet]
+                <algorithm> [<args>...]
+       composer --serve=<socket> [--jobs=<n>] [--client-queue=<n>]
+                [--trace=<file>] [--quiet] <algorithm> [<args>...]
        composer --version
 
 Options:
   -i <path> --image=<path> Process an image.
   -c --camera              Process stream from default camera.
+  -v <path> --video=<path> Process a video file or an image sequence such as
+                           frame_%04d.png as if it came from a camera.
+     --every-frame         Process every frame of videos as fast as possible,
+                           instead of the latest frame at their frame rate.
+                           Y4M streams, files ending in .y4m or - for
+                           standard input, are read this way unpaced.
+     --raw=<WxH>           Read videos as raw frames of this size in pixels,
+                           e.g. 640x480, mapping files instead of decoding.
+     --raw-format=<fmt>    Pixels of raw frames, bgr or gray [default: bgr].
+     --output-stream=<path>
+                           Write the output of the last algorithm for the
+                           first camera or video as a stream, - for
+                           standard output.
+     --output-format=<fmt> Format of the output stream, y4m or raw
+                           [default: y4m].
   -S --show-intermediates  Show intermediate steps for all algorithms.
   -n --no-gui              Save output to .png instead of showing using
-                           OpenCV's highgui. Does not save any video.
+                           OpenCV's highgui. Camera and video frames are
+                           processed without showing or saving them,
+                           apart from --output-stream.
   -g --no-interm-gui       Same as above, applies only to intermediate images.
+  -p --pipeline            Run each algorithm on camera and video frames in
+                           its own thread, passing frames between them in
+                           queues.
+     --queue-size=<n>      Frames waiting before each pipeline stage
+                           [default: 2].
+     --drop-oldest         Drop the oldest waiting frame when a pipeline
+                           queue is full, instead of skipping new frames.
+     --incremental         Only process the tiles of camera and video frames
+                           that changed since the last frame where the
+                           algorithms allow it, reusing the last results
+                           elsewhere. Not used with --pipeline.
+     --tile-size=<n>       Width and height of tiles in pixels [default: 32].
+     --tile-noise=<n>      Largest change of a pixel's channel from when its
+                           tile was last processed that is taken as noise
+                           [default: 8].
+     --budget-ms=<n>       Time to process each frame of cameras and videos
+                           in. Over it, intermediate images are no longer
+                           shown or saved and algorithms lower their
+                           quality, restoring it when there is time to
+                           spare. Not used with --pipeline.
+  -b <path> --batch=<path> Process every image of a directory or glob
+                           pattern without a gui, writing the results to
+                           the output directory.
+  -o <dir> --output-dir=<dir>
+                           Directory for batch results, created if needed
+                           [default: .].
+  -j <n> --jobs=<n>        Images processed at once in a batch, or frames
+                           with --serve [default: 1].
+     --readers=<n>         Threads decoding images ahead of the jobs in a
+                           batch, 0 for one per job [default: 0].
+     --max-in-flight=<n>   Most images of a batch decoded and not yet
+                           written, whether queued or being processed, 0
+                           for one per job and reader [default: 0].
+     --serve=<socket>      Keep the chain of algorithms running and process
+                           frames clients pass in shared memory over a unix
+                           socket, see composer_client.
+     --client-queue=<n>    Frames each client may have waiting with --serve,
+                           more are turned away [default: 16].
+     --writers=<n>         Threads writing intermediate images in the
+                           background without a gui [default: 1].
+     --png-compression=<level>
+                           PNG compression from 0, fastest, to 9
+                           [default: 3].
+     --float-maps          Write images as uncompressed .pfm float maps
+                           instead of 8-bit .png files.
+     --trace=<file>        Record how long each algorithm and its stages
+                           take, and waits for frames and the display, as
+                           a Chrome trace for chrome://tracing or Perfetto.
   -h --help                Show this message.
      --version             Print version.
   -q --quiet               Suppress all printing.
@@ -68,21 +151,265 @@ bool open_camera(int id, VideoCapture& cap)
     return true;
 }
 
+bool open_video(const std::string& path, VideoCapture& cap)
+{
+    std::cout << "Reading from '" << path << "'" << std::endl;
+    cap = VideoCapture(path);
+    if (!cap.isOpened()) {
+        std::cout << "Failed to open '" << path << "'" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/* size of raw frames as WxH, empty if it isn't one */
+Size parse_size(const std::string& name)
+{
+    int w = 0, h = 0;
+    char x = 0;
+    std::istringstream in(name);
+    if (in >> w >> x >> h && x == 'x' && w > 0 && h > 0) {
+        return Size(w, h);
+    }
+    return Size();
+}
+
+/* true for videos read as streams rather than decoded */
+bool is_stream(const std::string& path, bool raw)
+{
+    const std::string ext = ".y4m";
+    return raw || path == "-" || (path.size() >= ext.size() &&
+        path.compare(path.size() - ext.size(), ext.size(), ext) == 0);
+}
+
+/* writes the final output of the first source to the stream, if any */
+void write_stream(StreamWriter* stream, const Mat& output, bool quiet)
+{
+    if (stream != nullptr && !stream->write(output) && !quiet) {
+        std::cout << "Failed to write the output stream: "
+                  << stream->error() << std::endl;
+    }
+}
+
+/* true when every source has run out of frames */
+bool sources_finished(std::vector<std::shared_ptr<CaptureThread>>& sources)
+{
+    for (auto& s: sources) {
+        if (!s->finished()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* write the trace if one was recorded */
+void finish_trace(const std::string& path)
+{
+    if (!path.empty() && !write_trace(path)) {
+        std::cout << "Can't write trace to '" << path << "'" << std::endl;
+    }
+}
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+/* stop after the current frames, a second Ctrl-C exits at once */
+static void interrupt(int)
+{
+    interrupted = 1;
+    std::signal(SIGINT, SIG_DFL);
+}
+
+/* show pending windows and check for q, ESC or Ctrl-C */
+bool quit_requested(bool gui)
+{
+    if (interrupted) {
+        return true;
+    }
+    if (!gui) {
+        return false;
+    }
+    TRACE_SCOPE("display");
+    show_deferred();
+    auto key = cv::waitKey(1);
+    return key == 'q' || key == 'Q' || key == 27;
+}
+
+/* run each algorithm in sequence on the latest frame of every source
+ * the frames and the outputs of every algorithm are kept between frames,
+ * so their buffers are reused. with incremental tiles, only the tiles of
+ * each source that changed are processed. with a budget, the algorithms run at the quality it picks */
+void run_sequential(std::vector<std::shared_ptr<CaptureThread>>& sources,
+                    const std::vector<std::shared_ptr<FrameAlgorithm>>& algorithms,
+                    const std::vector<std::string>& names,
+                    bool gui, LatencyStats& latency,
+                    FrameAllocations& allocations,
+                    const DirtyTiles* incremental, StreamWriter* stream,
+                    BudgetScheduler* budget, bool quiet)
+{
+    /* the last stage of the budget shows and saves images */
+    const size_t display = algorithms.size();
+    std::vector<DirtyTiles> tiles;
+    std::vector<std::vector<Mat>> outputs(sources.size(),
+                                          std::vector<Mat>(algorithms.size()));
+    std::vector<ChainInputs> inputs(sources.size(), ChainInputs(algorithms));
+    std::vector<CapturedFrame> captured(sources.size());
+    /* capture times of the frames until they are shown */
+    std::vector<int64> timestamps;
+    if (incremental != nullptr) {
+        tiles.assign(sources.size(), *incremental);
+    }
+    while (!sources_finished(sources)) {
+        /* the budget covers a frame of every source */
+        bool processed = false;
+        for (int i = 0; i < sources.size(); i++) {
+            {
+                TRACE_SCOPE("wait for frame");
+                if (!sources[i]->latest(captured[i], 5)) {
+                    continue;
+                }
+            }
+            Mat frame = captured[i].image;
+            bool intermediates = budget == nullptr || budget->quality(display) == 0;
+            int64 start = getTickCount();
+            save_mat("input_" + std::to_string(i), frame, gui && intermediates, true);
+            if (budget != nullptr) {
+                budget->add(display, getTickCount() - start);
+            }
+            if (!tiles.empty()) {
+                TRACE_SCOPE("find changed tiles");
+                tiles[i].update(frame);
+            }
+            for (int j = 0; j < algorithms.size(); j++) {
+                auto prefix = names[j] + "_" + std::to_string(i);
+                Mat& output = outputs[i][j];
+                if (budget != nullptr) {
+                    algorithms[j]->quality = budget->quality(j);
+                }
+                start = getTickCount();
+                {
+                    TRACE_SCOPE(prefix);
+                    const Mat& input = inputs[i].input(j, frame);
+                    if (tiles.empty()) {
+                        algorithms[j]->process_frame(input, output, prefix);
+                    } else {
+                        process_incremental(*algorithms[j], input, output,
+                                            tiles[i], prefix);
+                    }
+                }
+                int64 shown = getTickCount();
+                save_mat(prefix, output,
+                         gui && (intermediates || j + 1 == algorithms.size()),
+                         true);
+                if (budget != nullptr) {
+                    budget->add(j, shown - start);
+                    budget->add(display, getTickCount() - shown);
+                }
+                frame = output;
+            }
+            processed = true;
+            if (i == 0) {
+                write_stream(stream, frame, quiet);
+            }
+            timestamps.push_back(captured[i].timestamp);
+        }
+        if (processed && budget != nullptr) {
+            budget->end_frame();
+        }
+        bool quit = quit_requested(gui);
+        for (auto t: timestamps) {
+            latency.add(t);
+            allocations.frame();
+        }
+        timestamps.clear();
+        if (quit) {
+            break;
+        }
+    }
+    if (budget != nullptr && !quiet) {
+        budget->print(std::cout);
+    }
+    for (size_t i = 0; i < tiles.size() && !quiet; i++) {
+        std::cout << "Processed " << tiles[i].changed << " of "
+                  << tiles[i].compared << " tiles from source " << i
+                  << std::endl;
+    }
+}
+
+/* run the chain of algorithms on frames, one thread per algorithm
+ * the main thread takes frames from the sources and shows windows. new
+ * frames are skipped while the first stage is busy, unless full queues
+ * drop their oldest */
+void run_pipeline(std::vector<std::shared_ptr<CaptureThread>>& sources,
+                  const std::vector<std::shared_ptr<FrameAlgorithm>>& algorithms,
+                  const std::vector<std::string>& names,
+                  size_t queue_size, bool drop_oldest, bool gui,
+                  LatencyStats& latency, FrameAllocations& allocations,
+                  StreamWriter* stream, bool quiet)
+{
+    Pipeline pipeline(algorithms, names, queue_size,
+                      drop_oldest ? BoundedQueue<Frame>::DROP_OLDEST
+                                  : BoundedQueue<Frame>::BLOCK, gui);
+    long finished = 0;
+    /* capture times of the frames until they are shown */
+    std::vector<int64> timestamps;
+    while (pipeline.in_flight() > 0 || !sources_finished(sources)) {
+        for (int i = 0; i < sources.size(); i++) {
+            CapturedFrame captured;
+            {
+                TRACE_SCOPE("wait for frame");
+                if (pipeline.full() || !sources[i]->latest(captured, 1)) {
+                    continue;
+                }
+            }
+            Frame frame;
+            frame.frame_number = captured.frame_number;
+            frame.source = i;
+            frame.timestamp = captured.timestamp;
+            frame.image = captured.image;
+            save_mat("input_" + std::to_string(i), frame.image, gui, true);
+            pipeline.push(frame);
+        }
+
+        Frame done;
+        while (pipeline.pop(done)) {
+            if (done.source == 0) {
+                write_stream(stream, done.image, quiet);
+            }
+            timestamps.push_back(done.timestamp);
+            finished++;
+        }
+        bool quit = quit_requested(gui);
+        for (auto t: timestamps) {
+            latency.add(t);
+            allocations.frame();
+        }
+        timestamps.clear();
+        if (quit) {
+            break;
+        }
+    }
+    pipeline.stop();
+    if (!quiet) {
+        std::cout << "Finished " << finished << " frames, dropped "
+                  << pipeline.dropped() << " in the pipeline" << std::endl;
+    }
+}
+
 int main(int argc, char** argv )
 {
-    std::vector<Mat> frames, images;
-    std::vector<VideoCapture> cameras;
+    /* windows are shown from this thread */
+    gui_thread();
+
+    std::vector<Mat> images;
+    std::vector<std::shared_ptr<CaptureThread>> sources;
     std::vector<std::string> image_names;
 
     /* define available algorithms */
     std::map<std::string, std::function<std::shared_ptr<FrameAlgorithm>()>> algs;
 
-    algs["canny"] = []() {
-        return std::make_shared<CannyAlgorithm>(); };
-    algs["convolution"] = []() {
-        return std::make_shared<ConvolutionAlgorithm>(); };
-    algs["two_pass"] = []() {
-        return std::make_shared<TwoPassAlgorithm>(); };
+    for (auto& name: algorithm_names()) {
+        algs[name] = [name]() { return make_algorithm(name); };
+    }
 
     std::vector<std::string> v_argv(argv + 1, argv + argc);
 
@@ -97,13 +424,74 @@ int main(int argc, char** argv )
                          true); // leave options at end alone
     auto main_args = args;
 
-    /* open camera */
+    /* spans are recorded from here, and written when done */
+    std::string trace_path = main_args["--trace"].isString()
+                           ? main_args["--trace"].asString() : "";
+    if (!trace_path.empty()) {
+        start_trace();
+        trace_thread_name("main");
+    }
+
+    /* images are written in the background, set up before any are */
+    WriterOptions& writer = writer_options();
+    writer.threads = (int)docopt_to_float(main_args, "--writers", 1);
+    writer.png_compression = (int)docopt_to_float(main_args, "--png-compression", 3);
+    writer.quiet = main_args["--quiet"].asBool();
+    if (main_args["--float-maps"].asBool()) {
+        writer.format = WriterOptions::PFM;
+    }
+
+    /* open camera, frames are read on their own thread */
     if (main_args["--camera"].asBool()) {
         VideoCapture cap;
         if (open_camera(0, cap)) {
-            cameras.push_back(cap);
-            frames.push_back(Mat());
-            cameras.back() >> frames.back();
+            sources.push_back(std::make_shared<CaptureThread>(cap));
+        }
+    }
+
+    /* the output stream may be standard output, keep messages off it */
+    std::string stream_path = main_args["--output-stream"].isString()
+                            ? main_args["--output-stream"].asString() : "";
+    if (stream_path == "-") {
+        std::cout.rdbuf(std::cerr.rdbuf());
+    }
+
+    /* open videos, played like a camera unless every frame is wanted */
+    bool every_frame = main_args["--every-frame"].asBool();
+    bool raw = main_args["--raw"].isString();
+    Size raw_size = raw ? parse_size(main_args["--raw"].asString()) : Size();
+    std::string raw_format = main_args["--raw-format"].isString()
+                           ? main_args["--raw-format"].asString() : "bgr";
+    if (raw && raw_size.area() == 0) {
+        std::cout << "raw size '" << main_args["--raw"].asString()
+                  << "' unknown" << std::endl;
+        return 1;
+    }
+    if (raw_format != "bgr" && raw_format != "gray") {
+        std::cout << "raw format '" << raw_format << "' unknown" << std::endl;
+        return 1;
+    }
+    for (auto& path : main_args["--video"].asStringList()) {
+        if (is_stream(path, raw)) {
+            /* streams have nothing to decode, so no pacing to keep up */
+            std::cout << "Reading stream '" << path << "'" << std::endl;
+            auto reader = std::make_shared<StreamReader>(path,
+                raw ? STREAM_RAW : STREAM_Y4M, raw_size,
+                raw_format == "gray" ? CV_8UC1 : CV_8UC3);
+            if (!reader->error().empty()) {
+                std::cout << "Failed to open '" << path << "': "
+                          << reader->error() << std::endl;
+                continue;
+            }
+            sources.push_back(std::make_shared<CaptureThread>(reader,
+                CaptureThread::EVERY_FRAME, false));
+            continue;
+        }
+        VideoCapture cap;
+        if (open_video(path, cap)) {
+            sources.push_back(std::make_shared<CaptureThread>(cap,
+                every_frame ? CaptureThread::EVERY_FRAME : CaptureThread::LATEST,
+                !every_frame));
         }
     }
 
@@ -123,14 +511,16 @@ int main(int argc, char** argv )
     /* parse parameters for each algorithm */
     std::vector<std::shared_ptr<FrameAlgorithm>> active_algorithms;
     std::vector<std::string> active_names;
+    std::vector<std::vector<std::string>> active_argv;
     while (true) {
         try {
             if (args["<algorithm>"].isEmpty()) {
                 break;
             }
             std::string name = args["<algorithm>"].asString();
-            active_names.push_back(name);
             active_algorithms.push_back(algs.at(name)());
+            active_names.push_back(name);
+            active_argv.push_back(args["<args>"].asStringList());
         } catch (std::out_of_range e) {
             std::cout << "Algorithm " << args["<algorithm>"] << " not found: "
                       << std::string(e.what()) << std::endl;
@@ -139,55 +529,128 @@ int main(int argc, char** argv )
             parse_arguments(main_args, args["<args>"].asStringList());
     }
 
+    /* a copy of the chain is made for each job of a batch or server */
+    auto make_chain = [&]() {
+        AlgorithmChain chain;
+        for (size_t i = 0; i < active_names.size(); i++) {
+            chain.push_back(algs.at(active_names[i])());
+            chain.back()->parse_arguments(main_args, active_argv[i]);
+        }
+        return chain;
+    };
+
+    if (main_args["--serve"].isString()) {
+        ServeOptions options;
+        options.socket_path = main_args["--serve"].asString();
+        options.jobs = (int)docopt_to_float(main_args, "--jobs", 1);
+        options.client_queue = (int)docopt_to_float(main_args, "--client-queue", 16);
+        options.quiet = main_args["--quiet"].asBool();
+        int status = run_server(options, make_chain, active_names);
+        finish_trace(trace_path);
+        return status;
+    }
+
+    if (!main_args["--batch"].asStringList().empty()) {
+        BatchOptions options;
+        options.inputs = main_args["--batch"].asStringList();
+        options.output_dir = main_args["--output-dir"].asString();
+        options.jobs = (int)docopt_to_float(main_args, "--jobs", 1);
+        options.readers = (int)docopt_to_float(main_args, "--readers", 0);
+        options.max_in_flight = (int)docopt_to_float(main_args, "--max-in-flight", 0);
+        options.quiet = main_args["--quiet"].asBool();
+        long failed = run_batch(options, make_chain, active_names);
+        image_writer().flush();
+        finish_trace(trace_path);
+        return failed == 0 ? 0 : 1;
+    }
+
     std::cout << "Press q or ESC, or type Ctrl-C to exit." << std::endl;
 
     /* run each algorithm in sequence on every image */
+    bool gui = !main_args["--no-gui"].asBool();
     std::vector<cv::Mat> outputs(images.size());
+    ChainInputs inputs(active_algorithms);
     for (int i = 0; i < active_algorithms.size(); i++) {
             for (int j = 0; j < images.size(); j++) {
                 auto prefix = image_names[j] + active_names[i];
-                active_algorithms[i]->
-                    process_frame(images[j], outputs[j], prefix);
-                save_mat(prefix, outputs[j], true, true);
+                {
+                    TRACE_SCOPE(prefix);
+                    active_algorithms[i]->
+                        process_frame(inputs.input(i, images[j]), outputs[j],
+                                      prefix);
+                }
+                save_mat(prefix, outputs[j], true, gui);
             }
         images = outputs;
     }
 
-    /* main loop: read from available cameras and show OpenCV windows */
-    if (!main_args["--no-gui"].asBool()) {
-        std::vector<cv::Mat> outputs(frames.size());
-        long frame_number = 0;
-        while (true) {
-            /* run each algorithm on each frame */
-            for (int i = 0; i < frames.size(); i++) {
-                save_mat("input_" + std::to_string(i), frames[i], true, true);
-                for (int j = 0; j < active_algorithms.size(); j++) {
-                    auto prefix = active_names[j] + "_" + std::to_string(i);
-                    active_algorithms[j]->
-                        process_frame(frames[i], outputs[i], prefix);
-                    save_mat(prefix, outputs[i], true, true);
-
-                    if (j < active_algorithms.size() - 1) {
-                        frames[i] = outputs[i];
-                    } else {
-                        outputs[i] = Mat();
-                    }
-                }
-            }
-
-            /* get new frames */
-            for (int i = 0; i < cameras.size(); i++) {
-                cameras[i] >> frames[i];
+    /* main loop: read from cameras and videos and show OpenCV windows */
+    bool quiet = main_args["--quiet"].asBool();
+    LatencyStats latency;
+    std::unique_ptr<StreamWriter> stream;
+    if (!stream_path.empty() && !sources.empty()) {
+        std::string format = main_args["--output-format"].isString()
+                           ? main_args["--output-format"].asString() : "y4m";
+        if (format != "y4m" && format != "raw") {
+            std::cout << "output format '" << format << "' unknown"
+                      << std::endl;
+            return 1;
+        }
+        stream.reset(new StreamWriter(stream_path,
+            format == "raw" ? STREAM_RAW : STREAM_Y4M,
+            sources[0]->fps()));
+        if (!stream->error().empty()) {
+            std::cout << "Failed to open '" << stream_path << "': "
+                      << stream->error() << std::endl;
+            return 1;
+        }
+    }
+    /* count the buffers allocated for each frame, the allocator outlives
+     * the capture threads that still use it */
+    static CountingAllocator allocator(Mat::getDefaultAllocator());
+    Mat::setDefaultAllocator(&allocator);
+    FrameAllocations allocations(allocator);
+    std::signal(SIGINT, interrupt);
+    if (!sources.empty() && main_args["--pipeline"].asBool()) {
+        run_pipeline(sources, active_algorithms, active_names,
+                     (size_t)docopt_to_float(main_args, "--queue-size", 2),
+                     main_args["--drop-oldest"].asBool(), gui, latency,
+                     allocations, stream.get(), quiet);
+    } else if (!sources.empty()) {
+        std::unique_ptr<DirtyTiles> incremental;
+        if (main_args["--incremental"].asBool()) {
+            incremental.reset(new DirtyTiles(
+                (int)docopt_to_float(main_args, "--tile-size", 32),
+                (int)docopt_to_float(main_args, "--tile-noise", 8)));
+        }
+        std::unique_ptr<BudgetScheduler> budget;
+        if (main_args["--budget-ms"].isString()) {
+            std::vector<int> levels;
+            for (auto& a: active_algorithms) {
+                levels.push_back(a->quality_levels());
             }
-
-            auto key = cv::waitKey(10);
-            if (key == 'q' || key == 'Q' || key == 27) {
-                break;
+            /* showing and saving intermediate images can stop */
+            levels.push_back(1);
+            budget.reset(new BudgetScheduler(
+                docopt_to_float(main_args, "--budget-ms", 33), levels));
+        }
+        run_sequential(sources, active_algorithms, active_names, gui, latency,
+                       allocations, incremental.get(), stream.get(),
+                       budget.get(), quiet);
+    }
+    if (!quiet) {
+        for (int i = 0; i < sources.size(); i++) {
+            if (sources[i]->dropped() > 0) {
+                std::cout << "Skipped " << sources[i]->dropped()
+                          << " stale frames from source " << i << std::endl;
             }
-            frame_number++;
         }
+        latency.print(std::cout);
+        allocations.print(std::cout);
     }
 
-
+    /* wait for the images still being written */
+    image_writer().flush();
+    finish_trace(trace_path);
     return 0;
 }
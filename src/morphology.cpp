@@ -0,0 +1,354 @@
+#include <cstring>
+#include <limits>
+
+#include "morphology.hpp"
+#include "simd.hpp"
+
+MorphologyElement disk_element(int radius)
+{
+    /* the octagon of a square of half size a and diagonals of b pixels
+     * reaches a + 2b along the axes and a + b along both diagonals, and is
+     * regular for a = b sqrt(2). its inner radius is picked so that the
+     * disk is as far inside its corners as it is outside its sides */
+    MorphologyElement element;
+    const double inner = 2 * radius / (1 + 1 / std::cos(CV_PI / 8));
+    int b = cvRound(inner / (2 + std::sqrt(2.0)));
+    int a = cvRound(inner - 2 * b);
+    if (a < 1) {
+        a = std::max(radius, 0);
+        b = 0;
+    }
+    element.rect = Size(2 * a + 1, 2 * a + 1);
+    element.diagonal = b;
+    return element;
+}
+
+/* out[i] = min or max of a[i] and b[i] for n values, out may be a or b */
+template <typename T, bool Max>
+static void extreme(const T* a, const T* b, T* out, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = Max ? std::max(a[i], b[i]) : std::min(a[i], b[i]);
+    }
+}
+
+#ifdef COMPOSER_SSE2
+template <bool Max>
+static void extreme_sse2(const uchar* a, const uchar* b, uchar* out, int n)
+{
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+        _mm_storeu_si128((__m128i*)(out + i),
+                         Max ? _mm_max_epu8(x, y) : _mm_min_epu8(x, y));
+    }
+    extreme<uchar, Max>(a + i, b + i, out + i, n - i);
+}
+
+template <bool Max>
+static void extreme_sse2(const float* a, const float* b, float* out, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(a + i);
+        __m128 y = _mm_loadu_ps(b + i);
+        _mm_storeu_ps(out + i, Max ? _mm_max_ps(x, y) : _mm_min_ps(x, y));
+    }
+    extreme<float, Max>(a + i, b + i, out + i, n - i);
+}
+#endif
+
+#ifdef COMPOSER_AVX2
+template <bool Max>
+TARGET_AVX2 static void extreme_avx2(const uchar* a, const uchar* b,
+                                     uchar* out, int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+        _mm256_storeu_si256((__m256i*)(out + i),
+                            Max ? _mm256_max_epu8(x, y) : _mm256_min_epu8(x, y));
+    }
+    extreme_sse2<Max>(a + i, b + i, out + i, n - i);
+}
+
+template <bool Max>
+TARGET_AVX2 static void extreme_avx2(const float* a, const float* b,
+                                     float* out, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x = _mm256_loadu_ps(a + i);
+        __m256 y = _mm256_loadu_ps(b + i);
+        _mm256_storeu_ps(out + i, Max ? _mm256_max_ps(x, y) : _mm256_min_ps(x, y));
+    }
+    extreme_sse2<Max>(a + i, b + i, out + i, n - i);
+}
+#endif
+
+template <typename T>
+struct Extreme {
+    typedef void (*fn)(const T*, const T*, T*, int);
+};
+
+template <typename T, bool Max>
+static typename Extreme<T>::fn select_extreme()
+{
+#ifdef COMPOSER_AVX2
+    if (cpu_has_avx2()) {
+        return extreme_avx2<Max>;
+    }
+#endif
+#ifdef COMPOSER_SSE2
+    return extreme_sse2<Max>;
+#else
+    return extreme<T, Max>;
+#endif
+}
+
+/* value outside the image, which never wins */
+static Scalar identity(int depth, bool dilate)
+{
+    if (depth == CV_32F) {
+        const double inf = std::numeric_limits<float>::infinity();
+        return Scalar::all(dilate ? -inf : inf);
+    }
+    return Scalar::all(dilate ? 0 : 255);
+}
+
+/* minimum or maximum of windows of size rows down the columns of a
+ * 1-channel image, each starting anchor rows above its pixel
+ *
+ * the column is split into blocks of size rows, starting anchor rows above
+ * the image. a window covers the end of one block and the start of the
+ * next, so it is the extreme of the suffix of the first block and the
+ * prefix of the second. both are running extremes, which are built for a
+ * block at a time. bands of columns are independent and run in parallel */
+template <typename T, bool Max>
+static void running_extreme(const Mat& src, Mat dst, int size, int anchor,
+                            ThreadPool* pool, Workspace* workspace,
+                            const std::string& name)
+{
+    const int n = src.rows;
+    const int width = src.cols;
+    Mat fill = workspace_mat(workspace, name + " identity", Size(width, 1),
+                             src.type());
+    fill.setTo(identity(src.depth(), Max));
+    /* suffixes of a block, then prefixes of the next */
+    Mat blocks = workspace_mat(workspace, name + " blocks",
+                               Size(width, 2 * size), src.type());
+    const typename Extreme<T>::fn op = select_extreme<T, Max>();
+
+    /* bands are whole cache lines wide, so threads do not share them */
+    const int line = 64 / sizeof(T);
+    const int lines = (width + line - 1) / line;
+    const std::vector<int> bounds = split_rows(lines, strip_count(pool, lines));
+    parallel_for(pool, 0, (int)bounds.size() - 1, [&](int b) {
+        const int begin = bounds[b] * line;
+        const int len = std::min(bounds[b + 1] * line, width) - begin;
+        const size_t bytes = len * sizeof(T);
+        auto row = [&](int i) -> const T* {
+            i -= anchor;
+            return (i >= 0 && i < n ? src.ptr<T>(i) : fill.ptr<T>(0)) + begin;
+        };
+        auto suffix = [&](int r) { return blocks.ptr<T>(r) + begin; };
+        auto prefix = [&](int r) { return blocks.ptr<T>(size + r) + begin; };
+
+        for (int start = 0; start < n; start += size) {
+            const int count = std::min(size, n - start);
+            memcpy(suffix(size - 1), row(start + size - 1), bytes);
+            for (int r = size - 2; r >= 0; r--) {
+                op(suffix(r + 1), row(start + r), suffix(r), len);
+            }
+            if (count > 1) {
+                memcpy(prefix(0), row(start + size), bytes);
+            }
+            for (int r = 1; r + 1 < count; r++) {
+                op(prefix(r - 1), row(start + size + r), prefix(r), len);
+            }
+
+            memcpy(dst.ptr<T>(start) + begin, suffix(0), bytes);
+            for (int r = 1; r < count; r++) {
+                op(suffix(r), prefix(r - 1), dst.ptr<T>(start + r) + begin, len);
+            }
+        }
+    });
+}
+
+/* running_extreme over every channel of an image, dst must not be src
+ * dilating takes the element mirrored, which is the same for odd sizes */
+static void column_pass(const Mat& src, const Mat& dst, int size, bool dilate,
+                        ThreadPool* pool, Workspace* workspace,
+                        const std::string& name)
+{
+    const Mat s = src.reshape(1);
+    const Mat d = dst.reshape(1);
+    const int anchor = dilate ? (size - 1) / 2 : size / 2;
+    if (src.depth() == CV_8U) {
+        if (dilate) {
+            running_extreme<uchar, true>(s, d, size, anchor, pool, workspace, name);
+        } else {
+            running_extreme<uchar, false>(s, d, size, anchor, pool, workspace, name);
+        }
+    } else {
+        if (dilate) {
+            running_extreme<float, true>(s, d, size, anchor, pool, workspace, name);
+        } else {
+            running_extreme<float, false>(s, d, size, anchor, pool, workspace, name);
+        }
+    }
+}
+
+/* transpose src into dst, which must have the transposed size, in strips */
+static void transpose_strips(const Mat& src, const Mat& dst, ThreadPool* pool)
+{
+    const std::vector<int> bounds = split_rows(src.rows,
+                                               strip_count(pool, src.rows, 64));
+    parallel_for(pool, 0, (int)bounds.size() - 1, [&](int i) {
+        Mat part = dst.colRange(bounds[i], bounds[i + 1]);
+        transpose(src.rowRange(bounds[i], bounds[i + 1]), part);
+    });
+}
+
+void morphology_rect(const Mat& input, Mat& output, Size size, bool dilate,
+                     ThreadPool* pool, Workspace* workspace)
+{
+    CV_Assert(input.depth() == CV_8U || input.depth() == CV_32F);
+    output.create(input.size(), input.type());
+    if (input.empty()) {
+        return;
+    }
+
+    Mat columns = input;
+    if (size.height > 1) {
+        TRACE_SCOPE("morphology columns");
+        Mat filtered = output;
+        if (size.width > 1 || output.data == input.data) {
+            filtered = workspace_mat(workspace, "columns", input.size(),
+                                     input.type());
+        }
+        column_pass(input, filtered, size.height, dilate, pool, workspace,
+                    "columns");
+        columns = filtered;
+    }
+
+    /* rows are filtered as the columns of the transposed image */
+    if (size.width > 1) {
+        TRACE_SCOPE("morphology rows");
+        const Size transposed(input.rows, input.cols);
+        Mat t = workspace_mat(workspace, "transposed", transposed, input.type());
+        Mat filtered = workspace_mat(workspace, "transposed rows", transposed,
+                                     input.type());
+        transpose_strips(columns, t, pool);
+        column_pass(t, filtered, size.width, dilate, pool, workspace, "rows");
+        transpose_strips(filtered, output, pool);
+    } else if (columns.data != output.data) {
+        columns.copyTo(output);
+    }
+}
+
+/* erode or dilate along a diagonal by a segment of 2 reach + 1 pixels
+ * each row is shifted a pixel further than the one above it, down and to
+ * the right or up and to the right, in an image wide enough for all of
+ * them. the diagonal is then a column, and the pixels around the shifted
+ * rows are left out like those outside the image */
+static void diagonal_pass(const Mat& input, Mat& output, int reach, bool down,
+                          bool dilate, ThreadPool* pool, Workspace* workspace)
+{
+    TRACE_SCOPE("morphology diagonal");
+    const int rows = input.rows;
+    const int cols = input.cols;
+    const std::string name = down ? "diagonal" : "antidiagonal";
+    const Size sheared_size(cols + rows - 1, rows);
+    Mat sheared = workspace_mat(workspace, name, sheared_size, input.type());
+    Mat filtered = workspace_mat(workspace, name + " filtered", sheared_size,
+                                 input.type());
+    const Scalar outside = identity(input.depth(), dilate);
+    auto offset = [&](int y) { return down ? rows - 1 - y : y; };
+
+    const std::vector<int> bounds = split_rows(rows, strip_count(pool, rows, 16));
+    parallel_for(pool, 0, (int)bounds.size() - 1, [&](int i) {
+        for (int y = bounds[i]; y < bounds[i + 1]; y++) {
+            const int x = offset(y);
+            Mat row = sheared.row(y);
+            if (x > 0) {
+                row.colRange(0, x).setTo(outside);
+            }
+            if (x + cols < row.cols) {
+                row.colRange(x + cols, row.cols).setTo(outside);
+            }
+            Mat inside = row.colRange(x, x + cols);
+            input.row(y).copyTo(inside);
+        }
+    });
+
+    column_pass(sheared, filtered, 2 * reach + 1, dilate, pool, workspace, name);
+
+    output.create(input.size(), input.type());
+    parallel_for(pool, 0, (int)bounds.size() - 1, [&](int i) {
+        for (int y = bounds[i]; y < bounds[i + 1]; y++) {
+            const int x = offset(y);
+            Mat dst = output.row(y);
+            filtered.row(y).colRange(x, x + cols).copyTo(dst);
+        }
+    });
+}
+
+/* erode or dilate by each part of the element in turn
+ * the diagonals reach pixels the rectangle found just outside the image,
+ * so with diagonals everything is found on a canvas that much larger */
+static void extreme_pass(const Mat& input, Mat& output,
+                         const MorphologyElement& element, bool dilate,
+                         ThreadPool* pool, Workspace* workspace)
+{
+    if (element.diagonal <= 0 || input.empty()) {
+        morphology_rect(input, output, element.rect, dilate, pool, workspace);
+        return;
+    }
+    const int margin = 2 * element.diagonal;
+    Mat canvas = workspace_mat(workspace, "canvas",
+                               Size(input.cols + 2 * margin,
+                                    input.rows + 2 * margin), input.type());
+    const Scalar outside = identity(input.depth(), dilate);
+    canvas.rowRange(0, margin).setTo(outside);
+    canvas.rowRange(canvas.rows - margin, canvas.rows).setTo(outside);
+    canvas.colRange(0, margin).setTo(outside);
+    canvas.colRange(canvas.cols - margin, canvas.cols).setTo(outside);
+    const Rect image(margin, margin, input.cols, input.rows);
+    Mat inside = canvas(image);
+    input.copyTo(inside);
+
+    morphology_rect(canvas, canvas, element.rect, dilate, pool, workspace);
+    diagonal_pass(canvas, canvas, element.diagonal, true, dilate, pool,
+                  workspace);
+    diagonal_pass(canvas, canvas, element.diagonal, false, dilate, pool,
+                  workspace);
+    output.create(input.size(), input.type());
+    canvas(image).copyTo(output);
+}
+
+void morphology(const Mat& input, Mat& output, int operation,
+                const MorphologyElement& element, ThreadPool* pool,
+                Workspace* workspace)
+{
+    switch (operation) {
+    case MORPHOLOGY_ERODE:
+        extreme_pass(input, output, element, false, pool, workspace);
+        break;
+    case MORPHOLOGY_DILATE:
+        extreme_pass(input, output, element, true, pool, workspace);
+        break;
+    case MORPHOLOGY_OPEN:
+        extreme_pass(input, output, element, false, pool, workspace);
+        extreme_pass(output, output, element, true, pool, workspace);
+        break;
+    case MORPHOLOGY_CLOSE:
+        extreme_pass(input, output, element, true, pool, workspace);
+        extreme_pass(output, output, element, false, pool, workspace);
+        break;
+    default:
+        input.copyTo(output);
+    }
+}
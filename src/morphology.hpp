@@ -0,0 +1,180 @@
+#ifndef _MORPHOLOGY_HPP
+#define _MORPHOLOGY_HPP
+#include "util.hpp"
+#include "thread_pool.hpp"
+using namespace cv;
+
+enum MorphologyOperation {
+    MORPHOLOGY_ERODE,
+    MORPHOLOGY_DILATE,
+    MORPHOLOGY_OPEN,
+    MORPHOLOGY_CLOSE
+};
+
+/* structuring element: a rectangle anchored at its center, followed by a
+ * segment of 2 diagonal + 1 pixels along each diagonal. with both, it is
+ * an octagon */
+struct MorphologyElement {
+    Size rect = Size(3, 3);
+    int diagonal = 0;
+};
+
+/* an octagon close to a disk of the radius, within about 4% of it
+ * small disks are squares */
+MorphologyElement disk_element(int radius);
+
+/* erode or dilate an image by a rectangle anchored at its center, like
+ * erode and dilate with a rectangular element
+ * the minimum or maximum over the rectangle is found with the van Herk and
+ * Gil-Werman algorithm, one pass down the columns and one along the rows,
+ * which takes 3 comparisons per pixel and pass whatever the size. pixels
+ * outside the image are left out. works on 8-bit and 32-bit float images
+ * of 1 to 4 channels, and output may be the input. with a thread pool,
+ * bands of columns are computed in parallel */
+void morphology_rect(const Mat& input, Mat& output, Size size, bool dilate,
+                     ThreadPool* pool=nullptr, Workspace* workspace=nullptr);
+
+/* erode, dilate, open or close an image by an element
+ * eroding by a sum of shapes is eroding by each of them in turn, so the
+ * diagonals take one more pass each, on the image with its rows shifted
+ * so that the diagonals become columns */
+void morphology(const Mat& input, Mat& output, int operation,
+                const MorphologyElement& element, ThreadPool* pool=nullptr,
+                Workspace* workspace=nullptr);
+
+/* settings of MorphologyAlgorithm, the same as its command line options
+ * the element is a disk of the radius, a width by height rectangle when
+ * both are given, or the square of 2 radius + 1 pixels */
+struct MorphologyConfig {
+    int operation = MORPHOLOGY_DILATE;
+    int radius = 1;
+    bool disk = false;
+    int width = 0;
+    int height = 0;
+    int threads = 1;
+};
+
+class MorphologyAlgorithm : public FrameAlgorithm {
+public:
+    int operation = MORPHOLOGY_DILATE;
+    MorphologyElement element;
+    int threads = 1;
+    std::shared_ptr<ThreadPool> pool;
+
+MorphologyAlgorithm(int default_operation=MORPHOLOGY_DILATE) : FrameAlgorithm(
+R"(Usage: morphology [--op=<op>] [--radius=<r>] [--disk | --width=<w> --height=<h>] [--threads=<n>] [--help | -h] [<algorithm> [<args>...]]
+
+Options:
+  -o <op> --op=<op> Operation: erode, dilate, open or close.
+  -r <r> --radius=<r> Square of 2r + 1 pixels, or radius of the disk [default: 1].
+  -d --disk         Approximate a disk with an octagon.
+  --width=<w>       Width of a rectangle instead of a square.
+  --height=<h>      Height of a rectangle instead of a square.
+  -t <n> --threads=<n> Filter bands of columns in parallel [default: 1].
+  -h --help Show this message.
+
+The time per pixel does not depend on the size of the element.
+)"), operation(default_operation)
+    { }
+
+    inline void configure(const MorphologyConfig& config)
+    {
+        operation = config.operation;
+        const int r = std::max(config.radius, 0);
+        element = MorphologyElement();
+        if (config.disk) {
+            element = disk_element(r);
+        } else if (config.width > 0 && config.height > 0) {
+            element.rect = Size(config.width, config.height);
+        } else {
+            element.rect = Size(2 * r + 1, 2 * r + 1);
+        }
+        threads = config.threads;
+        pool.reset();
+        if (threads > 1) {
+            pool = std::make_shared<ThreadPool>(threads - 1);
+        }
+    }
+
+    inline virtual std::map<std::string, docopt::value>
+    parse_arguments(std::map<std::string, docopt::value> m,
+                    std::vector<std::string> a)
+    {
+        FrameAlgorithm::parse_arguments(m, a);
+        MorphologyConfig config;
+        config.operation = operation;
+        if (args["--op"].isString()) {
+            std::string op = args["--op"].asString();
+            if (op == "erode") {
+                config.operation = MORPHOLOGY_ERODE;
+            } else if (op == "dilate") {
+                config.operation = MORPHOLOGY_DILATE;
+            } else if (op == "open") {
+                config.operation = MORPHOLOGY_OPEN;
+            } else if (op == "close") {
+                config.operation = MORPHOLOGY_CLOSE;
+            } else {
+                std::cout << "morphology operation '" << op << "' unknown" << std::endl;
+            }
+        }
+        config.radius = (int)docopt_to_float(args, "--radius", config.radius);
+        config.disk = args["--disk"].asBool();
+        config.width = (int)docopt_to_float(args, "--width", config.width);
+        config.height = (int)docopt_to_float(args, "--height", config.height);
+        config.threads = (int)docopt_to_float(args, "--threads", config.threads);
+        configure(config);
+        return args;
+    }
+
+    inline virtual void process_frame(const Mat& in, Mat& out, std::string prefix="") override
+    {
+        TRACE_SCOPE("morphology");
+        morphology(in, out, operation, element, pool.get(), &workspace);
+    }
+
+    /* every channel is filtered, so gray frames are the cheapest. edges
+     * and gradients are closed as floats without converting them */
+    inline virtual std::vector<PixelFormat> input_formats() override
+    {
+        return {PIXELS_GRAY8, PIXELS_BGR8, PIXELS_GRAY32F};
+    }
+
+    /* an opening or closing reaches twice as far as the element */
+    inline virtual int halo() override
+    {
+        const int reach = std::max(element.rect.width / 2,
+                                   element.rect.height / 2)
+                        + 2 * element.diagonal;
+        const bool twice = operation == MORPHOLOGY_OPEN
+                        || operation == MORPHOLOGY_CLOSE;
+        return twice ? 2 * reach : reach;
+    }
+
+    /* filter each dirty rectangle with the pixels around it, and keep the
+     * part of the result that does not depend on the borders
+     * the rectangles are filtered in parallel, so each worker keeps its own
+     * buffers, which only allocate for a size it has not filtered last */
+    inline virtual bool process_dirty(const Mat& in, Mat& out,
+                                      const std::vector<Rect>& dirty,
+                                      std::string prefix="") override
+    {
+        const int h = halo();
+        const Rect frame(Point(0, 0), in.size());
+        parallel_for(pool.get(), 0, (int)dirty.size(), [&](int i) {
+            static thread_local Mat filtered_buffer;
+            static thread_local Workspace rect_workspace;
+            const Rect r = dirty[i];
+            const Rect grown = Rect(r.x - h, r.y - h, r.width + 2 * h,
+                                    r.height + 2 * h) & frame;
+            Mat filtered = buffer_view(filtered_buffer, grown.size(), in.type());
+            morphology(in(grown), filtered, operation, element, nullptr,
+                       &rect_workspace);
+            Mat dst = out(r);
+            filtered(Rect(r.x - grown.x, r.y - grown.y, r.width, r.height))
+                .copyTo(dst);
+        });
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef _PIPELINE_HPP
+#define _PIPELINE_HPP
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "bounded_queue.hpp"
+#include "util.hpp"
+
+/* a frame moving through the pipeline
+ * source is the index of the camera it was read from, and timestamp the
+ * getTickCount() when it was captured */
+struct Frame {
+    long frame_number = 0;
+    int source = 0;
+    int64 timestamp = 0;
+    cv::Mat image;
+};
+
+/* output buffers of a stage, handed on to the next stages
+ * next is a buffer no frame refers to anymore, so after the first frames
+ * the stage writes its results without allocating */
+class OutputRing {
+public:
+    cv::Mat& next()
+    {
+        for (auto& m: buffers) {
+            if (unshared(m)) {
+                return m;
+            }
+        }
+        buffers.emplace_back();
+        return buffers.back();
+    }
+
+private:
+    /* references stay valid as it grows */
+    std::deque<cv::Mat> buffers;
+};
+
+/* runs a chain of algorithms with one worker thread per algorithm
+ *
+ * frames pushed to the pipeline pass through a queue before each stage, and
+ * the results of the last stage wait in a queue for pop. so every stage
+ * works on a different frame at once, and the chain keeps up with its
+ * slowest stage rather than the sum of all stages. intermediate windows
+ * are shown through save_mat, which defers them to the main thread */
+class Pipeline {
+public:
+    Pipeline(const std::vector<std::shared_ptr<FrameAlgorithm>>& algorithms,
+             const std::vector<std::string>& names, size_t capacity,
+             BoundedQueue<Frame>::Policy policy, bool gui=true)
+        : inputs(algorithms)
+    {
+        for (size_t i = 0; i <= algorithms.size(); i++) {
+            queues.emplace_back(new BoundedQueue<Frame>(capacity, policy));
+        }
+        for (size_t i = 0; i < algorithms.size(); i++) {
+            auto algorithm = algorithms[i];
+            auto name = names[i];
+            auto in = queues[i].get();
+            auto out = queues[i + 1].get();
+            workers.push_back(std::thread([this, i, algorithm, name, in, out, gui]() {
+                trace_thread_name(name);
+                Frame frame;
+                OutputRing outputs;
+                while (in->pop(frame)) {
+                    auto prefix = name + "_" + std::to_string(frame.source);
+                    cv::Mat& output = outputs.next();
+                    try {
+                        TRACE_SCOPE(prefix);
+                        algorithm->process_frame(inputs.input(i, frame.image),
+                                                 output, prefix);
+                    } catch (std::exception& e) {
+                        std::cout << name << " failed on frame "
+                                  << frame.frame_number << ": " << e.what()
+                                  << std::endl;
+                        failed++;
+                        continue;
+                    }
+                    save_mat(prefix, output, gui, true);
+                    frame.image = output;
+                    out->push(std::move(frame));
+                }
+            }));
+        }
+    }
+
+    ~Pipeline()
+    {
+        stop();
+    }
+
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    /* true when push would wait for the first stage to catch up */
+    bool full()
+    {
+        return queues.front()->full();
+    }
+
+    /* queue a frame for the first stage without waiting
+     * fails when the pipeline is full, so the caller can skip the frame */
+    bool push(Frame frame)
+    {
+        bool ok = queues.front()->try_push(std::move(frame));
+        pushed += ok;
+        return ok;
+    }
+
+    /* take a finished frame if there is one */
+    bool pop(Frame& frame)
+    {
+        bool ok = queues.back()->try_pop(frame);
+        popped += ok;
+        return ok;
+    }
+
+    /* frames pushed that have not come out, been dropped or failed yet */
+    long in_flight()
+    {
+        return pushed - popped - dropped() - failed;
+    }
+
+    /* close every queue, discarding frames in flight, and wait for the
+     * stages to finish their current frame */
+    void stop()
+    {
+        for (auto& q: queues) {
+            q->close();
+        }
+        for (auto& w: workers) {
+            w.join();
+        }
+        workers.clear();
+    }
+
+    /* frames dropped by every queue */
+    long dropped()
+    {
+        long count = 0;
+        for (auto& q: queues) {
+            count += q->dropped();
+        }
+        return count;
+    }
+
+private:
+    /* each stage converts its own input, so they share nothing */
+    ChainInputs inputs;
+    std::vector<std::unique_ptr<BoundedQueue<Frame>>> queues;
+    std::vector<std::thread> workers;
+    long pushed = 0;
+    long popped = 0;
+    std::atomic<long> failed{0};
+};
+
+#endif
@@ -0,0 +1,711 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.hpp"
+
+size_t buffer_bytes(int width, int height, PixelFormat format)
+{
+    return (size_t)std::max(width, 0) * std::max(height, 0)
+         * CV_ELEM_SIZE(pixel_type(format));
+}
+
+int shared_memory(size_t size)
+{
+#if defined(MFD_CLOEXEC) && defined(F_ADD_SEALS)
+    int fd = memfd_create("composer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd >= 0 && (ftruncate(fd, (off_t)size) != 0
+                 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+static bool socket_address(const std::string& path, sockaddr_un& address)
+{
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return true;
+}
+
+int serve_connect(const std::string& path)
+{
+    sockaddr_un address;
+    if (!socket_address(path, address)) {
+        return -1;
+    }
+    int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s >= 0 && connect(s, (sockaddr*)&address, sizeof(address)) != 0) {
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/* write or read all of a message, which a stream socket may split */
+static bool send_all(int socket, const void* data, size_t n)
+{
+    const char* p = (const char*)data;
+    while (n > 0) {
+        ssize_t done = send(socket, p, n, MSG_NOSIGNAL);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return false;
+        }
+        p += done;
+        n -= (size_t)done;
+    }
+    return true;
+}
+
+static bool receive_all(int socket, void* data, size_t n)
+{
+    char* p = (char*)data;
+    while (n > 0) {
+        ssize_t done = recv(socket, p, n, 0);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return false;
+        }
+        p += done;
+        n -= (size_t)done;
+    }
+    return true;
+}
+
+bool serve_send(int socket, const ServeRequest& request, int fd)
+{
+    if (fd < 0) {
+        return send_all(socket, &request, sizeof(request));
+    }
+    /* the descriptor goes with the first byte of the request */
+    iovec iov;
+    iov.iov_base = (void*)&request;
+    iov.iov_len = sizeof(request);
+    char control[CMSG_SPACE(sizeof(int))];
+    std::memset(control, 0, sizeof(control));
+    msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+    ssize_t done;
+    do {
+        done = sendmsg(socket, &message, MSG_NOSIGNAL);
+    } while (done < 0 && errno == EINTR);
+    if (done <= 0) {
+        return false;
+    }
+    return send_all(socket, (const char*)&request + done,
+                    sizeof(request) - (size_t)done);
+}
+
+bool serve_receive(int socket, ServeReply& reply)
+{
+    return receive_all(socket, &reply, sizeof(reply))
+        && reply.magic == SERVE_MAGIC;
+}
+
+/* shared memory of a client, mapped once for all of its frames
+ * it must be sealed against shrinking, otherwise the client could cut the
+ * pages of a frame away while it is processed, and the server would die of
+ * SIGBUS. the mapping goes once no job holds it */
+struct SharedMemory {
+    ~SharedMemory()
+    {
+        munmap(data, size);
+    }
+
+    void* data = nullptr;
+    size_t size = 0;
+    dev_t device = 0;
+    ino_t inode = 0;
+};
+
+/* whether fd is the memory that is already mapped */
+static bool same_memory(int fd, const std::shared_ptr<SharedMemory>& memory)
+{
+    struct stat st;
+    return memory != nullptr && fstat(fd, &st) == 0
+        && st.st_dev == memory->device && st.st_ino == memory->inode;
+}
+
+/* map the memory of a descriptor, null with an error if it is not sealed */
+static std::shared_ptr<SharedMemory> map_memory(int fd, std::string& error)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        error = std::string("can't read the shared memory: ") + std::strerror(errno);
+        return nullptr;
+    }
+#ifdef F_GET_SEALS
+    const int seals = fcntl(fd, F_GET_SEALS);
+    const bool sealed = seals >= 0 && (seals & F_SEAL_SHRINK);
+#else
+    const bool sealed = false;
+#endif
+    if (!sealed) {
+        error = "the shared memory must be a memfd sealed with F_SEAL_SHRINK";
+        return nullptr;
+    }
+    void* data = st.st_size == 0 ? MAP_FAILED
+               : mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        error = std::string("can't map the shared memory: ") + std::strerror(errno);
+        return nullptr;
+    }
+    auto memory = std::make_shared<SharedMemory>();
+    memory->data = data;
+    memory->size = (size_t)st.st_size;
+    memory->device = st.st_dev;
+    memory->inode = st.st_ino;
+    return memory;
+}
+
+/* a connected client, with its own queue of waiting frames
+ *
+ * the socket never blocks. requests are read into a buffer as they arrive,
+ * and replies are queued and sent as the socket takes them, so a client
+ * that is slow to send or to read only holds up itself. the socket is
+ * closed once neither the server nor a job holds it */
+struct ServeClient {
+    ServeClient(int socket, int wake) : socket(socket), wake(wake) {}
+    ~ServeClient()
+    {
+        for (auto& d: descriptors) {
+            close(d.second);
+        }
+        close(socket);
+    }
+
+    struct Job {
+        ServeRequest request;
+        std::shared_ptr<SharedMemory> memory;
+        int64 received;
+    };
+
+    /* queue a reply and send what the socket takes now, the server is
+     * woken to send the rest once there is room. replies of the workers
+     * and the server never interleave */
+    void reply(const ServeReply& r)
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        output.append((const char*)&r, sizeof(r));
+        if (send_output() && !output.empty()) {
+            char c = 0;
+            ssize_t ignored = write(wake, &c, 1);
+            (void)ignored;
+        }
+    }
+
+    /* send queued replies until the socket is full, false once it broke */
+    bool flush()
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        return send_output();
+    }
+
+    /* bytes of replies waiting to be sent */
+    size_t waiting_output()
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        return output.size();
+    }
+
+    /* read what has arrived, false once the client is gone
+     * a descriptor comes with the first byte of a request, and a read never
+     * goes past data that came with another one, so it belongs to the
+     * request at the start of the read */
+    bool receive()
+    {
+        char data[16 * sizeof(ServeRequest)];
+        iovec iov;
+        iov.iov_base = data;
+        iov.iov_len = sizeof(data);
+        char control[CMSG_SPACE(4 * sizeof(int))];
+        msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t done = recvmsg(socket, &message, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+        if (done < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        for (cmsghdr* h = CMSG_FIRSTHDR(&message); h != nullptr;
+             h = CMSG_NXTHDR(&message, h)) {
+            if (h->cmsg_level != SOL_SOCKET || h->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            const size_t count = (h->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < count; i++) {
+                int fd;
+                std::memcpy(&fd, CMSG_DATA(h) + i * sizeof(int), sizeof(int));
+                if (i == 0) {
+                    descriptors.push_back({received + input.size(), fd});
+                } else {
+                    close(fd);
+                }
+            }
+        }
+        input.append(data, (size_t)done);
+        return done > 0;
+    }
+
+    /* the next whole request read, with the descriptor that came with it
+     * or -1. false when there is none yet */
+    bool next_request(ServeRequest& request, int& fd)
+    {
+        fd = -1;
+        if (input.size() < sizeof(request)) {
+            return false;
+        }
+        std::memcpy(&request, input.data(), sizeof(request));
+        input.erase(0, sizeof(request));
+        received += sizeof(request);
+        while (!descriptors.empty() && descriptors.front().first < received) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            fd = descriptors.front().second;
+            descriptors.pop_front();
+        }
+        return true;
+    }
+
+    int socket;
+    std::deque<Job> queue;
+    /* the memory frames came in last, used until another is passed */
+    std::shared_ptr<SharedMemory> memory;
+
+private:
+    bool send_output()
+    {
+        while (!broken && !output.empty()) {
+            ssize_t done = send(socket, output.data(), output.size(),
+                                MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (done < 0 && errno == EINTR) {
+                continue;
+            }
+            if (done < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (done <= 0) {
+                broken = true;
+                output.clear();
+                break;
+            }
+            output.erase(0, (size_t)done);
+        }
+        return !broken;
+    }
+
+    int wake;
+    std::mutex write_mutex;
+    std::string output;
+    bool broken = false;
+    /* requests read so far, from offset received of the stream, and the
+     * descriptors that came with them by offset */
+    std::string input;
+    uint64_t received = 0;
+    std::deque<std::pair<uint64_t, int>> descriptors;
+};
+
+/* latencies of the most recent frames, from receiving them to replying */
+class LatencyWindow {
+public:
+    void add(double ms)
+    {
+        if (samples.size() < capacity) {
+            samples.push_back(ms);
+        } else {
+            samples[next] = ms;
+        }
+        next = (next + 1) % capacity;
+    }
+
+    /* the latency a fraction p of the frames were faster than */
+    double percentile(double p) const
+    {
+        if (samples.empty()) {
+            return 0;
+        }
+        std::vector<double> sorted = samples;
+        size_t k = std::min((size_t)(p * sorted.size()), sorted.size() - 1);
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        return sorted[k];
+    }
+
+private:
+    static const size_t capacity = 4096;
+    std::vector<double> samples;
+    size_t next = 0;
+};
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+static void interrupt(int)
+{
+    interrupted = 1;
+}
+
+/* check the buffers of a request fit in the shared memory */
+static bool request_fits(const ServeRequest& r, size_t size, std::string& error)
+{
+    if (r.width <= 0 || r.height <= 0
+    ||  r.in_format > PIXELS_LABELS32S || r.out_format > PIXELS_LABELS32S) {
+        error = "invalid frame size or format";
+        return false;
+    }
+    const PixelFormat formats[] = {(PixelFormat)r.in_format,
+                                   (PixelFormat)r.out_format};
+    const uint64_t offsets[] = {r.in_offset, r.out_offset};
+    const uint64_t strides[] = {r.in_stride, r.out_stride};
+    for (int i = 0; i < 2; i++) {
+        uint64_t row = buffer_bytes(r.width, 1, formats[i]);
+        uint64_t stride = strides[i] > 0 ? strides[i] : row;
+        if (stride < row || stride % CV_ELEM_SIZE1(pixel_type(formats[i]))
+        ||  offsets[i] > size || size - offsets[i] < row
+        ||  (size - offsets[i] - row) / stride < (uint64_t)r.height - 1) {
+            error = "the frame does not fit in the shared memory";
+            return false;
+        }
+    }
+    return true;
+}
+
+/* run the chain on the frame of a job, in the shared memory it came with */
+static void process_job(Composer& composer, const ServeClient::Job& job,
+                        ServeReply& reply)
+{
+    const ServeRequest& r = job.request;
+    std::string error;
+    if (request_fits(r, job.memory->size, error)) {
+        uchar* data = (uchar*)job.memory->data;
+        PixelBuffer in, out;
+        in.data = data + r.in_offset;
+        in.width = out.width = r.width;
+        in.height = out.height = r.height;
+        in.stride = r.in_stride;
+        in.format = (PixelFormat)r.in_format;
+        out.data = data + r.out_offset;
+        out.stride = r.out_stride;
+        out.format = (PixelFormat)r.out_format;
+        try {
+            if (!composer.process(in, out)) {
+                error = composer.error();
+            }
+        } catch (std::exception& e) {
+            error = e.what();
+        }
+    }
+    reply.status = error.empty() ? SERVE_OK : SERVE_FAILED;
+    std::strncpy(reply.message, error.c_str(), sizeof(reply.message) - 1);
+}
+
+int run_server(const ServeOptions& options,
+               const std::function<AlgorithmChain()>& make_chain,
+               const std::vector<std::string>& names)
+{
+    sockaddr_un address;
+    if (!socket_address(options.socket_path, address)) {
+        std::cout << "Socket path '" << options.socket_path << "' is too long"
+                  << std::endl;
+        return 1;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(options.socket_path.c_str());
+    if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0
+    ||  listen(listener, 64) != 0) {
+        std::cout << "Can't listen on '" << options.socket_path << "': "
+                  << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    std::string chain_name;
+    for (auto& n: names) {
+        chain_name += (chain_name.empty() ? "" : ",") + n;
+    }
+
+    /* chains are made up front, parsing arguments is not thread safe */
+    const int jobs = std::max(options.jobs, 1);
+    std::vector<std::unique_ptr<Composer>> composers;
+    for (int j = 0; j < jobs; j++) {
+        composers.emplace_back(new Composer(make_chain()));
+    }
+
+    std::mutex mutex;
+    std::condition_variable waiting;
+    /* clients with waiting frames, each once, taken in turn */
+    std::deque<std::shared_ptr<ServeClient>> ready;
+    long queued = 0;
+    long processed = 0;
+    long failed = 0;
+    long rejected = 0;
+    LatencyWindow latency;
+    bool stopping = false;
+
+    /* workers wake the poll loop when a reply has to wait for room */
+    int wake[2];
+    if (pipe2(wake, O_CLOEXEC | O_NONBLOCK) != 0) {
+        std::cout << "Can't create a pipe: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    std::signal(SIGINT, interrupt);
+    std::signal(SIGTERM, interrupt);
+    if (!options.quiet) {
+        std::cout << "Serving " << chain_name << " on '" << options.socket_path
+                  << "' with " << jobs << " jobs" << std::endl;
+    }
+
+    std::vector<std::thread> workers;
+    for (int j = 0; j < jobs; j++) {
+        workers.push_back(std::thread([&, j]() {
+            while (true) {
+                std::shared_ptr<ServeClient> client;
+                ServeClient::Job job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    waiting.wait(lock, [&]() { return stopping || !ready.empty(); });
+                    if (stopping) {
+                        return;
+                    }
+                    client = ready.front();
+                    ready.pop_front();
+                    job = client->queue.front();
+                    client->queue.pop_front();
+                    queued--;
+                    if (!client->queue.empty()) {
+                        ready.push_back(client);
+                    }
+                }
+
+                ServeReply reply;
+                reply.id = job.request.id;
+                {
+                    TRACE_SCOPE(chain_name);
+                    process_job(*composers[j], job, reply);
+                }
+                job.memory.reset();
+                client->reply(reply);
+
+                double ms = (cv::getTickCount() - job.received) * 1000.0
+                          / cv::getTickFrequency();
+                std::lock_guard<std::mutex> lock(mutex);
+                latency.add(ms);
+                processed++;
+                failed += reply.status != SERVE_OK;
+            }
+        }));
+    }
+
+    /* answer a request from a client, frames are queued for the workers */
+    auto handle = [&](const std::shared_ptr<ServeClient>& client,
+                      const ServeRequest& request, int fd,
+                      size_t client_count) {
+        ServeReply reply;
+        reply.id = request.id;
+        if (request.type == SERVE_STATS) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            std::ostringstream stats;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stats << chain_name << ": clients " << client_count
+                      << ", queued " << queued << ", processed "
+                      << processed << ", failed " << failed
+                      << ", rejected " << rejected << ", p50 "
+                      << latency.percentile(0.5) << " ms, p99 "
+                      << latency.percentile(0.99) << " ms";
+            }
+            std::strncpy(reply.message, stats.str().c_str(),
+                         sizeof(reply.message) - 1);
+            client->reply(reply);
+            return;
+        }
+
+        /* a new memory is checked and mapped once, later frames in it
+         * may come without the descriptor */
+        std::string error;
+        if (fd >= 0) {
+            if (!same_memory(fd, client->memory)) {
+                std::shared_ptr<SharedMemory> memory = map_memory(fd, error);
+                if (memory != nullptr) {
+                    client->memory = memory;
+                }
+            }
+            close(fd);
+        } else if (client->memory == nullptr) {
+            error = "no shared memory with the frame";
+        }
+        if (!error.empty()) {
+            reply.status = SERVE_FAILED;
+            std::strncpy(reply.message, error.c_str(), sizeof(reply.message) - 1);
+            client->reply(reply);
+            std::lock_guard<std::mutex> lock(mutex);
+            failed++;
+            return;
+        }
+
+        bool busy;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            busy = client->queue.size() >= (size_t)std::max(options.client_queue, 1);
+            if (busy) {
+                rejected++;
+            } else {
+                if (client->queue.empty()) {
+                    ready.push_back(client);
+                }
+                client->queue.push_back({request, client->memory,
+                                         cv::getTickCount()});
+                queued++;
+            }
+        }
+        if (busy) {
+            reply.status = SERVE_BUSY;
+            std::strncpy(reply.message, "too many frames waiting",
+                         sizeof(reply.message) - 1);
+            client->reply(reply);
+        } else {
+            waiting.notify_one();
+        }
+    };
+
+    /* the sockets are watched here, workers only queue replies. a client
+     * with many replies it has not read yet is not read from until it
+     * catches up */
+    const size_t max_output = 256 * sizeof(ServeReply);
+    std::map<int, std::shared_ptr<ServeClient>> clients;
+    while (!interrupted) {
+        std::vector<pollfd> fds(2);
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        fds[1].fd = wake[0];
+        fds[1].events = POLLIN;
+        for (auto& c: clients) {
+            const size_t output = c.second->waiting_output();
+            pollfd p;
+            p.fd = c.first;
+            p.events = (output < max_output ? POLLIN : 0)
+                     | (output > 0 ? POLLOUT : 0);
+            p.revents = 0;
+            fds.push_back(p);
+        }
+        if (poll(fds.data(), fds.size(), 200) <= 0) {
+            continue;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int s = accept4(listener, nullptr, nullptr,
+                            SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (s >= 0) {
+                clients[s] = std::make_shared<ServeClient>(s, wake[1]);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wake[0], drain, sizeof(drain)) > 0) {
+            }
+        }
+        for (size_t i = 2; i < fds.size(); i++) {
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            std::shared_ptr<ServeClient> client = clients[fds[i].fd];
+            bool alive = !(fds[i].revents & POLLNVAL);
+            if (alive && (fds[i].revents & POLLOUT)) {
+                alive = client->flush();
+            }
+            if (alive && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                alive = client->receive();
+                ServeRequest request;
+                int fd;
+                while (client->next_request(request, fd)) {
+                    if (request.magic != SERVE_MAGIC) {
+                        if (fd >= 0) {
+                            close(fd);
+                        }
+                        alive = false;
+                        break;
+                    }
+                    handle(client, request, fd, clients.size());
+                }
+            }
+            if (alive && client->flush()) {
+                continue;
+            }
+
+            /* gone, waiting frames are dropped and running ones finish */
+            std::lock_guard<std::mutex> lock(mutex);
+            queued -= client->queue.size();
+            client->queue.clear();
+            ready.erase(std::remove(ready.begin(), ready.end(), client),
+                        ready.end());
+            clients.erase(fds[i].fd);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    waiting.notify_all();
+    for (auto& w: workers) {
+        w.join();
+    }
+    clients.clear();
+    ready.clear();
+    close(listener);
+    close(wake[0]);
+    close(wake[1]);
+    unlink(options.socket_path.c_str());
+    if (!options.quiet) {
+        std::cout << "Processed " << processed << " frames, " << failed
+                  << " failed and " << rejected << " rejected, p50 "
+                  << latency.percentile(0.5) << " ms, p99 "
+                  << latency.percentile(0.99) << " ms" << std::endl;
+    }
+    return 0;
+}
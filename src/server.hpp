@@ -0,0 +1,92 @@
+#ifndef _SERVER_HPP
+#define _SERVER_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "batch.hpp"
+#include "composer.hpp"
+
+/* messages between composer --serve and its clients, over a unix stream
+ * socket on the same machine
+ *
+ * a client sends requests and the server answers each with a reply of the
+ * same id, not necessarily in order. a frame request comes with the file
+ * descriptor of shared memory, a memfd sealed with F_SEAL_SHRINK, passed
+ * with SCM_RIGHTS. the input is read from in_offset in it and the output
+ * written to out_offset, so frames are never encoded or copied through the
+ * socket. the server maps the memory once, and frames without a descriptor
+ * use the memory of the last one that came with one.
+ * a stats request is answered with a line of statistics in the message */
+const uint32_t SERVE_MAGIC = 0x43505352;
+
+enum ServeRequestType {
+    SERVE_FRAME,
+    SERVE_STATS
+};
+
+enum ServeStatus {
+    SERVE_OK,
+    SERVE_FAILED,
+    /* the client already has the most frames waiting it may have */
+    SERVE_BUSY
+};
+
+struct ServeRequest {
+    uint32_t magic = SERVE_MAGIC;
+    uint32_t type = SERVE_FRAME;
+    uint64_t id = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+    uint32_t in_format = PIXELS_BGR8;
+    uint32_t out_format = PIXELS_BGR8;
+    uint64_t in_offset = 0;
+    uint64_t in_stride = 0;
+    uint64_t out_offset = 0;
+    uint64_t out_stride = 0;
+};
+
+struct ServeReply {
+    uint32_t magic = SERVE_MAGIC;
+    uint32_t status = SERVE_OK;
+    uint64_t id = 0;
+    char message[1024] = {};
+};
+
+/* bytes of a buffer of the format with packed rows */
+size_t buffer_bytes(int width, int height, PixelFormat format);
+
+/* shared memory of the given size to pass frames in, sealed so it can't
+ * shrink, -1 on failure */
+int shared_memory(size_t size);
+
+/* connect to the socket of a server, -1 on failure */
+int serve_connect(const std::string& path);
+
+/* send a request, passing fd along unless it is -1 */
+bool serve_send(int socket, const ServeRequest& request, int fd=-1);
+
+/* wait for the next reply */
+bool serve_receive(int socket, ServeReply& reply);
+
+/* settings of the server
+ * jobs is the number of frames processed at once, each by its own warm
+ * copy of the chain. client_queue caps the frames a client may have
+ * waiting, more are answered SERVE_BUSY */
+struct ServeOptions {
+    std::string socket_path;
+    int jobs = 1;
+    int client_queue = 16;
+    bool quiet = false;
+};
+
+/* serve frames with a chain of algorithms until interrupted
+ * waiting frames are taken from the clients in turn, so one busy client
+ * can't starve the others. returns the exit status */
+int run_server(const ServeOptions& options,
+               const std::function<AlgorithmChain()>& make_chain,
+               const std::vector<std::string>& names);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _SIMD_HPP
+#define _SIMD_HPP
+
+#include <opencv2/opencv.hpp>
+
+/* vector extensions used by the hot loops
+ *
+ * SSE2 is part of the x86-64 baseline, so it is always compiled in on x86.
+ * AVX2 kernels are compiled with a per-function target attribute and only
+ * called when the CPU reports support for it.
+ * every kernel also has a plain scalar version for other architectures */
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__)
+#define COMPOSER_SSE2 1
+#include <immintrin.h>
+#endif
+
+#if defined(COMPOSER_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define COMPOSER_AVX2 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+inline bool cpu_has_avx2()
+{
+#ifdef COMPOSER_AVX2
+    static const bool avx2 = cv::checkHardwareSupport(CV_CPU_AVX2);
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+#endif
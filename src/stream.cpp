@@ -0,0 +1,381 @@
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "stream.hpp"
+#include "util.hpp"
+
+/* read exactly n bytes, false at the end of the stream or on an error */
+static bool read_fully(int fd, uchar* data, size_t n)
+{
+    while (n > 0) {
+        ssize_t got = ::read(fd, data, n);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        n -= (size_t)got;
+    }
+    return true;
+}
+
+StreamReader::StreamReader(const std::string& path, StreamFormat format,
+                           cv::Size raw_size, int raw_type)
+    : format(format)
+{
+    if (path == "-") {
+        fd = STDIN_FILENO;
+    } else {
+        fd = ::open(path.c_str(), O_RDONLY);
+        close_fd = true;
+    }
+    if (fd < 0) {
+        failure = std::strerror(errno);
+        return;
+    }
+
+    /* files are mapped, pipes and devices are read */
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                       fd, 0);
+        if (p != MAP_FAILED) {
+            map = (const uchar*)p;
+            map_size = (size_t)st.st_size;
+            madvise(p, map_size, MADV_SEQUENTIAL);
+        }
+    }
+
+    if (format == STREAM_Y4M) {
+        read_header();
+        return;
+    }
+    size = raw_size;
+    pixels = raw_type == CV_8UC1 ? GRAY : BGR;
+    frame_bytes = (size_t)size.area() * (pixels == GRAY ? 1 : 3);
+    if (size.area() <= 0) {
+        failure = "raw streams need a frame size";
+    }
+}
+
+StreamReader::~StreamReader()
+{
+    if (map != nullptr) {
+        munmap((void*)map, map_size);
+    }
+    if (close_fd && fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool StreamReader::read_line(std::string& line)
+{
+    line.clear();
+    uchar c;
+    while (line.size() < 4096) {
+        const uchar* p = next_bytes(1, &c);
+        if (p == nullptr) {
+            return false;
+        }
+        if (*p == '\n') {
+            return true;
+        }
+        line += (char)*p;
+    }
+    return false;
+}
+
+/* the header is "YUV4MPEG2" followed by tagged parameters, such as
+ * "W640 H480 F30000:1001 C420jpeg XCOLORRANGE=FULL". the colour space
+ * defaults to 4:2:0. without XCOLORRANGE, YCbCr is limited range like
+ * video, and mono is full range like ffmpeg's gray */
+bool StreamReader::read_header()
+{
+    std::string line;
+    if (!read_line(line) || line.compare(0, 9, "YUV4MPEG2") != 0) {
+        failure = "not a YUV4MPEG2 stream";
+        return false;
+    }
+    std::istringstream tags(line.substr(9));
+    std::string tag;
+    std::string colour = "420";
+    std::string range;
+    while (tags >> tag) {
+        if (tag[0] == 'W') {
+            size.width = std::atoi(tag.c_str() + 1);
+        } else if (tag[0] == 'H') {
+            size.height = std::atoi(tag.c_str() + 1);
+        } else if (tag[0] == 'F') {
+            int num = 0, den = 0;
+            if (std::sscanf(tag.c_str() + 1, "%d:%d", &num, &den) == 2 && den > 0) {
+                frame_rate = (double)num / den;
+            }
+        } else if (tag[0] == 'C') {
+            colour = tag.substr(1);
+        } else if (tag.compare(0, 12, "XCOLORRANGE=") == 0) {
+            range = tag.substr(12);
+        }
+    }
+
+    const size_t area = (size_t)std::max(size.area(), 0);
+    if (colour.compare(0, 4, "mono") == 0) {
+        pixels = GRAY;
+        frame_bytes = area;
+        full_range = true;
+    } else if (colour.compare(0, 3, "444") == 0 && colour.find("alpha") == std::string::npos) {
+        pixels = YUV444;
+        frame_bytes = area * 3;
+    } else if (colour.compare(0, 3, "420") == 0) {
+        pixels = YUV420;
+        frame_bytes = area * 3 / 2;
+        if (size.width % 2 || size.height % 2) {
+            failure = "4:2:0 frames must have an even width and height";
+            return false;
+        }
+    } else {
+        failure = "colour space '" + colour + "' is not supported";
+        return false;
+    }
+    if (area == 0) {
+        failure = "no frame size in the header";
+        return false;
+    }
+    if (range == "FULL") {
+        full_range = true;
+    } else if (range == "LIMITED") {
+        full_range = false;
+    } else if (!range.empty()) {
+        failure = "colour range '" + range + "' is not supported";
+        return false;
+    }
+    return true;
+}
+
+const uchar* StreamReader::next_bytes(size_t n, uchar* buffer)
+{
+    if (map != nullptr) {
+        if (map_size - offset < n) {
+            return nullptr;
+        }
+        const uchar* p = map + offset;
+        offset += n;
+        return p;
+    }
+    return read_fully(fd, buffer, n) ? buffer : nullptr;
+}
+
+bool StreamReader::read(cv::Mat& image, int64& timestamp)
+{
+    if (!failure.empty()) {
+        return false;
+    }
+    if (format == STREAM_Y4M) {
+        /* each frame starts with "FRAME", perhaps with parameters */
+        std::string line;
+        if (!read_line(line) || line.compare(0, 5, "FRAME") != 0) {
+            return false;
+        }
+    }
+
+    if (pixels == BGR) {
+        if (map != nullptr) {
+            /* the mapping is never written, so the frame can point into it */
+            const uchar* p = next_bytes(frame_bytes, nullptr);
+            timestamp = cv::getTickCount();
+            if (p == nullptr) {
+                return false;
+            }
+            image = cv::Mat(size, CV_8UC3, (void*)p);
+            return true;
+        }
+        image.create(size, CV_8UC3);
+        bool ok = next_bytes(frame_bytes, image.data) != nullptr;
+        timestamp = cv::getTickCount();
+        return ok;
+    }
+
+    /* planes are converted to BGR in the frame's buffer */
+    const int rows = pixels == YUV420 ? size.height * 3 / 2
+                   : pixels == YUV444 ? size.height * 3 : size.height;
+    planes.create(rows, size.width, CV_8UC1);
+    const uchar* p = next_bytes(frame_bytes, planes.data);
+    timestamp = cv::getTickCount();
+    if (p == nullptr) {
+        return false;
+    }
+    cv::Mat in(rows, size.width, CV_8UC1, (void*)p);
+    const int h = size.height;
+    if (pixels == YUV420 && !full_range) {
+        cv::cvtColor(in, image, CV_YUV2BGR_I420);
+        return true;
+    }
+    if (pixels == GRAY) {
+        channels.assign(1, in);
+    } else if (pixels == YUV444) {
+        /* Y, Cb and Cr planes, OpenCV wants them as Y Cr Cb */
+        channels = {in.rowRange(0, h), in.rowRange(2 * h, 3 * h),
+                    in.rowRange(h, 2 * h)};
+    } else {
+        /* quarter size Cb and Cr planes follow Y, scaled up to it */
+        const cv::Size half(size.width / 2, h / 2);
+        const size_t quarter = (size_t)half.area();
+        channels.resize(3);
+        channels[0] = in.rowRange(0, h);
+        cv::resize(cv::Mat(half, CV_8UC1, (void*)(p + 4 * quarter + quarter)),
+                   chroma[0], size, 0, 0, cv::INTER_LINEAR);
+        cv::resize(cv::Mat(half, CV_8UC1, (void*)(p + 4 * quarter)),
+                   chroma[1], size, 0, 0, cv::INTER_LINEAR);
+        channels[1] = chroma[0];
+        channels[2] = chroma[1];
+    }
+    if (!full_range) {
+        /* luma from 16 to 235 and chroma from 16 to 240, around 128 */
+        for (size_t i = 0; i < channels.size(); i++) {
+            const double scale = i == 0 ? 255.0 / 219 : 255.0 / 224;
+            const double shift = i == 0 ? -16 * scale : 128 - 128 * scale;
+            channels[i].convertTo(ranged[i], CV_8U, scale, shift);
+            channels[i] = ranged[i];
+        }
+    }
+    if (pixels == GRAY) {
+        cv::cvtColor(channels[0], image, CV_GRAY2BGR);
+    } else {
+        cv::merge(channels, ycrcb);
+        cv::cvtColor(ycrcb, image, CV_YCrCb2BGR);
+    }
+    return true;
+}
+
+StreamWriter::StreamWriter(const std::string& path, StreamFormat format,
+                           double fps)
+    : format(format), fps(fps)
+{
+    if (path == "-") {
+        fd = STDOUT_FILENO;
+    } else {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        close_fd = true;
+    }
+    if (fd < 0) {
+        failure = std::strerror(errno);
+    }
+}
+
+StreamWriter::~StreamWriter()
+{
+    if (close_fd && fd >= 0) {
+        ::close(fd);
+    }
+}
+
+bool StreamWriter::write_bytes(const void* data, size_t n)
+{
+    const char* p = (const char*)data;
+    while (n > 0) {
+        ssize_t done = ::write(fd, p, n);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            failure = std::strerror(errno);
+            return false;
+        }
+        p += done;
+        n -= (size_t)done;
+    }
+    return true;
+}
+
+bool StreamWriter::write(const cv::Mat& image)
+{
+    if (!failure.empty()) {
+        return false;
+    }
+    rejection.clear();
+
+    /* 8-bit gray or BGR, scaled like write_mat */
+    cv::Mat frame = image;
+    if (image.type() == CV_32SC1) {
+        labels_to_bgr(image, converted);
+        frame = converted;
+    } else if (image.depth() != CV_8U) {
+        image.convertTo(converted, CV_8U, 256);
+        frame = converted;
+    }
+    if (frame.channels() == 4) {
+        cv::cvtColor(frame, converted, CV_BGRA2BGR);
+        frame = converted;
+    }
+    if (frame.channels() != 1 && frame.channels() != 3) {
+        rejection = "frames must have 1, 3 or 4 channels, not "
+                  + std::to_string(frame.channels());
+        return false;
+    }
+
+    if (channels == 0) {
+        size = frame.size();
+        channels = frame.channels();
+        if (format == STREAM_Y4M) {
+            /* frame rates are written as a fraction in thousandths */
+            const int rate = (int)std::round((fps > 0 ? fps : 25) * 1000);
+            std::ostringstream header;
+            header << "YUV4MPEG2 W" << size.width << " H" << size.height
+                   << " F" << rate << ":1000 Ip A1:1 "
+                   << (channels == 1 ? "Cmono" : "C444 XCOLORRANGE=FULL")
+                   << "\n";
+            if (!write_bytes(header.str().data(), header.str().size())) {
+                return false;
+            }
+        }
+    }
+    if (frame.size() != size || frame.channels() != channels) {
+        std::ostringstream reason;
+        reason << "a frame of " << frame.cols << "x" << frame.rows << " with "
+               << frame.channels() << " channels differs from the first, of "
+               << size.width << "x" << size.height << " with " << channels;
+        rejection = reason.str();
+        return false;
+    }
+
+    if (format == STREAM_Y4M) {
+        if (!write_bytes("FRAME\n", 6)) {
+            return false;
+        }
+        if (channels == 3) {
+            cv::cvtColor(frame, ycrcb, CV_BGR2YCrCb);
+            cv::split(ycrcb, ycrcb_planes);
+            /* planes go Y, Cb, Cr */
+            for (int i: {0, 2, 1}) {
+                const cv::Mat& plane = ycrcb_planes[i];
+                for (int r = 0; r < plane.rows; r++) {
+                    if (!write_bytes(plane.ptr(r), plane.cols)) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+    }
+
+    const size_t row_bytes = frame.cols * frame.elemSize();
+    if (frame.isContinuous()) {
+        return write_bytes(frame.data, row_bytes * frame.rows);
+    }
+    for (int r = 0; r < frame.rows; r++) {
+        if (!write_bytes(frame.ptr(r), row_bytes)) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,122 @@
+#ifndef _STREAM_HPP
+#define _STREAM_HPP
+
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "capture.hpp"
+
+/* uncompressed video, read and written without decoding frames
+ *
+ * YUV4MPEG2 streams carry their size, frame rate and colour space in a
+ * header. raw streams are frames of packed 8-bit BGR or gray pixels and
+ * nothing else, so their size and pixels are given. either can be a file
+ * or a pipe, "-" for standard input or output, which is how they are
+ * passed to and from ffmpeg */
+enum StreamFormat {
+    STREAM_Y4M,
+    STREAM_RAW
+};
+
+/* reads frames of a stream as 8-bit BGR
+ *
+ * Y4M frames are converted at the colour range of the header, limited or
+ * full. regular files are mapped into memory, so a raw BGR frame is handed out
+ * as a Mat over the mapping without copying it, and other frames are
+ * converted straight from it. pipes are read into the reused buffer of the
+ * frame, or of the planes to convert */
+class StreamReader : public FrameSource {
+public:
+    /* raw_size and raw_type, CV_8UC3 or CV_8UC1, only matter for raw
+     * streams. check error() for whether the stream could be opened */
+    StreamReader(const std::string& path, StreamFormat format,
+                 cv::Size raw_size=cv::Size(), int raw_type=CV_8UC3);
+    ~StreamReader();
+
+    StreamReader(const StreamReader&) = delete;
+    StreamReader& operator=(const StreamReader&) = delete;
+
+    virtual bool read(cv::Mat& image, int64& timestamp) override;
+    virtual double fps() override { return frame_rate; }
+
+    /* why the stream can't be read, empty if it can */
+    const std::string& error() const { return failure; }
+
+    cv::Size size;
+
+private:
+    enum Pixels {
+        BGR,
+        GRAY,
+        YUV420,
+        YUV444
+    };
+
+    bool read_header();
+    bool read_line(std::string& line);
+    /* the next n bytes, in the mapping or read into buffer */
+    const uchar* next_bytes(size_t n, uchar* buffer);
+
+    int fd = -1;
+    bool close_fd = false;
+    const uchar* map = nullptr;
+    size_t map_size = 0;
+    size_t offset = 0;
+
+    StreamFormat format;
+    Pixels pixels = BGR;
+    size_t frame_bytes = 0;
+    double frame_rate = 0;
+    bool full_range = false;
+    cv::Mat planes;
+    /* planes as Y Cr Cb, at full size and range, and their buffers */
+    std::vector<cv::Mat> channels;
+    cv::Mat chroma[2];
+    cv::Mat ranged[3];
+    cv::Mat ycrcb;
+    std::string failure;
+};
+
+/* writes the frames of a stream
+ * 1 and 3 channel images are written as gray and BGR, after converting
+ * them to 8 bits like write_mat. Y4M streams hold gray frames as mono and
+ * BGR frames as full range 4:4:4 YCbCr. every frame must have the size
+ * and channels of the first */
+class StreamWriter {
+public:
+    StreamWriter(const std::string& path, StreamFormat format, double fps=0);
+    ~StreamWriter();
+
+    StreamWriter(const StreamWriter&) = delete;
+    StreamWriter& operator=(const StreamWriter&) = delete;
+
+    /* returns false if the frame can't be written */
+    bool write(const cv::Mat& image);
+
+    /* why the stream can't be written, or else why the last frame was
+     * not, empty if it was */
+    const std::string& error() const
+    {
+        return failure.empty() ? rejection : failure;
+    }
+
+private:
+    bool write_bytes(const void* data, size_t n);
+
+    int fd = -1;
+    bool close_fd = false;
+    StreamFormat format;
+    double fps;
+    cv::Size size;
+    int channels = 0;
+    cv::Mat converted;
+    cv::Mat ycrcb;
+    std::vector<cv::Mat> ycrcb_planes;
+    std::string failure;
+    /* frames that don't fit the stream are skipped, it goes on */
+    std::string rejection;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef _THREAD_POOL_HPP
+#define _THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* a fixed set of worker threads that run queued tasks
+ *
+ * parallel_for runs one call per index and blocks until all of them are
+ * done. the calling thread takes indices too, so a pool with n workers
+ * runs n + 1 calls at once and parallel_for may be used from inside a task
+ */
+class ThreadPool {
+public:
+    explicit ThreadPool(int workers)
+    {
+        for (int i = 0; i < workers; i++) {
+            threads.push_back(std::thread([this]() { work(); }));
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t: threads) {
+            t.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /* number of worker threads, not counting callers of parallel_for */
+    int size() const { return (int)threads.size(); }
+
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+
+    /* call body(i) for every i in [begin, end)
+     * the first exception thrown by body is rethrown here */
+    void parallel_for(int begin, int end, const std::function<void(int)>& body)
+    {
+        if (end - begin <= 0) {
+            return;
+        }
+
+        struct Loop {
+            std::atomic<int> next;
+            int end;
+            int pending;
+            std::exception_ptr error;
+            std::mutex mutex;
+            std::condition_variable done;
+        };
+        auto loop = std::make_shared<Loop>();
+        loop->next = begin;
+        loop->end = end;
+        loop->pending = end - begin;
+
+        auto run = [loop, &body]() {
+            int i;
+            while ((i = loop->next++) < loop->end) {
+                std::exception_ptr error;
+                try {
+                    body(i);
+                } catch (...) {
+                    error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(loop->mutex);
+                if (error && !loop->error) {
+                    loop->error = error;
+                }
+                if (--loop->pending == 0) {
+                    loop->done.notify_all();
+                }
+            }
+        };
+
+        int helpers = std::min(size(), end - begin - 1);
+        for (int i = 0; i < helpers; i++) {
+            submit(run);
+        }
+        run();
+
+        std::unique_lock<std::mutex> lock(loop->mutex);
+        loop->done.wait(lock, [&loop]() { return loop->pending == 0; });
+        if (loop->error) {
+            std::rethrow_exception(loop->error);
+        }
+    }
+
+private:
+    void work()
+    {
+        while (true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return;
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+};
+
+/* first row of each of n strips of rows, followed by the number of rows */
+inline std::vector<int> split_rows(int rows, int strips)
+{
+    std::vector<int> bounds(strips + 1);
+    for (int i = 0; i <= strips; i++) {
+        bounds[i] = (int)((long long)rows * i / strips);
+    }
+    return bounds;
+}
+
+/* number of strips to split rows into for a pool, at least min_rows each */
+inline int strip_count(ThreadPool* pool, int rows, int min_rows=1)
+{
+    int threads = pool == nullptr ? 1 : pool->size() + 1;
+    return std::max(1, std::min(rows / std::max(min_rows, 1), threads));
+}
+
+/* run body(i) for every i in [begin, end), on the pool if there is one */
+inline void parallel_for(ThreadPool* pool, int begin, int end,
+                         const std::function<void(int)>& body)
+{
+    if (pool == nullptr || end - begin <= 1) {
+        for (int i = begin; i < end; i++) {
+            body(i);
+        }
+    } else {
+        pool->parallel_for(begin, end, body);
+    }
+}
+
+#endif
@@ -0,0 +1,164 @@
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "trace.hpp"
+
+namespace {
+
+struct Span {
+    std::string name;
+    long long start;
+    long long end;
+};
+
+/* spans are appended to fixed size chunks, so a chunk never moves once
+ * written. only the owning thread writes, and used is published with
+ * release so the trace can be read while threads are still running */
+struct Chunk {
+    static const size_t capacity = 4096;
+    Span spans[capacity];
+    std::atomic<size_t> used{0};
+    std::atomic<Chunk*> next{nullptr};
+};
+
+struct ThreadBuffer {
+    int id = 0;
+    std::string name;
+    std::unique_ptr<Chunk> head{new Chunk};
+    Chunk* tail = head.get();
+    std::vector<std::unique_ptr<Chunk>> chunks;
+};
+
+/* buffers of every thread that recorded a span, kept after the thread
+ * exits so its spans are still written */
+struct TraceRegistry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    long long origin = 0;
+};
+
+TraceRegistry& registry()
+{
+    static TraceRegistry r;
+    return r;
+}
+
+ThreadBuffer& thread_buffer()
+{
+    static thread_local ThreadBuffer* buffer = nullptr;
+    if (buffer == nullptr) {
+        TraceRegistry& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.buffers.emplace_back(new ThreadBuffer);
+        buffer = r.buffers.back().get();
+        buffer->id = (int)r.buffers.size();
+    }
+    return *buffer;
+}
+
+std::string json_string(const std::string& s)
+{
+    std::string out = "\"";
+    for (char c: s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+}
+
+std::atomic<bool>& trace_flag()
+{
+    static std::atomic<bool> flag(false);
+    return flag;
+}
+
+long long trace_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void start_trace()
+{
+    registry().origin = trace_now();
+    trace_flag().store(true);
+}
+
+void trace_thread_name(const std::string& name)
+{
+    if (!trace_enabled()) {
+        return;
+    }
+    ThreadBuffer& buffer = thread_buffer();
+    std::lock_guard<std::mutex> lock(registry().mutex);
+    buffer.name = name;
+}
+
+void trace_span(const std::string& name, long long start, long long end)
+{
+    ThreadBuffer& buffer = thread_buffer();
+    Chunk* chunk = buffer.tail;
+    size_t used = chunk->used.load(std::memory_order_relaxed);
+    if (used == Chunk::capacity) {
+        buffer.chunks.emplace_back(new Chunk);
+        chunk->next.store(buffer.chunks.back().get(), std::memory_order_release);
+        chunk = buffer.tail = buffer.chunks.back().get();
+        used = 0;
+    }
+    chunk->spans[used].name = name;
+    chunk->spans[used].start = start;
+    chunk->spans[used].end = end;
+    chunk->used.store(used + 1, std::memory_order_release);
+}
+
+bool write_trace(const std::string& path)
+{
+    trace_flag().store(false);
+
+    std::ofstream out(path);
+    out << std::fixed << std::setprecision(3);
+    TraceRegistry& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    for (auto& buffer: r.buffers) {
+        if (!buffer->name.empty()) {
+            out << (first ? "" : ",\n")
+                << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                << "\"tid\": " << buffer->id << ", \"args\": {\"name\": "
+                << json_string(buffer->name) << "}}";
+            first = false;
+        }
+        for (Chunk* chunk = buffer->head.get(); chunk != nullptr;
+             chunk = chunk->next.load(std::memory_order_acquire)) {
+            size_t used = chunk->used.load(std::memory_order_acquire);
+            for (size_t i = 0; i < used; i++) {
+                const Span& s = chunk->spans[i];
+                /* complete events, times in microseconds */
+                out << (first ? "" : ",\n")
+                    << "{\"name\": " << json_string(s.name)
+                    << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->id
+                    << ", \"ts\": " << (s.start - r.origin) / 1000.0
+                    << ", \"dur\": " << (s.end - s.start) / 1000.0 << "}";
+                first = false;
+            }
+        }
+    }
+    out << "\n]}\n";
+    return (bool)out;
+}
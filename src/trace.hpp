@@ -0,0 +1,62 @@
+#ifndef _TRACE_HPP
+#define _TRACE_HPP
+
+#include <atomic>
+#include <string>
+
+/* timing spans written as a Chrome trace, for chrome://tracing or Perfetto
+ *
+ * TRACE_SCOPE(name) records the time from where it is declared to the end
+ * of the enclosing scope. every thread appends its spans to its own
+ * buffer without locking, so spans cost two clock reads when tracing and
+ * a flag test otherwise. names are only built when tracing */
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) \
+    TraceSpan TRACE_CONCAT(trace_span_, __LINE__)( \
+        trace_enabled() ? std::string(name) : std::string())
+
+std::atomic<bool>& trace_flag();
+
+inline bool trace_enabled()
+{
+    return trace_flag().load(std::memory_order_relaxed);
+}
+
+/* start recording spans */
+void start_trace();
+
+/* stop recording and write every span recorded so far to a JSON file
+ * returns false if the file can't be written */
+bool write_trace(const std::string& path);
+
+/* name the calling thread in the trace */
+void trace_thread_name(const std::string& name);
+
+/* add a span to the calling thread's buffer, times in nanoseconds */
+void trace_span(const std::string& name, long long start, long long end);
+
+/* nanoseconds on a steady clock */
+long long trace_now();
+
+class TraceSpan {
+public:
+    explicit TraceSpan(std::string name)
+        : name(std::move(name)), start(trace_enabled() ? trace_now() : -1) {}
+
+    ~TraceSpan()
+    {
+        if (start >= 0) {
+            trace_span(name, start, trace_now());
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    std::string name;
+    long long start;
+};
+
+#endif
@@ -1,70 +1,198 @@
 #include "two_pass.hpp"
 
-float cat_by_value(Vec3b bgr, void* conf) 
+/* root of a provisional label, halving the path on the way */
+static inline int find_root(int* parent, int l)
 {
-    float max_cats = 2;
-    if (conf != nullptr) {
-        max_cats = *((float*)conf);
+    while (parent[l] != l) {
+        parent[l] = parent[parent[l]];
+        l = parent[l];
     }
-    float gray = bgr_to_gray(bgr);
-    return (float)((int)(gray * max_cats)) / max_cats;
+    return l;
 }
 
-void two_pass(const Mat& input, Mat& output,
-              const std::function<float(Vec3b, void*)>& categorize, void* conf, bool north_bias)
+/* record that two provisional labels belong to the same component
+ * the smaller label becomes the root, so every root is the first label
+ * its component got in raster order */
+static inline void merge_labels(int* parent, int a, int b)
 {
-    output = Mat(input.size(), CV_32FC3);
-    
-    /* categorize pixels */
-    Mat categories(input.size(), CV_32FC1);
-    for (int r = 0; r < input.rows; r++) {
-        for (int c = 0; c < input.cols; c++) {
-            Vec3b val = input.at<Vec3b>(r, c);
-            categories.at<float>(r, c) = categorize(val, conf); 
-        }
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a < b) {
+        parent[b] = a;
+    } else if (b < a) {
+        parent[a] = b;
     }
+}
 
-    /* pass 1:
-     * find contiguous runs of pixels */
-    float label = 0;
-    for (int r = 1; r < input.rows - 1; r++) {
-        for (int c = 1; c < input.cols - 1; c++) {
-            float north = categories.at<float>(r - 1, c); 
-            float west  = categories.at<float>(r, c - 1); 
-            float here  = categories.at<float>(r, c);
-            if (north_bias) {
-                if (c > 1 && here == north) {
-                    output.at<Vec3f>(r, c) = output.at<Vec3f>(r - 1, c); 
-                } else if (r > 1 && here == west) {
-                    output.at<Vec3f>(r, c) = output.at<Vec3f>(r, c - 1); 
-                } else {
-                    output.at<Vec3f>(r, c) = Vec3f(label, 1.0, 1.0); 
-                    label += 1; 
-                }
+/* pass 1 over rows [row_begin, row_end):
+ * find contiguous runs of pixels, a pixel takes the label of its northern
+ * or western neighbour when they are in the same category. when both are,
+ * their labels are equivalent
+ * new labels are numbered from first_label, returns one past the last */
+template <typename T>
+static int label_strip(const Mat& categories, Mat& labels,
+                       int* parent, int row_begin, int row_end,
+                       int first_label, bool north_bias)
+{
+    int next = first_label;
+    for (int r = row_begin; r < row_end; r++) {
+        const T* cats = categories.ptr<T>(r);
+        const T* cats_north = categories.ptr<T>(std::max(r - 1, 0));
+        int* row = labels.ptr<int>(r);
+        const int* row_north = labels.ptr<int>(std::max(r - 1, 0));
+        for (int c = 0; c < categories.cols; c++) {
+            T here = cats[c];
+            bool north = r > row_begin && here == cats_north[c];
+            bool west  = c > 0 && here == cats[c - 1];
+            if (north && west) {
+                row[c] = north_bias ? row_north[c] : row[c - 1];
+                merge_labels(parent, row_north[c], row[c - 1]);
+            } else if (north) {
+                row[c] = row_north[c];
+            } else if (west) {
+                row[c] = row[c - 1];
             } else {
-                if (r > 1 && here == west) {
-                    output.at<Vec3f>(r, c) = output.at<Vec3f>(r, c - 1); 
-                } else if (c > 1 && here == north) {
-                    output.at<Vec3f>(r, c) = output.at<Vec3f>(r - 1, c); 
-                } else {
-                    output.at<Vec3f>(r, c) = Vec3f(label, 1.0, 1.0); 
-                    label += 1; 
-                }
+                row[c] = next;
+                parent[next] = next;
+                next++;
             }
-            if (here == west && west == north) {
-                // equiv(west.label, north.label) 
+        }
+    }
+    return next;
+}
+
+/* area, extent and coordinate sums of the pixels of a region */
+struct Accumulator {
+    int area = 0;
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = -1, y1 = -1;
+    double sx = 0, sy = 0;
+};
+
+/* pass 2 over rows [row_begin, row_end):
+ * replace provisional labels by the dense label in their parent entry */
+static void relabel_strip(Mat& labels, const int* parent,
+                          int row_begin, int row_end,
+                          std::vector<Accumulator>* acc)
+{
+    for (int r = row_begin; r < row_end; r++) {
+        int* row = labels.ptr<int>(r);
+        for (int c = 0; c < labels.cols; c++) {
+            row[c] = parent[row[c]];
+            if (acc != nullptr) {
+                Accumulator& a = (*acc)[row[c]];
+                a.area++;
+                a.x0 = std::min(a.x0, c);
+                a.x1 = std::max(a.x1, c);
+                a.y0 = std::min(a.y0, r);
+                a.y1 = std::max(a.y1, r);
+                a.sx += c;
+                a.sy += r;
             }
+        }
+    }
+}
 
+/* regions that continue across the border above row r are equivalent */
+template <typename T>
+static void merge_border(const Mat& categories, const Mat& labels,
+                         int* parent, int r)
+{
+    const T* cats = categories.ptr<T>(r);
+    const T* cats_north = categories.ptr<T>(r - 1);
+    const int* row = labels.ptr<int>(r);
+    const int* row_north = labels.ptr<int>(r - 1);
+    for (int c = 0; c < categories.cols; c++) {
+        if (cats[c] == cats_north[c]) {
+            merge_labels(parent, row_north[c], row[c]);
         }
     }
+}
 
-    /* visualization */
-    auto hsv(std::vector<Mat>(3));
-    split(output, hsv);
-    hsv[0] /= label / 256;
-    merge(hsv, output);
-    cvtColor(output, output, CV_HSV2BGR);
-    save_mat("categories", categories, true, true);
+int label_categories(const Mat& categories, Mat& labels, bool north_bias,
+                     std::vector<ComponentStats>* stats, ThreadPool* pool,
+                     Workspace* workspace)
+{
+    CV_Assert(categories.type() == CV_8UC1 || categories.type() == CV_16UC1);
+    /* labels are ints, one for each pixel at most */
+    const size_t entries = (size_t)categories.rows * categories.cols + 1;
+    CV_Assert(entries <= (size_t)INT_MAX);
+    const bool wide = categories.depth() == CV_16U;
+    labels.create(categories.size(), CV_32SC1);
 
-    /* pass 2: merge equivalent labels */
+    /* horizontal strips are labeled on their own, each with a range of
+     * provisional labels starting after the index of its first pixel */
+    const int rows = categories.rows;
+    const int cols = categories.cols;
+    const int strips = strip_count(pool, rows);
+    const std::vector<int> bounds = split_rows(rows, strips);
+
+    /* one equivalence entry per pixel, every entry is written before it
+     * is read so the buffer is reused as is. it can't be any smaller: a
+     * pixel takes a new label when it differs from its northern and
+     * western neighbours, which every pixel of a checkerboard does */
+    Mat parents = workspace_mat(workspace, "parents",
+                                Size(1, (int)entries), CV_32SC1);
+    int* parent = parents.ptr<int>();
+    std::vector<int> used(strips);
+    int count = 0;
+    {
+        TRACE_SCOPE("two_pass first pass");
+        parallel_for(pool, 0, strips, [&](int i) {
+            int first = bounds[i] * cols + 1;
+            used[i] = wide ? label_strip<ushort>(categories, labels, parent,
+                                                 bounds[i], bounds[i + 1], first,
+                                                 north_bias)
+                           : label_strip<uchar>(categories, labels, parent,
+                                                bounds[i], bounds[i + 1], first,
+                                                north_bias);
+        });
+
+        for (int i = 1; i < strips; i++) {
+            if (wide) {
+                merge_border<ushort>(categories, labels, parent, bounds[i]);
+            } else {
+                merge_border<uchar>(categories, labels, parent, bounds[i]);
+            }
+        }
+
+        /* resolve equivalences to dense labels, in place
+         * every label's parent is smaller than it, so by the time a label is
+         * reached its parent already holds the dense label */
+        for (int i = 0; i < strips; i++) {
+            for (int l = bounds[i] * cols + 1; l < used[i]; l++) {
+                parent[l] = parent[l] == l ? ++count : parent[parent[l]];
+            }
+        }
+    }
+
+    /* pass 2: merge equivalent labels and gather component statistics */
+    TRACE_SCOPE("two_pass second pass");
+    std::vector<std::vector<Accumulator> > acc(stats == nullptr ? 0 : strips,
+                                               std::vector<Accumulator>(count + 1));
+    parallel_for(pool, 0, strips, [&](int i) {
+        relabel_strip(labels, parent, bounds[i], bounds[i + 1],
+                      stats == nullptr ? nullptr : &acc[i]);
+    });
+
+    if (stats != nullptr) {
+        stats->assign(count + 1, ComponentStats());
+        for (int l = 1; l <= count; l++) {
+            Accumulator a;
+            for (auto& strip: acc) {
+                const Accumulator& b = strip[l];
+                a.area += b.area;
+                a.x0 = std::min(a.x0, b.x0);
+                a.x1 = std::max(a.x1, b.x1);
+                a.y0 = std::min(a.y0, b.y0);
+                a.y1 = std::max(a.y1, b.y1);
+                a.sx += b.sx;
+                a.sy += b.sy;
+            }
+            ComponentStats& s = (*stats)[l];
+            s.area = a.area;
+            s.bbox = Rect(a.x0, a.y0, a.x1 - a.x0 + 1, a.y1 - a.y0 + 1);
+            s.centroid = Point2d(a.sx / a.area, a.sy / a.area);
+        }
+    }
+    return count;
 }
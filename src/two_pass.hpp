@@ -1,49 +1,273 @@
 #ifndef _TWO_PASS_HPP
 #define _TWO_PASS_HPP
 
-#include <functional>
+#include <climits>
 #include "util.hpp"
+#include "thread_pool.hpp"
 
 using namespace cv;
 
-inline float bgr_to_gray(Vec3b bgr)
+/* categorizers map a row of BGR or gray pixels to small integer categories
+ *
+ * two_pass takes the categorizer as a template parameter, so the per pixel
+ * work is inlined into the scan. a categorizer provides
+ *   typedef uchar or ushort category_type;
+ *   int count() const;   the number of categories
+ *   void operator()(const Vec3b* bgr, category_type* cats, int n) const;
+ *   void operator()(const uchar* gray, category_type* cats, int n) const;
+ * and must be safe to call from several threads at once */
+
+/* categories by gray level
+ * rows are converted to gray with cvtColor, which is vectorized, and the
+ * gray levels are looked up in a 256 entry table */
+class GrayCategorizer {
+public:
+    typedef uchar category_type;
+
+    explicit GrayCategorizer(int max_cats=2)
+    {
+        cats = std::min(std::max(max_cats, 1), 256);
+        for (int g = 0; g < 256; g++) {
+            lut[g] = (uchar)(g * cats / 256);
+        }
+    }
+
+    int count() const { return cats; }
+
+    inline void operator()(const Vec3b* bgr, uchar* out, int n) const
+    {
+        const int chunk = 4096;
+        uchar gray[chunk];
+        for (int i = 0; i < n; i += chunk) {
+            int len = std::min(chunk, n - i);
+            Mat gray_row(1, len, CV_8UC1, gray);
+            cvtColor(Mat(1, len, CV_8UC3, (void*)(bgr + i)), gray_row,
+                     CV_BGR2GRAY);
+            for (int j = 0; j < len; j++) {
+                out[i + j] = lut[gray[j]];
+            }
+        }
+    }
+
+    inline void operator()(const uchar* gray, uchar* out, int n) const
+    {
+        for (int i = 0; i < n; i++) {
+            out[i] = lut[gray[i]];
+        }
+    }
+
+private:
+    int cats;
+    uchar lut[256];
+};
+
+/* categories by colour, each channel is quantized to the same number of
+ * levels through a lookup table */
+class ColorCategorizer {
+public:
+    typedef ushort category_type;
+
+    explicit ColorCategorizer(int levels=2)
+    {
+        levels = std::min(std::max(levels, 1), 40);
+        cats = levels * levels * levels;
+        for (int v = 0; v < 256; v++) {
+            int level = v * levels / 256;
+            lut_b[v] = (ushort)(level * levels * levels);
+            lut_g[v] = (ushort)(level * levels);
+            lut_r[v] = (ushort)level;
+        }
+    }
+
+    int count() const { return cats; }
+
+    inline void operator()(const Vec3b* bgr, ushort* out, int n) const
+    {
+        for (int i = 0; i < n; i++) {
+            out[i] = lut_b[bgr[i][0]] + lut_g[bgr[i][1]] + lut_r[bgr[i][2]];
+        }
+    }
+
+    /* a gray pixel has the same level in every channel */
+    inline void operator()(const uchar* gray, ushort* out, int n) const
+    {
+        for (int i = 0; i < n; i++) {
+            out[i] = lut_b[gray[i]] + lut_g[gray[i]] + lut_r[gray[i]];
+        }
+    }
+
+private:
+    int cats;
+    ushort lut_b[256], lut_g[256], lut_r[256];
+};
+
+/* size, extent and center of a connected component */
+struct ComponentStats {
+    int area = 0;
+    Rect bbox;
+    Point2d centroid;
+};
+
+/* label the 4-connected regions of an 8 or 16-bit category image
+ * labels are written to a 32-bit integer image, numbered from 1 in raster
+ * order of the first pixel of each region. stats, when given, gets an
+ * entry per label, the entry for 0 is unused
+ * with a thread pool, strips of rows are labeled in parallel and merged,
+ * the labels are the same as on a single thread. images of more than
+ * INT_MAX - 1 pixels are refused with an exception
+ * returns the number of regions */
+int label_categories(const Mat& categories, Mat& labels, bool north_bias=true,
+                     std::vector<ComponentStats>* stats=nullptr,
+                     ThreadPool* pool=nullptr, Workspace* workspace=nullptr);
+
+/* categorize every pixel of a BGR or 8-bit gray image, then label the
+ * regions of pixels in the same category */
+template <typename Categorizer>
+int two_pass(const Mat& input, Mat& labels, const Categorizer& categorize,
+             bool north_bias=true, std::vector<ComponentStats>* stats=nullptr,
+             bool save=false, bool gui=false,
+             std::string interm_name_prefix="", ThreadPool* pool=nullptr,
+             Workspace* workspace=nullptr)
 {
-    return (0.114 * bgr[0] + 0.587 * bgr[1] + 0.299 * bgr[2]) / 256.0;
-}
+    typedef typename Categorizer::category_type category_type;
 
-float cat_by_value(Vec3b, void*);
+    Mat categories = workspace_mat(workspace, "categories", input.size(),
+                                   DataType<category_type>::type);
+    const std::vector<int> bounds = split_rows(input.rows,
+                                               strip_count(pool, input.rows));
+    {
+        TRACE_SCOPE("two_pass categorize");
+        parallel_for(pool, 0, (int)bounds.size() - 1, [&](int i) {
+            for (int r = bounds[i]; r < bounds[i + 1]; r++) {
+                if (input.type() == CV_8UC1) {
+                    categorize(input.ptr<uchar>(r),
+                               categories.ptr<category_type>(r), input.cols);
+                } else {
+                    categorize(input.ptr<Vec3b>(r),
+                               categories.ptr<category_type>(r), input.cols);
+                }
+            }
+        });
+    }
+
+    if (save) {
+        Mat shown;
+        categories.convertTo(shown, CV_32FC1, 1.0 / categorize.count());
+        save_mat(interm_name_prefix + "categories", shown, save, gui);
+    }
+
+    return label_categories(categories, labels, north_bias, stats, pool,
+                            workspace);
+}
 
-void two_pass(const Mat& input, Mat& output,
-              const std::function<float(Vec3b, void*)>& categorize, void* conf, bool north_bias=true);
+/* settings of TwoPassAlgorithm, the same as its command line options */
+struct TwoPassConfig {
+    int max_categories = 2;
+    bool west_bias = false;
+    bool color = false;
+    bool stats = false;
+    int threads = 1;
+};
 
 class TwoPassAlgorithm : public FrameAlgorithm {
 public:
-    float max_cats;
-    bool north_bias;
+    int max_cats = 2;
+    bool north_bias = true;
+    bool by_color = false;
+    bool print_stats = false;
+    bool save_interm = false;
+    bool show_interm = false;
+    int threads = 1;
+    std::shared_ptr<ThreadPool> pool;
 
 TwoPassAlgorithm() : FrameAlgorithm(
-R"(Usage: two_pass [--west-bias] [--max-categories=<cats>] [--help | -h] [<algorithm> [<args>...]]]
+R"(Usage: two_pass [--west-bias] [--max-categories=<cats>] [--color] [--stats] [--threads=<n>] [--help | -h] [<algorithm> [<args>...]]]
 
 Options:
   -c <cats> --max-categories=<cats> Maximum number of categories.
   -w --west-bias    Instead of northern bias.
+  --color           Categorize by colour, with the maximum number of
+                    categories per channel.
+  -s --stats        Print area, bounding box and centroid of every region.
+  -t <n> --threads=<n> Label strips of rows in parallel [default: 1].
   -h --help Show this message.
 )")
     { }
 
+    inline void configure(const TwoPassConfig& config)
+    {
+        max_cats = config.max_categories;
+        north_bias = !config.west_bias;
+        by_color = config.color;
+        print_stats = config.stats;
+        threads = config.threads;
+        pool.reset();
+        if (threads > 1) {
+            pool = std::make_shared<ThreadPool>(threads - 1);
+        }
+    }
+
     inline virtual std::map<std::string, docopt::value>
     parse_arguments(std::map<std::string, docopt::value> m,
                     std::vector<std::string> a)
     {
         FrameAlgorithm::parse_arguments(m, a);
-        max_cats = (float)((int)docopt_to_float(args, "--max-categories", max_cats));
-        north_bias = !args["--west-bias"].asBool();
+        save_interm = main_args["--show-intermediates"].asBool();
+        show_interm = !main_args["--no-interm-gui"].asBool();
+        TwoPassConfig config;
+        config.max_categories = (int)docopt_to_float(args, "--max-categories",
+                                                     config.max_categories);
+        config.west_bias = args["--west-bias"].asBool();
+        config.color = args["--color"].asBool();
+        config.stats = args["--stats"].asBool();
+        config.threads = (int)docopt_to_float(args, "--threads", config.threads);
+        configure(config);
         return args;
     }
 
+    /* gray levels are categorized from gray frames as they are */
+    inline virtual std::vector<PixelFormat> input_formats() override
+    {
+        if (by_color) {
+            return {PIXELS_BGR8};
+        }
+        return {PIXELS_GRAY8, PIXELS_BGR8};
+    }
+
+    inline virtual PixelFormat output_format(PixelFormat) override
+    {
+        return PIXELS_LABELS32S;
+    }
+
+    /* below full quality, intermediates are no longer saved */
+    inline virtual int quality_levels() override
+    {
+        return save_interm ? 1 : 0;
+    }
+
     inline virtual void process_frame(const Mat& in, Mat& out, std::string prefix="") override
     {
-        two_pass(in, out, cat_by_value, &max_cats, north_bias);
+        std::vector<ComponentStats> stats;
+        std::vector<ComponentStats>* s = print_stats ? &stats : nullptr;
+        const bool save = save_interm && quality == 0;
+        int count;
+        if (by_color) {
+            count = two_pass(in, out, ColorCategorizer(max_cats), north_bias,
+                             s, save, show_interm, prefix, pool.get(),
+                             &workspace);
+        } else {
+            count = two_pass(in, out, GrayCategorizer(max_cats), north_bias,
+                             s, save, show_interm, prefix, pool.get(),
+                             &workspace);
+        }
+        if (print_stats) {
+            std::cout << prefix << ": " << count << " regions" << std::endl;
+            for (int l = 1; l <= count; l++) {
+                std::cout << "  " << l << " area " << stats[l].area
+                          << " bbox " << stats[l].bbox
+                          << " centroid " << stats[l].centroid << std::endl;
+            }
+        }
     }
 };
 
@@ -1,26 +1,122 @@
 #ifndef _UTIL_HPP
 #define _UTIL_HPP
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <opencv2/opencv.hpp>
 
-#include "../lib/docopt.cpp/docopt.h"
+/* found through the include path, installed next to this header */
+#include "docopt.h"
+#include "formats.hpp"
+#include "trace.hpp"
+#include "writer.hpp"
 
+/* colour a 32-bit label image for display, each label gets its own hue
+ * and label 0 stays black */
+inline void labels_to_bgr(const cv::Mat& labels, cv::Mat& bgr)
+{
+    double max_label;
+    cv::minMaxLoc(labels, NULL, &max_label);
+    cv::Mat hsv(labels.size(), CV_8UC3);
+    for (int r = 0; r < labels.rows; r++) {
+        const int* in = labels.ptr<int>(r);
+        cv::Vec3b* out = hsv.ptr<cv::Vec3b>(r);
+        for (int c = 0; c < labels.cols; c++) {
+            uchar hue = (uchar)(in[c] * 179.0 / std::max(max_label, 1.0));
+            out[c] = in[c] == 0 ? cv::Vec3b(0, 0, 0) : cv::Vec3b(hue, 255, 255);
+        }
+    }
+    cv::cvtColor(hsv, bgr, CV_HSV2BGR);
+}
+
+/* highgui windows must only be used from the main thread
+ * the first call records the calling thread as the main one */
+inline std::thread::id gui_thread()
+{
+    static const std::thread::id id = std::this_thread::get_id();
+    return id;
+}
+
+/* images shown from other threads, the latest one for each window */
+struct DeferredWindows {
+    std::mutex mutex;
+    std::map<std::string, cv::Mat> images;
+};
+
+inline DeferredWindows& deferred_windows()
+{
+    static DeferredWindows windows;
+    return windows;
+}
+
+/* show the images other threads passed to save_mat since the last call
+ * must be called from the main thread, before waitKey */
+inline void show_deferred()
+{
+    std::map<std::string, cv::Mat> images;
+    {
+        DeferredWindows& windows = deferred_windows();
+        std::lock_guard<std::mutex> lock(windows.mutex);
+        images.swap(windows.images);
+    }
+    for (auto& i: images) {
+        cv::namedWindow(i.first, cv::WINDOW_NORMAL);
+        cv::imshow(i.first, i.second);
+    }
+}
+
+/* write an image to a file, converting other types to 8 bits like save_mat
+ * or keeping their values in a float map, depending on the options */
+inline bool write_mat(const std::string& path, const cv::Mat& mat,
+                      const WriterOptions& options=writer_options())
+{
+    if (options.format == WriterOptions::PFM) {
+        return write_pfm(path, mat);
+    }
+    if (mat.type() == CV_32SC1) {
+        cv::Mat bgr;
+        labels_to_bgr(mat, bgr);
+        return write_mat(path, bgr, options);
+    }
+    /* 8-bit images of any channel count are written as they are */
+    cv::Mat _mat(mat);
+    if (mat.depth() != CV_8U) {
+        mat.convertTo(_mat, CV_8U, 256);
+    }
+    std::vector<int> params = {cv::IMWRITE_PNG_COMPRESSION,
+                               options.png_compression};
+    return cv::imwrite(path, _mat, params);
+}
+
+/* show an image in a window, or write it to a file in the background
+ * without a gui, see image_writer() */
 inline void save_mat(const std::string name, const cv::Mat mat,
                      bool save, bool gui)
 {
-    if (save) {
-        if (gui) {
-            cv::namedWindow(name, cv::WINDOW_NORMAL);
-            cv::imshow(name, mat);
-        } else {
-            cv::Mat _mat(mat);
-            if (mat.type() != CV_8UC3) {
-                mat.convertTo(_mat, CV_8UC3, 256);
-            }
-            std::cout << "Writing to '_" << name << ".png'" << std::endl;
-            cv::imwrite("_" + name + ".png", _mat);
-        }
+    if (!save) {
+        return;
+    }
+    if (!gui) {
+        image_writer().write("_" + name + image_extension(), mat);
+    } else if (mat.type() == CV_32SC1) {
+        /* label images are only coloured when shown */
+        cv::Mat bgr;
+        labels_to_bgr(mat, bgr);
+        save_mat(name, bgr, save, gui);
+    } else if (std::this_thread::get_id() != gui_thread()) {
+        /* algorithms may reuse their buffers, so keep a copy */
+        DeferredWindows& windows = deferred_windows();
+        std::lock_guard<std::mutex> lock(windows.mutex);
+        windows.images[name] = mat.clone();
+    } else {
+        cv::namedWindow(name, cv::WINDOW_NORMAL);
+        cv::imshow(name, mat);
     }
 }
 
@@ -38,6 +134,125 @@ inline float docopt_to_float(std::map<std::string, docopt::value> args,
     return default_v;
 }
 
+/* named buffers an algorithm keeps between frames
+ * a buffer is only reallocated when its size or type changes, so frames of
+ * the same resolution are processed without allocating. allocations
+ * counts the buffers created here only, CountingAllocator counts them all.
+ * buffers are overwritten on the next frame, so they must not be used for
+ * results handed to the caller */
+class Workspace {
+public:
+    cv::Mat get(const std::string& name, cv::Size size, int type)
+    {
+        cv::Mat& m = buffers[name];
+        if (m.empty() || m.size() != size || m.type() != type) {
+            m.create(size, type);
+            allocations++;
+        }
+        return m;
+    }
+
+    long allocations = 0;
+
+private:
+    std::map<std::string, cv::Mat> buffers;
+};
+
+/* counts the Mat buffers allocated while it is the default allocator,
+ * see Mat::setDefaultAllocator. base does the work, so buffers it allocated
+ * are freed by base even after the counter is gone */
+class CountingAllocator : public cv::MatAllocator {
+public:
+    explicit CountingAllocator(cv::MatAllocator* base) : base(base) {}
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+                           size_t* step, int flags,
+                           cv::UMatUsageFlags usage) const override
+    {
+        count++;
+        return base->allocate(dims, sizes, type, data, step, flags, usage);
+    }
+
+    bool allocate(cv::UMatData* data, int access,
+                  cv::UMatUsageFlags usage) const override
+    {
+        return base->allocate(data, access, usage);
+    }
+
+    void deallocate(cv::UMatData* data) const override
+    {
+        base->deallocate(data);
+    }
+
+    mutable std::atomic<long> count{0};
+
+private:
+    cv::MatAllocator* base;
+};
+
+/* Mat buffers allocated per frame once the first frames have set up their
+ * buffers, 0 when every buffer is reused. frame is called once a frame is
+ * done, from any one thread */
+class FrameAllocations {
+public:
+    explicit FrameAllocations(const CountingAllocator& allocator,
+                              long warmup=10)
+        : allocator(allocator), warmup(warmup) {}
+
+    void frame()
+    {
+        if (++frames == warmup) {
+            start = allocator.count;
+        }
+    }
+
+    void print(std::ostream& out) const
+    {
+        if (frames <= warmup) {
+            return;
+        }
+        out << "Allocated " << (double)(allocator.count - start) / (frames - warmup)
+            << " buffers per frame after the first " << warmup << " frames"
+            << std::endl;
+    }
+
+private:
+    const CountingAllocator& allocator;
+    const long warmup;
+    long frames = 0;
+    long start = 0;
+};
+
+/* true when writing to m changes no other Mat: it has no buffer yet, or
+ * owns one no other Mat refers to */
+inline bool unshared(const cv::Mat& m)
+{
+    return m.empty() || (m.u != nullptr && m.u->refcount == 1);
+}
+
+/* a buffer from the workspace, or a new one without a workspace */
+inline cv::Mat workspace_mat(Workspace* workspace, const std::string& name,
+                             cv::Size size, int type)
+{
+    if (workspace == nullptr) {
+        return cv::Mat(size, type);
+    }
+    return workspace->get(name, size, type);
+}
+
+/* a size by type view of the top left of buffer, which only grows, so
+ * regions of changing sizes don't allocate once the largest was seen.
+ * the view is not continuous when it is narrower than buffer */
+inline cv::Mat buffer_view(cv::Mat& buffer, cv::Size size, int type)
+{
+    if (buffer.type() != type || buffer.rows < size.height
+        || buffer.cols < size.width) {
+        buffer.create(std::max(buffer.rows, size.height),
+                      std::max(buffer.cols, size.width), type);
+    }
+    return buffer(cv::Rect(cv::Point(0, 0), size));
+}
+
 /* this class controls the setup and activity of an algorithm that takes a
  * single input and has a main output
  *
@@ -57,9 +272,51 @@ public:
 
     std::string doc = "Usage: algorithm [<algorithm> [<args>...]]";
 
+    /* scratch buffers reused by process_frame */
+    Workspace workspace;
+
     virtual void process_frame(const cv::Mat& in, cv::Mat& out,
                                std::string prefix="") = 0;
 
+    /* formats process_frame works on without converting them, the one it
+     * is cheapest on first. chains convert frames in other formats before
+     * they get here, see ChainInputs */
+    virtual std::vector<PixelFormat> input_formats()
+    {
+        return {PIXELS_BGR8};
+    }
+
+    /* format of the output for an input format */
+    virtual PixelFormat output_format(PixelFormat input) { return input; }
+
+    /* how far from a changed input pixel process_dirty has to update the
+     * output */
+    virtual int halo() { return 0; }
+
+    /* update out, the output of the previous frame, in the dirty
+     * rectangles, which never overlap. the input changed no further than
+     * halo() from them. returns false when other parts of the output may
+     * have changed too. by default the whole frame is processed again */
+    virtual bool process_dirty(const cv::Mat& in, cv::Mat& out,
+                               const std::vector<cv::Rect>& dirty,
+                               std::string prefix="")
+    {
+        process_frame(in, out, prefix);
+        return false;
+    }
+
+    /* forget what was kept from the frames with this prefix, the next one
+     * starts a new sequence, like an unrelated image of a batch */
+    virtual void reset(const std::string& prefix) { }
+
+    /* lower quality levels the algorithm can process frames at when they
+     * run over budget, each cheaper than the one before */
+    virtual int quality_levels() { return 0; }
+
+    /* level the next frames are processed at, from 0 for full quality to
+     * quality_levels() */
+    int quality = 0;
+
     inline virtual std::map<std::string, docopt::value>
     parse_arguments(std::map<std::string, docopt::value> main_args,
                     std::vector<std::string> argv)
@@ -70,4 +327,64 @@ public:
     }
 };
 
+typedef std::vector<std::shared_ptr<FrameAlgorithm>> AlgorithmChain;
+
+/* the frames each algorithm of a chain gets from the one before it
+ *
+ * a frame is passed on as it is when the algorithm takes its format, and is
+ * converted to the first format the algorithm takes otherwise. an algorithm
+ * whose output keeps the format of its input, like a convolution, only
+ * takes the format the next one works on best of those it takes too. so a
+ * blur before edge detection runs on the gray image rather than on every
+ * channel, and its output needs no conversion. conversions go through a
+ * FrameCache for each algorithm, which keeps the buffers between frames.
+ * the algorithms must be set up before, and each input must only be asked
+ * for by one thread at a time */
+class ChainInputs {
+public:
+    explicit ChainInputs(const AlgorithmChain& chain)
+        : formats(chain.size()), caches(chain.size())
+    {
+        for (size_t i = chain.size(); i-- > 0;) {
+            formats[i] = chain[i]->input_formats();
+            if (i + 1 == chain.size()) {
+                continue;
+            }
+            bool keeps_format = true;
+            for (PixelFormat f: formats[i]) {
+                keeps_format = keeps_format && chain[i]->output_format(f) == f;
+            }
+            for (size_t n = 0; keeps_format && n < formats[i + 1].size(); n++) {
+                PixelFormat f = formats[i + 1][n];
+                if (std::find(formats[i].begin(), formats[i].end(), f)
+                    != formats[i].end()) {
+                    formats[i] = {f};
+                    break;
+                }
+            }
+        }
+    }
+
+    /* what algorithm i gets for a frame, images of other types than the
+     * pixel formats are passed on as they are */
+    const cv::Mat& input(size_t i, const cv::Mat& frame)
+    {
+        PixelFormat format;
+        if (!pixel_format(frame, format)
+            || std::find(formats[i].begin(), formats[i].end(), format)
+               != formats[i].end()) {
+            return frame;
+        }
+        caches[i].reset(frame);
+        const cv::Mat& converted = caches[i].get(formats[i].front());
+        return converted.empty() ? frame : converted;
+    }
+
+    /* formats each algorithm takes */
+    std::vector<std::vector<PixelFormat>> formats;
+
+private:
+    std::vector<FrameCache> caches;
+};
+
 #endif
@@ -0,0 +1,128 @@
+#include <cstdint>
+#include <fstream>
+
+#include "writer.hpp"
+#include "util.hpp"
+
+WriterOptions& writer_options()
+{
+    static WriterOptions options;
+    return options;
+}
+
+std::string image_extension(const WriterOptions& options)
+{
+    return options.format == WriterOptions::PFM ? ".pfm" : ".png";
+}
+
+bool write_pfm(const std::string& path, const cv::Mat& mat)
+{
+    if (mat.channels() != 1 && mat.channels() != 3) {
+        return false;
+    }
+    cv::Mat values;
+    mat.convertTo(values, CV_MAKETYPE(CV_32F, mat.channels()),
+                  mat.depth() == CV_8U ? 1 / 256.0 : 1);
+    if (values.channels() == 3) {
+        cv::cvtColor(values, values, CV_BGR2RGB);
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    /* a negative scale marks little endian data */
+    const uint16_t one = 1;
+    const bool little_endian = *(const uint8_t*)&one == 1;
+    file << (values.channels() == 3 ? "PF" : "Pf") << "\n"
+         << values.cols << " " << values.rows << "\n"
+         << (little_endian ? "-1.0" : "1.0") << "\n";
+
+    /* rows go from the bottom of the image to the top */
+    const size_t row_bytes = values.cols * values.elemSize();
+    for (int r = values.rows - 1; r >= 0; r--) {
+        file.write((const char*)values.ptr(r), row_bytes);
+    }
+    return (bool)file;
+}
+
+ImageWriter::ImageWriter(const WriterOptions& options)
+    : options(options), queue(options.capacity)
+{
+    for (int i = 0; i < std::max(options.threads, 1); i++) {
+        threads.push_back(std::thread([this]() { run(); }));
+    }
+}
+
+ImageWriter::~ImageWriter()
+{
+    flush();
+    queue.close();
+    for (auto& t: threads) {
+        t.join();
+    }
+}
+
+void ImageWriter::write(const std::string& path, const cv::Mat& mat)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending++;
+    }
+    /* algorithms reuse their buffers, so the image is copied */
+    Job job;
+    job.path = path;
+    job.image = mat.clone();
+    if (!queue.push(std::move(job))) {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending--;
+        failures++;
+        done.notify_all();
+    }
+}
+
+void ImageWriter::flush()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return pending == 0; });
+}
+
+long ImageWriter::failed()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return failures;
+}
+
+void ImageWriter::run()
+{
+    trace_thread_name("writer");
+    Job job;
+    while (queue.pop(job)) {
+        TRACE_SCOPE("write");
+        /* one string per line, so the lines of the writers don't mix */
+        if (!options.quiet) {
+            std::cout << "Writing to '" + job.path + "'\n" << std::flush;
+        }
+        bool ok;
+        try {
+            ok = write_mat(job.path, job.image, options);
+        } catch (cv::Exception&) {
+            ok = false;
+        }
+        if (!ok) {
+            std::cout << "Can't write '" + job.path + "'\n" << std::flush;
+        }
+        job.image.release();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        pending--;
+        failures += !ok;
+        done.notify_all();
+    }
+}
+
+ImageWriter& image_writer()
+{
+    static ImageWriter writer(writer_options());
+    return writer;
+}
@@ -0,0 +1,86 @@
+#ifndef _WRITER_HPP
+#define _WRITER_HPP
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "bounded_queue.hpp"
+
+/* how images are encoded when written
+ * PNG converts to 8 bits like the windows show them, compressed at
+ * png_compression from 0 to 9. PFM keeps the values as 32-bit floats,
+ * uncompressed. threads write images at once, and at most capacity wait
+ * for them before a write blocks. unless quiet, each path is printed by
+ * the thread that writes it */
+struct WriterOptions {
+    enum Format {
+        PNG,
+        PFM
+    };
+
+    Format format = PNG;
+    int png_compression = 3;
+    int threads = 1;
+    size_t capacity = 16;
+    bool quiet = false;
+};
+
+/* options of the shared writer, set them before the first write */
+WriterOptions& writer_options();
+
+/* file extension for the format, with the dot */
+std::string image_extension(const WriterOptions& options=writer_options());
+
+/* write a 1 or 3 channel image as a portable float map
+ * 8-bit images are scaled to [0, 1) like the float images algorithms use */
+bool write_pfm(const std::string& path, const cv::Mat& mat);
+
+/* writes images on its own threads
+ *
+ * write keeps a copy of the image and returns, so the caller does not
+ * wait for the conversion, encoding and disk. when the queue is full it
+ * waits for a writer instead of dropping the image. flush waits for every
+ * queued image, and is called on destruction */
+class ImageWriter {
+public:
+    explicit ImageWriter(const WriterOptions& options);
+    ~ImageWriter();
+
+    ImageWriter(const ImageWriter&) = delete;
+    ImageWriter& operator=(const ImageWriter&) = delete;
+
+    void write(const std::string& path, const cv::Mat& mat);
+
+    /* wait until every image written so far is on disk */
+    void flush();
+
+    /* number of images that could not be written */
+    long failed();
+
+    const WriterOptions options;
+
+private:
+    struct Job {
+        std::string path;
+        cv::Mat image;
+    };
+
+    void run();
+
+    BoundedQueue<Job> queue;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable done;
+    long pending = 0;
+    long failures = 0;
+};
+
+/* the writer shared by save_mat, made with writer_options() on first use */
+ImageWriter& image_writer();
+
+#endif
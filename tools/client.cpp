@@ -0,0 +1,172 @@
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../lib/docopt.cpp/docopt.h"
+#include "../src/util.hpp"
+#include "../src/server.hpp"
+
+using namespace cv;
+
+std::string doc =
+R"(Usage: composer_client <socket> [--image=<path>] [--output=<path>]
+                       [--format=<fmt>] [--frames=<n>] [--in-flight=<n>]
+                       [--stats]
+       composer_client --help
+
+Sends an image to composer --serve as frames in shared memory, and prints
+how long the server took to answer. The result of the last frame can be
+written to a file.
+
+Options:
+  -i <path> --image=<path>  Image to send.
+  -o <path> --output=<path> Write the result of the last frame.
+  --format=<fmt>            Format of the result: bgr8, gray8, gray32f or
+                            labels32s [default: bgr8].
+  --frames=<n>              Frames to send [default: 1].
+  --in-flight=<n>           Frames sent before waiting for replies
+                            [default: 1].
+  --stats                   Print the statistics of the server.
+  -h --help                 Show this message.
+)";
+
+int main(int argc, char** argv)
+{
+    auto args = docopt::docopt(doc, {argv + 1, argv + argc}, true, "");
+    const std::string path = args["<socket>"].asString();
+    int s = serve_connect(path);
+    if (s < 0) {
+        std::cout << "Can't connect to '" << path << "': "
+                  << std::strerror(errno) << std::endl;
+        return 1;
+    }
+
+    int status = 0;
+    if (args["--image"].isString()) {
+        Mat image = imread(args["--image"].asString(), IMREAD_COLOR);
+        if (image.empty()) {
+            std::cout << "Can't read '" << args["--image"].asString() << "'"
+                      << std::endl;
+            return 1;
+        }
+        std::map<std::string, PixelFormat> formats = {
+            {"bgr8", PIXELS_BGR8}, {"gray8", PIXELS_GRAY8},
+            {"gray32f", PIXELS_GRAY32F}, {"labels32s", PIXELS_LABELS32S}
+        };
+        std::string format_name = args["--format"].asString();
+        if (formats.count(format_name) == 0) {
+            std::cout << "format '" << format_name << "' unknown" << std::endl;
+            return 1;
+        }
+        PixelFormat format = formats[format_name];
+        const long frames = std::max(1, (int)docopt_to_float(args, "--frames", 1));
+        const int slots = std::max(1, (int)docopt_to_float(args, "--in-flight", 1));
+
+        /* a slot of input and output for each frame in flight */
+        const size_t in_bytes = buffer_bytes(image.cols, image.rows, PIXELS_BGR8);
+        const size_t out_bytes = buffer_bytes(image.cols, image.rows, format);
+        const size_t slot_bytes = in_bytes + out_bytes;
+        int fd = shared_memory(slot_bytes * slots);
+        void* map = fd < 0 ? MAP_FAILED
+                  : mmap(nullptr, slot_bytes * slots, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            std::cout << "Can't create shared memory: " << std::strerror(errno)
+                      << std::endl;
+            return 1;
+        }
+        for (int i = 0; i < slots; i++) {
+            Mat in(image.size(), CV_8UC3, (uchar*)map + i * slot_bytes);
+            image.copyTo(in);
+        }
+
+        /* replies may come in any order, so slots are freed by id */
+        std::vector<int> free_slots;
+        for (int i = slots - 1; i >= 0; i--) {
+            free_slots.push_back(i);
+        }
+        std::map<uint64_t, int> slot_of;
+        std::vector<int64> sent(slots);
+        std::vector<double> latencies;
+        long next = 0;
+        int last_ok = -1;
+        for (long done = 0; done < frames && status == 0; done++) {
+            /* keep every slot busy, then wait for any of them */
+            while (next < frames && !free_slots.empty()) {
+                int slot = free_slots.back();
+                free_slots.pop_back();
+                ServeRequest request;
+                request.id = next;
+                request.width = image.cols;
+                request.height = image.rows;
+                request.in_format = PIXELS_BGR8;
+                request.out_format = format;
+                request.in_offset = slot * slot_bytes;
+                request.out_offset = request.in_offset + in_bytes;
+                slot_of[request.id] = slot;
+                sent[slot] = getTickCount();
+                /* the server keeps the memory mapped after the first frame */
+                if (!serve_send(s, request, next == 0 ? fd : -1)) {
+                    std::cout << "Lost the server" << std::endl;
+                    return 1;
+                }
+                next++;
+            }
+            ServeReply reply;
+            if (!serve_receive(s, reply)) {
+                std::cout << "Lost the server" << std::endl;
+                return 1;
+            }
+            if (slot_of.count(reply.id) == 0) {
+                std::cout << "Unexpected reply " << reply.id << std::endl;
+                return 1;
+            }
+            int slot = slot_of[reply.id];
+            slot_of.erase(reply.id);
+            free_slots.push_back(slot);
+            latencies.push_back((getTickCount() - sent[slot]) * 1000.0
+                                / getTickFrequency());
+            if (reply.status != SERVE_OK) {
+                std::cout << "Frame " << reply.id << " failed: "
+                          << reply.message << std::endl;
+                status = 1;
+            } else {
+                last_ok = slot;
+            }
+        }
+
+        std::sort(latencies.begin(), latencies.end());
+        std::cout << latencies.size() << " frames, median "
+                  << latencies[latencies.size() / 2] << " ms, 99th percentile "
+                  << latencies[latencies.size() * 99 / 100] << " ms"
+                  << std::endl;
+        if (args["--output"].isString() && last_ok >= 0) {
+            PixelBuffer out;
+            out.data = (uchar*)map + last_ok * slot_bytes + in_bytes;
+            out.width = image.cols;
+            out.height = image.rows;
+            out.format = format;
+            write_mat(args["--output"].asString(), wrap_buffer(out));
+        }
+        munmap(map, slot_bytes * slots);
+        close(fd);
+    }
+
+    if (args["--stats"].asBool()) {
+        ServeRequest request;
+        request.type = SERVE_STATS;
+        ServeReply reply;
+        if (!serve_send(s, request) || !serve_receive(s, reply)) {
+            std::cout << "Lost the server" << std::endl;
+            return 1;
+        }
+        std::cout << reply.message << std::endl;
+    }
+    close(s);
+    return status;
+}